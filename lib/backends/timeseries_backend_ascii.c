@@ -206,15 +206,16 @@ void timeseries_backend_ascii_kp_free(timeseries_backend_t *backend,
 }
 
 int timeseries_backend_ascii_kp_ki_update(timeseries_backend_t *backend,
-                                          timeseries_kp_t *kp)
+                                          timeseries_kp_t *kp,
+                                          uint32_t first_id, uint32_t end_id)
 {
   /* we don't need to do anything */
   return 0;
 }
 
 void timeseries_backend_ascii_kp_ki_free(timeseries_backend_t *backend,
-                                         timeseries_kp_t *kp,
-                                         timeseries_kp_ki_t *ki, void *ki_state)
+                                         timeseries_kp_t *kp, uint32_t ki_id,
+                                         void *ki_state)
 {
   /* we did not allocate any state */
   assert(ki_state == NULL);
@@ -239,8 +240,7 @@ int timeseries_backend_ascii_kp_flush(timeseries_backend_t *backend,
                                       timeseries_kp_t *kp, uint32_t time)
 {
   timeseries_backend_ascii_state_t *state = STATE(backend);
-  timeseries_kp_ki_t *ki = NULL;
-  int id;
+  uint32_t id;
 
   /* there are at most 10 digits in a 32bit unix time value, plus the nul */
   char time_buffer[11];
@@ -248,12 +248,10 @@ int timeseries_backend_ascii_kp_flush(timeseries_backend_t *backend,
   /* we really only need to convert the time value to a string once */
   snprintf(time_buffer, 11, "%" PRIu32, time);
 
-  TIMESERIES_KP_FOREACH_KI(kp, ki, id)
+  TIMESERIES_KP_FOREACH_ENABLED_KI(kp, id)
   {
-    if (timeseries_kp_ki_enabled(ki) != 0) {
-      DUMP_METRIC(state, timeseries_kp_ki_get_key(ki),
-                  timeseries_kp_ki_get_value(ki), time_buffer);
-    }
+    DUMP_METRIC(state, timeseries_kp_ki_get_key(kp, id),
+                timeseries_kp_ki_get_value(kp, id), time_buffer);
   }
 
   return 0;
@@ -283,6 +281,12 @@ int timeseries_backend_ascii_set_single_by_id(timeseries_backend_t *backend,
   return timeseries_backend_ascii_set_single(backend, (char *)id, value, time);
 }
 
+int timeseries_backend_ascii_flush(timeseries_backend_t *backend)
+{
+  /* single values are written as soon as they are set */
+  return 0;
+}
+
 int timeseries_backend_ascii_set_bulk_init(timeseries_backend_t *backend,
                                            uint32_t key_cnt, uint32_t time)
 {
@@ -343,3 +347,26 @@ int timeseries_backend_ascii_resolve_key_bulk(
 
   return 0;
 }
+
+int timeseries_backend_ascii_get_stats(timeseries_backend_t *backend,
+                                       timeseries_backend_stats_cb_t *cb,
+                                       void *user)
+{
+  /* we don't keep any statistics */
+  return 0;
+}
+
+timeseries_backend_conn_state_t
+timeseries_backend_ascii_conn_state(timeseries_backend_t *backend)
+{
+  /* the output file is opened by init */
+  return TIMESERIES_BACKEND_CONN_CONNECTED;
+}
+
+timeseries_kp_flush_status_t
+timeseries_backend_ascii_flush_status(timeseries_backend_t *backend,
+                                      uint32_t time, int wait)
+{
+  /* the values are written by kp_flush */
+  return TIMESERIES_KP_FLUSH_DELIVERED;
+}
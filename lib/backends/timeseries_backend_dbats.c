@@ -42,6 +42,7 @@
 #include <db.h> // for DB_LOCK_DEADLOCK
 #include <dbats.h>
 
+#include "khash.h"
 #include "utils.h"
 
 #include "timeseries_backend_int.h"
@@ -59,6 +60,50 @@
 
 #define STATE(provname) (TIMESERIES_BACKEND_STATE(dbats, provname))
 
+/** Maximum number of keys to resolve in a single bulk DBATS lookup (each
+    lookup is a single transaction, so this bounds the transaction size) */
+#define KEY_LOOKUP_CHUNK_LEN 10000
+
+/** Number of times to attempt a bulk key lookup before giving up */
+#define KEY_LOOKUP_RETRIES 60
+
+/** Initial delay (in usec) before retrying a deadlocked transaction */
+#define DEADLOCK_BACKOFF_MIN 1000
+
+/** Maximum delay (in usec) before retrying a deadlocked transaction */
+#define DEADLOCK_BACKOFF_MAX 1000000
+
+/** Default number of single values to buffer before writing them */
+#define SINGLE_MAX_DEFAULT 10000
+
+/** Default maximum time (in msec) to buffer single values for */
+#define SINGLE_DELAY_DEFAULT 1000
+
+/** Default number of key IDs to cache for set_single */
+#define KEY_CACHE_SIZE_DEFAULT 65536
+
+/** Marks the end of the key cache LRU list */
+#define KEY_CACHE_NONE UINT32_MAX
+
+/** An entry in the key -> DBATS ID cache */
+typedef struct key_cache_entry {
+  /** The key (owned by the cache) */
+  char *key;
+
+  /** The DBATS ID of the key */
+  uint32_t dbats_id;
+
+  /** Index of the next most recently used entry */
+  uint32_t prev;
+
+  /** Index of the next least recently used entry */
+  uint32_t next;
+
+} key_cache_entry_t;
+
+/** Map from key to index in the key cache entry array */
+KHASH_MAP_INIT_STR(keycache, uint32_t);
+
 /** The basic fields that every instance of this backend have in common */
 static timeseries_backend_t timeseries_backend_dbats = {
   TIMESERIES_BACKEND_ID_DBATS, BACKEND_NAME,
@@ -87,21 +132,100 @@ typedef struct timeseries_backend_dbats_state {
   /** The snapshot for the current bulk set */
   dbats_snapshot *bulk_snap;
 
+  /** Number of keys to write per transaction when flushing a KP (0 to write
+      all keys in a single transaction) */
+  uint32_t commit_chunk;
+
+  /** Number of transactions committed while flushing KPs */
+  uint64_t flush_commits;
+
+  /** Number of deadlocked transactions retried while flushing KPs */
+  uint64_t flush_retries;
+
+  /** Number of values that were written in transactions that then
+      deadlocked (and so had to be written again) */
+  uint64_t flush_wasted_writes;
+
+  /** Maximum number of single values to buffer before writing them */
+  uint32_t single_max;
+
+  /** Maximum time (in msec) to buffer single values for (0 for no limit) */
+  uint32_t single_delay;
+
+  /** DBATS IDs of the buffered single values */
+  uint32_t *single_ids;
+
+  /** Buffered single values */
+  uint64_t *single_values;
+
+  /** Number of buffered single values */
+  uint32_t single_cnt;
+
+  /** The time slot of the buffered single values */
+  uint32_t single_time;
+
+  /** When (in msec) the first of the buffered single values was set */
+  uint64_t single_start;
+
+  /** Number of transactions committed while writing single values */
+  uint64_t single_commits;
+
+  /** Number of buffered single values discarded because they could not be
+      written */
+  uint64_t single_dropped;
+
+  /** Maximum number of entries in the key cache (0 to disable it) */
+  uint32_t key_cache_size;
+
+  /** Key cache entries (key_cache_cnt of key_cache_size are in use) */
+  key_cache_entry_t *key_cache;
+
+  /** Number of key cache entries in use */
+  uint32_t key_cache_cnt;
+
+  /** Index of the most recently used key cache entry */
+  uint32_t key_cache_head;
+
+  /** Index of the least recently used key cache entry */
+  uint32_t key_cache_tail;
+
+  /** Map from key to key cache entry */
+  khash_t(keycache) * key_cache_hash;
+
+  /** Number of set_single keys found in the key cache */
+  uint64_t key_cache_hits;
+
+  /** Number of set_single keys that had to be looked up in DBATS */
+  uint64_t key_cache_misses;
+
 } timeseries_backend_dbats_state_t;
 
 /** Print usage information to stderr */
 static void usage(timeseries_backend_t *backend)
 {
   fprintf(stderr,
-          "backend usage: %s [-f flag [-f flag]] -p path\n"
+          "backend usage: %s [-c keys] [-d msec] [-f flag [-f flag]] "
+          "[-k keys] [-s values] -p path\n"
+          "       -c <keys>     commit KP flushes every <keys> keys, resuming\n"
+          "                       from the last commit on deadlock\n"
+          "                       (default: one commit per flush)\n"
+          "       -d <msec>     write buffered single values once the oldest\n"
+          "                       is <msec> old (checked when values are set,\n"
+          "                       0 for no limit) (default: %d)\n"
           "       -f <flag>     flag(s) to use when opening database\n"
           "                       - " FLAG_UNCOMPRESSED "\n"
           "                       - " FLAG_EXCLUSIVE "\n"
           "                       - " FLAG_NO_TXN "\n"
           "                       - " FLAG_UPDATABLE "\n"
           "                       (see DBATS documentation for more info)\n"
-          "       -p <path>     path to an existing DBATS database directory\n",
-          backend->name);
+          "       -k <keys>     number of key IDs to cache for single values\n"
+          "                       (0 to disable) (default: %d)\n"
+          "       -p <path>     path to an existing DBATS database directory\n"
+          "       -s <values>   number of single values to buffer before\n"
+          "                       writing them (1 to write each value as it\n"
+          "                       is set) (default: %d)\n",
+          backend->name, SINGLE_DELAY_DEFAULT, KEY_CACHE_SIZE_DEFAULT,
+          SINGLE_MAX_DEFAULT);
 }
 
 /** Parse the arguments given to the backend */
@@ -117,9 +241,17 @@ static int parse_args(timeseries_backend_t *backend, int argc, char **argv)
 
   /* remember the argv strings DO NOT belong to us */
 
-  while ((opt = getopt(argc, argv, ":f:p:?")) >= 0) {
+  while ((opt = getopt(argc, argv, ":c:d:f:k:p:s:?")) >= 0) {
     switch (opt) {
 
+    case 'c':
+      state->commit_chunk = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'd':
+      state->single_delay = strtoul(optarg, NULL, 10);
+      break;
+
     case 'f':
       if (strncmp(optarg, FLAG_UNCOMPRESSED, strlen(FLAG_UNCOMPRESSED)) == 0) {
         state->dbats_flags |= DBATS_UNCOMPRESSED;
@@ -136,10 +268,18 @@ static int parse_args(timeseries_backend_t *backend, int argc, char **argv)
       }
       break;
 
+    case 'k':
+      state->key_cache_size = strtoul(optarg, NULL, 10);
+      break;
+
     case 'p':
       state->dbats_path = strdup(optarg);
       break;
 
+    case 's':
+      state->single_max = strtoul(optarg, NULL, 10);
+      break;
+
     case '?':
     case ':':
     default:
@@ -154,6 +294,317 @@ static int parse_args(timeseries_backend_t *backend, int argc, char **argv)
     return -1;
   }
 
+  if (state->single_max == 0) {
+    fprintf(stderr, "ERROR: At least one single value must be buffered\n");
+    usage(backend);
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Resolve (creating if needed) the DBATS IDs for the given keys
+ *
+ * @param backend       Pointer to the DBATS backend
+ * @param keys_cnt      Number of keys to resolve
+ * @param keys          Array of keys to resolve
+ * @param dbats_ids     Array to fill with the DBATS ID of each key
+ * @return 0 if all keys were resolved, -1 otherwise
+ */
+static int bulk_get_key_id(timeseries_backend_t *backend, uint32_t keys_cnt,
+                           const char *const *keys, uint32_t *dbats_ids)
+{
+  timeseries_backend_dbats_state_t *state = STATE(backend);
+  uint32_t dbats_keys_cnt;
+  /* hax until we get deadlock retries into DBATS */
+  int retries = KEY_LOOKUP_RETRIES;
+  int rc;
+
+  /* ask dbats to do the lookup */
+  do {
+    dbats_keys_cnt = keys_cnt; /* reset the number of keys to resolve */
+    rc = dbats_bulk_get_key_id(state->dbats_handler, NULL, &dbats_keys_cnt,
+                               keys, dbats_ids, DBATS_CREATE);
+    if (rc != 0) {
+      retries--;
+      if (retries == 0) {
+        timeseries_log(__func__,
+                       "Could not resolve DBATS key IDs after %d retries",
+                       KEY_LOOKUP_RETRIES);
+        return -1;
+      } else {
+        timeseries_log(__func__, "Retrying key lookup for %" PRIu32 " keys",
+                       dbats_keys_cnt);
+      }
+    }
+  } while (rc != 0);
+
+  assert(dbats_keys_cnt == keys_cnt);
+  return 0;
+}
+
+/** Sleep before retrying a deadlocked transaction
+ *
+ * @param attempt       Number of times the transaction has already deadlocked
+ *
+ * The delay doubles with each attempt, up to DEADLOCK_BACKOFF_MAX.
+ */
+static void deadlock_backoff(int attempt)
+{
+  useconds_t delay = DEADLOCK_BACKOFF_MIN;
+
+  while (attempt-- > 0 && delay < DEADLOCK_BACKOFF_MAX) {
+    delay *= 2;
+  }
+  if (delay > DEADLOCK_BACKOFF_MAX) {
+    delay = DEADLOCK_BACKOFF_MAX;
+  }
+
+  usleep(delay);
+}
+
+/** Get the current time in msec */
+static uint64_t now_msec()
+{
+  struct timeval tv;
+  gettimeofday_wrap(&tv);
+  return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+/** Remove the given entry from the key cache LRU list */
+static void key_cache_unlink(timeseries_backend_dbats_state_t *state,
+                             uint32_t idx)
+{
+  key_cache_entry_t *entry = &state->key_cache[idx];
+
+  if (entry->prev != KEY_CACHE_NONE) {
+    state->key_cache[entry->prev].next = entry->next;
+  } else {
+    state->key_cache_head = entry->next;
+  }
+  if (entry->next != KEY_CACHE_NONE) {
+    state->key_cache[entry->next].prev = entry->prev;
+  } else {
+    state->key_cache_tail = entry->prev;
+  }
+}
+
+/** Insert the given entry at the front of the key cache LRU list */
+static void key_cache_push(timeseries_backend_dbats_state_t *state,
+                           uint32_t idx)
+{
+  key_cache_entry_t *entry = &state->key_cache[idx];
+
+  entry->prev = KEY_CACHE_NONE;
+  entry->next = state->key_cache_head;
+  if (state->key_cache_head != KEY_CACHE_NONE) {
+    state->key_cache[state->key_cache_head].prev = idx;
+  } else {
+    state->key_cache_tail = idx;
+  }
+  state->key_cache_head = idx;
+}
+
+/** Get the DBATS ID for the given key, using (and updating) the key cache
+ *
+ * @param backend       Pointer to the DBATS backend
+ * @param key           Key to get the ID for
+ * @param dbats_id[out] Set to the DBATS ID of the key
+ * @return 0 if the key was resolved, -1 otherwise
+ */
+static int key_cache_get(timeseries_backend_t *backend, const char *key,
+                         uint32_t *dbats_id)
+{
+  timeseries_backend_dbats_state_t *state = STATE(backend);
+  key_cache_entry_t *entry;
+  char *key_cpy;
+  khiter_t k, evict;
+  uint32_t idx;
+  int khret;
+
+  if (state->key_cache_size == 0) {
+    return bulk_get_key_id(backend, 1, &key, dbats_id);
+  }
+
+  if ((k = kh_get(keycache, state->key_cache_hash, key)) !=
+      kh_end(state->key_cache_hash)) {
+    state->key_cache_hits++;
+    idx = kh_val(state->key_cache_hash, k);
+    if (idx != state->key_cache_head) {
+      key_cache_unlink(state, idx);
+      key_cache_push(state, idx);
+    }
+    *dbats_id = state->key_cache[idx].dbats_id;
+    return 0;
+  }
+
+  state->key_cache_misses++;
+  if (bulk_get_key_id(backend, 1, &key, dbats_id) != 0) {
+    return -1;
+  }
+
+  if ((key_cpy = strdup(key)) == NULL) {
+    /* we have the ID, we just can't cache it */
+    return 0;
+  }
+
+  /* add the key to the hash first, so that a failure leaves the cache as it
+     was (deleting the evicted entry below does not move the new one) */
+  k = kh_put(keycache, state->key_cache_hash, key_cpy, &khret);
+  if (khret < 0) {
+    free(key_cpy);
+    return 0;
+  }
+
+  /* use a free entry if there is one, otherwise evict the LRU entry */
+  if (state->key_cache_cnt < state->key_cache_size) {
+    idx = state->key_cache_cnt++;
+  } else {
+    idx = state->key_cache_tail;
+    key_cache_unlink(state, idx);
+    evict = kh_get(keycache, state->key_cache_hash, state->key_cache[idx].key);
+    assert(evict != kh_end(state->key_cache_hash));
+    kh_del(keycache, state->key_cache_hash, evict);
+    free(state->key_cache[idx].key);
+  }
+  entry = &state->key_cache[idx];
+
+  entry->key = key_cpy;
+  entry->dbats_id = *dbats_id;
+  kh_val(state->key_cache_hash, k) = idx;
+  key_cache_push(state, idx);
+
+  return 0;
+}
+
+/** Free the key cache */
+static void key_cache_free(timeseries_backend_dbats_state_t *state)
+{
+  uint32_t i;
+
+  for (i = 0; i < state->key_cache_cnt; i++) {
+    free(state->key_cache[i].key);
+  }
+  free(state->key_cache);
+  state->key_cache = NULL;
+  state->key_cache_cnt = 0;
+
+  if (state->key_cache_hash != NULL) {
+    kh_destroy(keycache, state->key_cache_hash);
+    state->key_cache_hash = NULL;
+  }
+}
+
+/** Write the buffered single values to DBATS in a single transaction
+ *
+ * @param backend       Pointer to the DBATS backend
+ * @return 0 if the values were written, -1 otherwise
+ *
+ * If a set or commit deadlocks, all the buffered values are written again.
+ * On any other error the buffered values are discarded, so that they cannot
+ * fail every later write.
+ */
+static int single_commit(timeseries_backend_t *backend)
+{
+  timeseries_backend_dbats_state_t *state = STATE(backend);
+  dbats_snapshot *snapshot;
+  dbats_value val;
+  uint32_t i;
+  int attempt = 0;
+  int rc;
+
+  if (state->single_cnt == 0) {
+    return 0;
+  }
+
+  while (1) {
+    if (dbats_select_snap(state->dbats_handler, &snapshot, state->single_time,
+                          0) != 0) {
+      timeseries_log(__func__, "dbats_select_snap failed");
+      goto err;
+    }
+
+    rc = 0;
+    for (i = 0; i < state->single_cnt; i++) {
+      val.u64 = state->single_values[i];
+      if ((rc = dbats_set(snapshot, state->single_ids[i], &val)) != 0) {
+        dbats_abort_snap(snapshot);
+        if (rc != DB_LOCK_DEADLOCK) {
+          timeseries_log(__func__, "dbats_set failed");
+          goto err;
+        }
+        break;
+      }
+    }
+
+    if (rc == 0 && (rc = dbats_commit_snap(snapshot)) == 0) {
+      state->single_commits++;
+      state->single_cnt = 0;
+      return 0;
+    }
+
+    if (rc != DB_LOCK_DEADLOCK) {
+      timeseries_log(__func__, "dbats_commit_snap failed");
+      goto err;
+    }
+
+    timeseries_log(__func__,
+                   "deadlock writing %" PRIu32 " single values, retrying",
+                   state->single_cnt);
+    deadlock_backoff(attempt++);
+  }
+
+err:
+  timeseries_log(__func__,
+                 "discarding %" PRIu32 " single values for time %" PRIu32,
+                 state->single_cnt, state->single_time);
+  state->single_dropped += state->single_cnt;
+  state->single_cnt = 0;
+  return -1;
+}
+
+/** Buffer a single value, writing the buffer if it is due
+ *
+ * @param backend       Pointer to the DBATS backend
+ * @param dbats_id      DBATS ID of the key to set
+ * @param value         Value to set
+ * @param time          Time slot to set the value for
+ * @return 0 if the value was buffered (or written), -1 otherwise
+ *
+ * The buffer is written before a value for a different time slot is
+ * buffered, and after adding a value fills it or makes it older than the
+ * configured delay. If writing the earlier values fails, they are discarded
+ * and the new value is not buffered.
+ */
+static int single_buffer(timeseries_backend_t *backend, uint32_t dbats_id,
+                         uint64_t value, uint32_t time)
+{
+  timeseries_backend_dbats_state_t *state = STATE(backend);
+
+  if (state->single_cnt > 0 &&
+      (state->single_time != time || state->single_cnt == state->single_max) &&
+      single_commit(backend) != 0) {
+    return -1;
+  }
+
+  if (state->single_cnt == 0) {
+    state->single_time = time;
+    if (state->single_delay != 0) {
+      state->single_start = now_msec();
+    }
+  }
+
+  assert(state->single_cnt < state->single_max);
+  state->single_ids[state->single_cnt] = dbats_id;
+  state->single_values[state->single_cnt] = value;
+  state->single_cnt++;
+
+  if (state->single_cnt == state->single_max ||
+      (state->single_delay != 0 &&
+       now_msec() - state->single_start >= state->single_delay)) {
+    return single_commit(backend);
+  }
+
   return 0;
 }
 
@@ -177,11 +628,33 @@ int timeseries_backend_dbats_init(timeseries_backend_t *backend, int argc,
   }
   timeseries_backend_register_state(backend, state);
 
+  state->single_max = SINGLE_MAX_DEFAULT;
+  state->single_delay = SINGLE_DELAY_DEFAULT;
+  state->key_cache_size = KEY_CACHE_SIZE_DEFAULT;
+  state->key_cache_head = KEY_CACHE_NONE;
+  state->key_cache_tail = KEY_CACHE_NONE;
+
   /* parse the command line args */
   if (parse_args(backend, argc, argv) != 0) {
     return -1;
   }
 
+  if ((state->single_ids = malloc(sizeof(uint32_t) * state->single_max)) ==
+        NULL ||
+      (state->single_values = malloc(sizeof(uint64_t) * state->single_max)) ==
+        NULL) {
+    timeseries_log(__func__, "could not malloc single value buffer");
+    return -1;
+  }
+
+  if (state->key_cache_size != 0 &&
+      ((state->key_cache = malloc(sizeof(key_cache_entry_t) *
+                                  state->key_cache_size)) == NULL ||
+       (state->key_cache_hash = kh_init(keycache)) == NULL)) {
+    timeseries_log(__func__, "could not malloc key cache");
+    return -1;
+  }
+
   /* can we open the dbats db now?? */
   /* the two parameters that we specify with 0's are only used when creating a
      DB */
@@ -220,6 +693,15 @@ void timeseries_backend_dbats_free(timeseries_backend_t *backend)
       state->bulk_snap = NULL;
     }
 
+    /* a failure is logged (and the values discarded) by single_commit */
+    single_commit(backend);
+    free(state->single_ids);
+    state->single_ids = NULL;
+    free(state->single_values);
+    state->single_values = NULL;
+
+    key_cache_free(state);
+
     if (state->dbats_handler != NULL) {
       dbats_close(state->dbats_handler);
       state->dbats_handler = NULL;
@@ -250,48 +732,57 @@ void timeseries_backend_dbats_kp_free(timeseries_backend_t *backend,
 }
 
 int timeseries_backend_dbats_kp_ki_update(timeseries_backend_t *backend,
-                                          timeseries_kp_t *kp)
+                                          timeseries_kp_t *kp,
+                                          uint32_t first_id, uint32_t end_id)
 {
-  timeseries_backend_dbats_state_t *state = STATE(backend);
-  timeseries_kp_ki_t *ki = NULL;
-  int id;
-  uint32_t *dbats_id;
+  uint32_t chunk_len = end_id - first_id;
+  uint32_t *dbats_ids;
+  const char **keys;
+  uint32_t id, cnt, i;
+  int rc = -1;
+
+  if (first_id >= end_id) {
+    return 0;
+  }
+  if ((dbats_ids = timeseries_kp_ki_backend_ids(
+         kp, TIMESERIES_BACKEND_ID_DBATS)) == NULL) {
+    return -1;
+  }
 
-  /* foreach KI, if the backend state is null, get the key id */
-  TIMESERIES_KP_FOREACH_KI(kp, ki, id)
-  {
-    if (timeseries_kp_ki_enabled(ki) == 0 ||
-        timeseries_kp_ki_get_backend_state(ki, TIMESERIES_BACKEND_ID_DBATS) !=
-          NULL) {
-      continue;
-    }
+  if (chunk_len > KEY_LOOKUP_CHUNK_LEN) {
+    chunk_len = KEY_LOOKUP_CHUNK_LEN;
+  }
+  if ((keys = malloc(sizeof(char *) * chunk_len)) == NULL) {
+    timeseries_log(__func__, "Could not allocate DBATS Key array");
+    return -1;
+  }
 
-    if ((dbats_id = malloc(sizeof(uint32_t))) == NULL) {
-      timeseries_log(__func__, "Could not allocate DBATS Key");
-      return -1;
+  /* resolve the new KIs in chunks, straight into the ID column (if this
+     fails part-way, the whole range will be resolved again next time, which
+     is harmless) */
+  for (id = first_id; id < end_id; id += cnt) {
+    cnt = end_id - id < chunk_len ? end_id - id : chunk_len;
+    for (i = 0; i < cnt; i++) {
+      keys[i] = timeseries_kp_ki_get_key(kp, id + i);
     }
-
-    /* lookup this key */
-    /** @todo bulk key lookup */
-    if (dbats_get_key_id(state->dbats_handler, NULL,
-                         timeseries_kp_ki_get_key(ki), dbats_id,
-                         DBATS_CREATE) != 0) {
-      timeseries_log(__func__, "Could not resolve DBATS key ID");
-      return -1;
+    if (bulk_get_key_id(backend, cnt, keys, &dbats_ids[id]) != 0) {
+      goto done;
     }
-
-    timeseries_kp_ki_set_backend_state(ki, TIMESERIES_BACKEND_ID_DBATS,
-                                       dbats_id);
   }
-  return 0;
+
+  rc = 0;
+
+done:
+  free(keys);
+  return rc;
 }
 
 void timeseries_backend_dbats_kp_ki_free(timeseries_backend_t *backend,
-                                         timeseries_kp_t *kp,
-                                         timeseries_kp_ki_t *ki, void *ki_state)
+                                         timeseries_kp_t *kp, uint32_t ki_id,
+                                         void *ki_state)
 {
-  /* ki_state is a (uint32_t*) */
-  free(ki_state);
+  /* we did not allocate any state (IDs are stored in the KP ID column) */
+  assert(ki_state == NULL);
   return;
 }
 
@@ -302,139 +793,102 @@ int timeseries_backend_dbats_kp_flush(timeseries_backend_t *backend,
   dbats_snapshot *snapshot;
   dbats_value val;
   int rc;
-  timeseries_kp_ki_t *ki = NULL;
-  int id;
-  uint32_t *dbats_id;
-
-/* we re-enter here if the set deadlocks */
-retry:
-
-  /* select the snapshot */
-  if (dbats_select_snap(state->dbats_handler, &snapshot, time, 0) != 0) {
-    timeseries_log(__func__, "dbats_select_snap failed");
+  uint32_t id;
+  uint32_t *dbats_ids = NULL;
+  uint32_t resume_id = timeseries_kp_ki_next_enabled(kp, 0);
+  uint32_t sets;
+  int attempt = 0;
+
+  /* the ID column is created when the first keys are resolved (a background
+     flush must not create it, since the KP may be adding keys) */
+  if (timeseries_kp_ki_cnt(kp) > 0 &&
+      (dbats_ids = timeseries_kp_ki_backend_ids(
+         kp, TIMESERIES_BACKEND_ID_DBATS)) == NULL) {
     return -1;
   }
 
-  TIMESERIES_KP_FOREACH_KI(kp, ki, id)
-  {
-    if (timeseries_kp_ki_enabled(ki) == 0) {
-      continue;
+  /* write any buffered single values first so they cannot overwrite these
+     (if that fails they are discarded, which must not fail this flush) */
+  single_commit(backend);
+
+  /* each pass through this loop is one transaction that writes (at most)
+     commit_chunk keys, starting with the first key that has not yet been
+     committed. if a transaction deadlocks, only it needs to be redone. */
+  while (1) {
+    if (dbats_select_snap(state->dbats_handler, &snapshot, time, 0) != 0) {
+      timeseries_log(__func__, "dbats_select_snap failed");
+      return -1;
     }
 
-    dbats_id = (uint32_t *)timeseries_kp_ki_get_backend_state(
-      ki, TIMESERIES_BACKEND_ID_DBATS);
+    rc = 0;
+    sets = 0;
+    for (id = resume_id;
+         id < timeseries_kp_ki_cnt(kp) &&
+         (state->commit_chunk == 0 || sets < state->commit_chunk);
+         id = timeseries_kp_ki_next_enabled(kp, id + 1)) {
+      val.u64 = timeseries_kp_ki_get_value(kp, id);
+      if ((rc = dbats_set(snapshot, dbats_ids[id], &val)) != 0) {
+        dbats_abort_snap(snapshot);
+        if (rc != DB_LOCK_DEADLOCK) {
+          timeseries_log(__func__, "dbats_set failed");
+          return -1;
+        }
+        break;
+      }
+      sets++;
+    }
 
-    val.u64 = timeseries_kp_ki_get_value(ki);
-    if ((rc = dbats_set(snapshot, *dbats_id, &val)) != 0) {
-      dbats_abort_snap(snapshot);
-      if (rc == DB_LOCK_DEADLOCK) {
-        timeseries_log(__func__, "deadlock in dbats_set");
-        goto retry;
+    if (rc == 0 && (rc = dbats_commit_snap(snapshot)) == 0) {
+      state->flush_commits++;
+      if (id >= timeseries_kp_ki_cnt(kp)) {
+        return 0;
       }
-      timeseries_log(__func__, "dbats_set failed");
-      return -1;
+      resume_id = id;
+      attempt = 0;
+      continue;
     }
-  }
 
-  /* now we commit the snapshot */
-  if ((rc = dbats_commit_snap(snapshot)) != 0) {
-    if (rc == DB_LOCK_DEADLOCK) {
-      timeseries_log(__func__, "deadlock in dbats_commit_snap");
-      goto retry;
+    if (rc != DB_LOCK_DEADLOCK) {
+      timeseries_log(__func__, "dbats_commit_snap failed");
+      return -1;
     }
-    timeseries_log(__func__, "dbats_commit_snap failed");
-    return -1;
-  }
 
-  return 0;
+    timeseries_log(__func__,
+                   "deadlock after writing %" PRIu32 " keys, retrying", sets);
+    state->flush_retries++;
+    state->flush_wasted_writes += sets;
+    deadlock_backoff(attempt++);
+  }
 }
 
 int timeseries_backend_dbats_set_single(timeseries_backend_t *backend,
                                         const char *key, uint64_t value,
                                         uint32_t time)
 {
-  timeseries_backend_dbats_state_t *state = STATE(backend);
-  dbats_snapshot *snapshot;
-  dbats_value val;
-  int rc;
-
-/* we re-enter here if the set deadlocks */
-retry:
-
-  /* select the snapshot */
-  if (dbats_select_snap(state->dbats_handler, &snapshot, time, 0) != 0) {
-    timeseries_log(__func__, "dbats_select_snap failed");
-    return -1;
-  }
-
-  /* set the value */
-  if ((rc = dbats_set_by_key(snapshot, key, &val, DBATS_CREATE)) != 0) {
-    dbats_abort_snap(snapshot);
-    if (rc == DB_LOCK_DEADLOCK) {
-      timeseries_log(__func__, "deadlock in dbats_set_by_key");
-      goto retry;
-    }
-    timeseries_log(__func__, "dbats_set_by_key failed");
-    return -1;
-  }
+  uint32_t dbats_id;
 
-  /* commit the snapshot */
-  if ((rc = dbats_commit_snap(snapshot)) != 0) {
-    if (rc == DB_LOCK_DEADLOCK) {
-      timeseries_log(__func__, "deadlock in dbats_commit_snap");
-      goto retry;
-    }
-    timeseries_log(__func__, "dbats_commit_snap failed");
+  if (key_cache_get(backend, key, &dbats_id) != 0) {
     return -1;
   }
 
-  return 0;
+  return single_buffer(backend, dbats_id, value, time);
 }
 
 int timeseries_backend_dbats_set_single_by_id(timeseries_backend_t *backend,
                                               uint8_t *id, size_t id_len,
                                               uint64_t value, uint32_t time)
 {
-  timeseries_backend_dbats_state_t *state = STATE(backend);
-  dbats_snapshot *snapshot;
   uint32_t dbats_id;
-  dbats_value val;
-  int rc;
 
-/* we re-enter here if the set deadlocks */
-retry:
-
-  /* select the snapshot */
-  if (dbats_select_snap(state->dbats_handler, &snapshot, time, 0) != 0) {
-    timeseries_log(__func__, "dbats_select_snap failed");
-    return -1;
-  }
-
-  /* set the value */
   assert(id_len == sizeof(uint32_t));
   memcpy(&dbats_id, id, sizeof(uint32_t));
-  val.u64 = value;
-  if ((rc = dbats_set(snapshot, dbats_id, &val)) != 0) {
-    dbats_abort_snap(snapshot);
-    if (rc == DB_LOCK_DEADLOCK) {
-      timeseries_log(__func__, "deadlock in dbats_set_by_key");
-      goto retry;
-    }
-    timeseries_log(__func__, "dbats_set_by_key failed");
-    return -1;
-  }
 
-  /* commit the snapshot */
-  if ((rc = dbats_commit_snap(snapshot)) != 0) {
-    if (rc == DB_LOCK_DEADLOCK) {
-      timeseries_log(__func__, "deadlock in dbats_commit_snap");
-      goto retry;
-    }
-    timeseries_log(__func__, "dbats_commit_snap failed");
-    return -1;
-  }
+  return single_buffer(backend, dbats_id, value, time);
+}
 
-  return 0;
+int timeseries_backend_dbats_flush(timeseries_backend_t *backend)
+{
+  return single_commit(backend);
 }
 
 int timeseries_backend_dbats_set_bulk_init(timeseries_backend_t *backend,
@@ -444,6 +898,10 @@ int timeseries_backend_dbats_set_bulk_init(timeseries_backend_t *backend,
   assert(state->bulk_expect == 0 && state->bulk_cnt == 0 &&
          state->bulk_snap == NULL);
 
+  /* write any buffered single values first so they cannot overwrite these
+     (if that fails they are discarded, which must not fail this bulk set) */
+  single_commit(backend);
+
   state->bulk_expect = key_cnt;
   state->bulk_time = time;
 
@@ -528,14 +986,9 @@ int timeseries_backend_dbats_resolve_key_bulk(
   timeseries_backend_t *backend, uint32_t keys_cnt, const char *const *keys,
   uint8_t **backend_keys, size_t *backend_key_lens, int *contig_alloc)
 {
-  timeseries_backend_dbats_state_t *state = STATE(backend);
   int i;
 
   uint32_t *dbats_ids = NULL;
-  uint32_t dbats_keys_cnt = keys_cnt;
-
-  int retries = 60; // hax until we get deadlock retries into DBATS
-  int rc;
 
   /** allocate an array of uint32s to store the result from dbats */
   if ((dbats_ids = malloc(sizeof(uint32_t) * keys_cnt)) == NULL) {
@@ -543,25 +996,10 @@ int timeseries_backend_dbats_resolve_key_bulk(
     return -1;
   }
 
-  /* ask dbats to do the lookup */
-  do {
-    dbats_keys_cnt = keys_cnt; /* reset the number of keys to resolve */
-    rc = dbats_bulk_get_key_id(state->dbats_handler, NULL, &dbats_keys_cnt,
-                               keys, dbats_ids, DBATS_CREATE);
-    if (rc != 0) {
-      retries--;
-      if (retries == 0) {
-        timeseries_log(__func__,
-                       "Could not resolve DBATS key IDs after 60 retries");
-        return -1;
-      } else {
-        timeseries_log(__func__, "Retrying key lookup for %" PRIu32 " keys",
-                       dbats_keys_cnt);
-      }
-    }
-  } while (rc != 0);
-
-  assert(dbats_keys_cnt == keys_cnt);
+  if (bulk_get_key_id(backend, keys_cnt, keys, dbats_ids) != 0) {
+    free(dbats_ids);
+    return -1;
+  }
 
   for (i = 0; i < keys_cnt; i++) {
     backend_keys[i] = (uint8_t *)(&dbats_ids[i]);
@@ -573,3 +1011,35 @@ int timeseries_backend_dbats_resolve_key_bulk(
 
   return 0;
 }
+
+int timeseries_backend_dbats_get_stats(timeseries_backend_t *backend,
+                                       timeseries_backend_stats_cb_t *cb,
+                                       void *user)
+{
+  timeseries_backend_dbats_state_t *state = STATE(backend);
+
+  cb(backend, "flush_commits", state->flush_commits, user);
+  cb(backend, "flush_retries", state->flush_retries, user);
+  cb(backend, "flush_wasted_writes", state->flush_wasted_writes, user);
+  cb(backend, "single_commits", state->single_commits, user);
+  cb(backend, "single_dropped", state->single_dropped, user);
+  cb(backend, "key_cache_hits", state->key_cache_hits, user);
+  cb(backend, "key_cache_misses", state->key_cache_misses, user);
+
+  return 0;
+}
+
+timeseries_backend_conn_state_t
+timeseries_backend_dbats_conn_state(timeseries_backend_t *backend)
+{
+  /* the database is opened by init */
+  return TIMESERIES_BACKEND_CONN_CONNECTED;
+}
+
+timeseries_kp_flush_status_t
+timeseries_backend_dbats_flush_status(timeseries_backend_t *backend,
+                                      uint32_t time, int wait)
+{
+  /* the values are committed by kp_flush */
+  return TIMESERIES_KP_FLUSH_DELIVERED;
+}
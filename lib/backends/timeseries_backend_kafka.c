@@ -35,6 +35,7 @@
 #include "timeseries_kp_int.h"
 #include "timeseries_log_int.h"
 #include "config.h"
+#include "khash.h"
 #include "utils.h"
 #include <assert.h>
 #include <errno.h>
@@ -42,9 +43,12 @@
 #include <inttypes.h>
 #include <librdkafka/rdkafka.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <wandio.h>
 
@@ -59,15 +63,67 @@
 
 #define MESSAGE_VERSION 0
 
+/** Compact message version: keys are front-coded and lengths and values are
+    LEB128 varints (optionally delta-encoded) */
+#define MESSAGE_VERSION_V1 1
+
+/** Version 1 header flag: the message contains delta-encoded values */
+#define MESSAGE_FLAG_DELTA 0x01
+
+/** Version 1 header flag: records identify keys by their ID in the (KP's)
+    key dictionary named in the header, and only carry the key name when the
+    ID is (re-)defined */
+#define MESSAGE_FLAG_IDS 0x02
+
+/** Maximum length of a LEB128-encoded uint64 */
+#define VARINT_MAX_LEN 10
+
 /** use "unassigned" partition to automatically round-robin amongst
     partitions */
 #define DEFAULT_PARTITION RD_KAFKA_PARTITION_UA
 
-#define CONNECT_MAX_RETRIES 8
+/** Initial delay (in sec) before retrying to connect to Kafka */
+#define CONNECT_RETRY_MIN 10
+
+/** Maximum delay (in sec) before retrying to connect to Kafka */
+#define CONNECT_RETRY_MAX 180
+
+/** How long to wait (in msec) for topic metadata */
+#define METADATA_TIMEOUT 5000
+
+/** Default interval (in msec) between librdkafka statistics reports */
+#define DEFAULT_STATS_INTERVAL 60000
+
+/** Maximum nesting depth of the librdkafka statistics JSON that is parsed */
+#define STATS_MAX_DEPTH 8
+
+/** Maximum length of the path of a librdkafka statistic that is parsed */
+#define STATS_PATH_MAX 64
+
+/** Number of recent flush generations whose deliveries are tracked */
+#define GEN_CNT 32
+
+/** Number of buckets in the delivery latency histogram. Bucket i counts
+    deliveries that took less than 2^i msec, and the last bucket counts the
+    rest */
+#define LATENCY_BUCKETS 17
+
+/** How often (in msec) to poll for delivery reports while waiting for a
+    flush generation to be delivered */
+#define GEN_WAIT_POLL 100
+
+/** How often (in sec) to refresh the partition count of the topic */
+#define PARTITION_CNT_REFRESH 600
+
+/** Marks the end of a list of KIs in a tskkey group */
+#define GROUP_END UINT32_MAX
 
 /** 512K buffer. Approx half will be used, hence the x2 */
 #define BUFFER_LEN ((1024 * 512) * 2)
 
+/** Default maximum number of message buffers (i.e. messages in flight) */
+#define DEFAULT_BUFFER_CNT 16
+
 #define IDENTITY_MAX_LEN 1024
 
 #define STATE(provname) (TIMESERIES_BACKEND_STATE(kafka, provname))
@@ -78,6 +134,106 @@ typedef enum {
   FORMAT_TSK_KEYPART,   //
 } format_t;
 
+/** What to do with a message when the producer queue is full */
+typedef enum {
+  /** Wait for the queue to drain (for at most block_msec msec, if set) */
+  QUEUE_FULL_BLOCK = 0,
+
+  /** Drop the message */
+  QUEUE_FULL_DROP = 1,
+
+  /** Drop the (oldest) messages waiting in the queue */
+  QUEUE_FULL_DROP_OLDEST = 2,
+
+  /** Give up on the KP flush, so that the timeseries flush spool (see
+      timeseries_enable_spool) keeps its values to be replayed later */
+  QUEUE_FULL_SPOOL = 3,
+
+} queue_full_policy_t;
+
+/** Delivery tracking for the messages written for a given time (a "flush
+    generation") */
+typedef struct kafka_gen {
+  /** Time of the values in the messages */
+  uint32_t time;
+
+  /** Is this generation in use? */
+  int used;
+
+  /** Number of messages produced and waiting for a delivery report */
+  uint32_t pending;
+
+  /** Number of messages that were delivered */
+  uint32_t delivered;
+
+  /** Number of messages that failed to be produced or delivered (or were
+      dropped) */
+  uint32_t failed;
+} kafka_gen_t;
+
+/** Tag passed as the opaque of each produced message */
+typedef struct kafka_msg {
+  /** Pool buffer holding the message (NULL if librdkafka copied it) */
+  uint8_t *buffer;
+
+  /** Flush generation (i.e. time) that the message belongs to */
+  uint32_t time;
+
+  /** When the message was produced (in msec) */
+  uint64_t produced_msec;
+} kafka_msg_t;
+
+/** librdkafka statistics that we keep track of (indexes into rdstats_fields
+    and the rdstats array in the state) */
+typedef enum {
+  RDSTAT_MSG_CNT,
+  RDSTAT_MSG_SIZE,
+  RDSTAT_TXMSGS,
+  RDSTAT_TXMSG_BYTES,
+  RDSTAT_TX,
+  RDSTAT_TX_BYTES,
+  RDSTAT_TXERRS,
+  RDSTAT_TXRETRIES,
+  RDSTAT_REQ_TIMEOUTS,
+  RDSTAT_OUTBUF_MSG_CNT,
+  RDSTAT_RTT_AVG,
+  RDSTAT_RTT_P99,
+  RDSTAT_INT_LATENCY_AVG,
+  RDSTAT_INT_LATENCY_P99,
+  RDSTAT_BATCHSIZE_AVG,
+  RDSTAT_BATCHSIZE_P99,
+  RDSTAT_BATCHCNT_AVG,
+  RDSTAT_CNT,
+} rdstat_t;
+
+/** Where to find each statistic in the librdkafka statistics JSON, and what
+    to call it in our stats. Broker and topic names in the path are replaced
+    by "*", and values found under several brokers (or topics) are summed,
+    unless max is set */
+static const struct {
+  const char *path;
+  const char *name;
+  int max;
+} rdstats_fields[RDSTAT_CNT] = {
+  {"msg_cnt", "rdkafka_msg_cnt", 0},
+  {"msg_size", "rdkafka_msg_size", 0},
+  {"txmsgs", "rdkafka_txmsgs", 0},
+  {"txmsg_bytes", "rdkafka_txmsg_bytes", 0},
+  {"tx", "rdkafka_tx", 0},
+  {"tx_bytes", "rdkafka_tx_bytes", 0},
+  {"brokers.*.txerrs", "rdkafka_txerrs", 0},
+  {"brokers.*.txretries", "rdkafka_txretries", 0},
+  {"brokers.*.req_timeouts", "rdkafka_req_timeouts", 0},
+  {"brokers.*.outbuf_msg_cnt", "rdkafka_outbuf_msg_cnt", 0},
+  {"brokers.*.rtt.avg", "rdkafka_rtt_avg_usec", 1},
+  {"brokers.*.rtt.p99", "rdkafka_rtt_p99_usec", 1},
+  {"brokers.*.int_latency.avg", "rdkafka_int_latency_avg_usec", 1},
+  {"brokers.*.int_latency.p99", "rdkafka_int_latency_p99_usec", 1},
+  {"topics.*.batchsize.avg", "rdkafka_batchsize_avg", 1},
+  {"topics.*.batchsize.p99", "rdkafka_batchsize_p99", 1},
+  {"topics.*.batchcnt.avg", "rdkafka_batchcnt_avg", 1},
+};
+
 #define DEFAULT_FORMAT_STR "tsk"
 #define DEFAULT_FORMAT FORMAT_TSK
 
@@ -94,19 +250,30 @@ typedef enum {
 #define SEND_MSG(partition, buf, written, time, ptr, len)                      \
   do {                                                                         \
     int success = 0;                                                           \
+    int full_rc;                                                               \
+    uint64_t wait_start = 0;                                                   \
     uint32_t swaptime = htonl(time);                                           \
     while (written > 0 && success == 0) {                                      \
-      if (rd_kafka_produce(state->rkt, (partition), RD_KAFKA_MSG_F_COPY,       \
-                           (buf), (written), &(swaptime), sizeof(swaptime),    \
-                           NULL) == -1) {                                      \
+      if (produce(state, (partition), (buf), (written), &(swaptime),           \
+                  sizeof(swaptime)) == -1) {                                   \
         if (rd_kafka_last_error() == RD_KAFKA_RESP_ERR__QUEUE_FULL) {          \
-          timeseries_log(__func__, "WARN: producer queue full, retrying...");  \
-          rd_kafka_poll(state->rdk_conn, 1000);                                \
+          if ((full_rc = queue_full(backend, &wait_start)) != 0) {             \
+            /* the message was dropped */                                      \
+            gen_failed(state);                                                 \
+            state->flush_lost = 1;                                             \
+            if (full_rc < 0) {                                                 \
+              /* the whole flush will be spooled, so stop writing it */        \
+              RESET_BUF(buf, ptr, written);                                    \
+              goto err;                                                        \
+            }                                                                  \
+            break;                                                             \
+          }                                                                    \
         } else {                                                               \
           timeseries_log(                                                      \
             __func__, "ERROR: Failed to produce to topic %s partition %i: %s", \
             rd_kafka_topic_name(state->rkt), (partition),                      \
             rd_kafka_err2str(rd_kafka_last_error()));                          \
+          gen_failed(state);                                                   \
           rd_kafka_poll(state->rdk_conn, 0);                                   \
           RESET_BUF(buf, ptr, written);                                        \
           goto err;                                                            \
@@ -116,6 +283,10 @@ typedef enum {
       }                                                                        \
     }                                                                          \
     rd_kafka_poll(state->rdk_conn, 0);                                         \
+    if (success != 0 && ((buf) = buffer_get(backend)) == NULL) {               \
+      (written) = 0;                                                           \
+      goto err;                                                                \
+    }                                                                          \
     RESET_BUF(buf, ptr, written);                                              \
   } while (0)
 
@@ -157,28 +328,150 @@ typedef struct timeseries_backend_kafka_state {
   /** Output format */
   format_t format;
 
+  /** Version of the TSK message format to write */
+  int version;
+
+  /** Maximum number of consecutive delta-encoded flushes (0 to disable
+      delta encoding) */
+  uint32_t delta_max;
+
+  /** Number of KP flushes between full re-publishes of the key dictionary (0
+      to disable key IDs) */
+  uint32_t dict_interval;
+
+  /** The last key written to the current (version 1) message */
+  const char *prev_key;
+
+  /** Length of the last key written to the current message */
+  size_t prev_key_len;
+
+  /** ID of the last key written to the current message (when using key
+      IDs), -1 if none */
+  int64_t prev_id;
+
+  /** Copy of prev_key for keys that belong to the caller (i.e. resolved
+      keys written by set_bulk_by_id) */
+  char *prev_key_buf;
+
   /** Name of the kafka topic to produce to */
   char *topic_prefix;
 
-  /** Reusable message buffer */
-  uint8_t buffer[BUFFER_LEN];
+  /** Message buffer currently being written to (taken from the pool) */
+  uint8_t *buffer;
 
   /** Number of bytes written to the buffer */
   int buffer_written;
 
+  /** Maximum number of message buffers to allocate */
+  int buffer_max;
+
+  /** All allocated message buffers */
+  uint8_t **buffers;
+
+  /** Number of allocated message buffers */
+  int buffers_cnt;
+
+  /** Message buffers that have been delivered and can be reused */
+  uint8_t **buffers_free;
+
+  /** Number of free message buffers */
+  int buffers_free_cnt;
+
+  /** Protects the buffer pool (buffers are returned by the delivery callback,
+      which runs in whichever thread polls librdkafka) */
+  pthread_mutex_t pool_lock;
+
+  /** Number of times all message buffers were in flight */
+  uint64_t buffer_waits;
+
   /** The number of values received for the current bulk set */
   uint32_t bulk_cnt;
 
   /** The expected number of values in the current bulk set */
   uint32_t bulk_expect;
 
+  /** The time of the current bulk set */
+  uint32_t bulk_time;
+
+  /** The message key of the message being filled by the current bulk set */
+  uint32_t bulk_msgkey;
+
+  /** Buffer to build messages in when all buffers are in flight (and we
+      cannot wait). Messages in this buffer are copied by librdkafka */
+  uint8_t *copy_buffer;
+
+  /** Number of messages that were built in the copy buffer */
+  uint64_t buffer_copies;
+
+  /* Delivery tracking: */
+
+  /** Time of the values currently being written (i.e. the flush generation
+      that produced messages belong to) */
+  uint32_t gen_time;
+
+  /** Ring of recent flush generations */
+  kafka_gen_t gens[GEN_CNT];
+
+  /** Index of the generation that will be replaced next */
+  int gens_next;
+
+  /** Histogram of produce-to-ack latencies (see LATENCY_BUCKETS) */
+  uint64_t latency_hist[LATENCY_BUCKETS];
+
+  /** Largest produce-to-ack latency (in msec) */
+  uint64_t latency_max;
+
+  /** Protects the generations, the latency histogram and the purge count
+      (which are updated by whichever thread polls librdkafka) */
+  pthread_mutex_t gen_lock;
+
+  /* Producer queue backpressure: */
+
+  /** What to do when the producer queue is full */
+  queue_full_policy_t queue_full_policy;
+
+  /** Maximum time to block for when the queue is full (0 to wait forever) */
+  uint32_t block_msec;
+
+  /** Number of messages that found the producer queue full */
+  uint64_t queue_full_cnt;
+
+  /** Total time spent waiting for the producer queue to drain */
+  uint64_t queue_full_msec;
+
+  /** Number of messages dropped because the producer queue was full */
+  uint64_t dropped_msgs;
+
+  /** Number of queued messages dropped to make room for new messages */
+  uint64_t purged_msgs;
+
+  /** Set when a message written by the current KP flush was dropped by the
+      queue-full policy (which fails the flush) */
+  int flush_lost;
+
   /* Kafka connection state: */
 
-  /** Are we connected to Kafka? */
-  int connected;
+  /** State of the connection to Kafka */
+  timeseries_backend_conn_state_t conn_state;
+
+  /** Protects the connection state */
+  pthread_mutex_t conn_lock;
+
+  /** Signalled to stop the connect thread */
+  pthread_cond_t conn_cond;
 
-  /** Have we encountered a fatal error? */
-  int fatal_error;
+  /** Set to stop the connect thread */
+  int connect_shutdown;
+
+  /** Thread that waits for the first connection to Kafka */
+  pthread_t connect_thread;
+
+  /** Has the connect thread been started? */
+  int connect_thread_started;
+
+  /** Maximum size of the producer queue (in KB, 0 for the librdkafka
+      default) */
+  uint32_t queue_max_kbytes;
 
   /** RD Kafka connection handle */
   rd_kafka_t *rdk_conn;
@@ -189,23 +482,187 @@ typedef struct timeseries_backend_kafka_state {
   /** RD Kafka topic handle */
   rd_kafka_topic_t *rkt;
 
+  /** Number of partitions in the topic (0 if unknown) */
+  int partition_cnt;
+
+  /** When the partition count was last refreshed */
+  time_t partition_cnt_time;
+
+  /* librdkafka statistics: */
+
+  /** Interval (in msec) between statistics reports (0 to disable) */
+  int stats_interval;
+
+  /** The statistics from the most recent report (indexed by rdstat_t) */
+  uint64_t rdstats[RDSTAT_CNT];
+
+  /** Number of statistics reports received */
+  uint64_t rdstats_cnt;
+
+  /** Protects the statistics (which are updated by whichever thread polls
+      librdkafka) */
+  pthread_mutex_t rdstats_lock;
+
 } timeseries_backend_kafka_state_t;
 
+/** A group of KIs that share a partition hash (tskkey format) */
+typedef struct timeseries_backend_kafka_group {
+  /** The partition hash shared by the KIs in this group */
+  uint32_t hash;
+
+  /** ID of the first KI in the group */
+  uint32_t head;
+
+  /** ID of the last KI in the group */
+  uint32_t tail;
+
+} timeseries_backend_kafka_group_t;
+
+/** Map from partition hash to group index */
+KHASH_MAP_INIT_INT(kafka_group, uint32_t);
+
+/** Holds the serialized key records for the KIs in a KP (only used by the
+    TSK formats) */
+typedef struct timeseries_backend_kafka_kp_state {
+  /** Length-prefixed (network byte order) keys, in KI ID order */
+  uint8_t *records;
+
+  /** Number of bytes used in the records array */
+  size_t records_len;
+
+  /** Number of bytes allocated for the records array */
+  size_t records_alloc;
+
+  /** Offset of the record for each KI (with one extra entry marking the end
+      of the last record) */
+  size_t *offsets;
+
+  /** Partition hash of each KI (only used by the tskkey format) */
+  uint32_t *hashes;
+
+  /** Number of KIs that have records */
+  uint32_t cnt;
+
+  /** Number of KIs the offsets and hashes arrays have space for */
+  uint32_t alloc;
+
+  /* the remaining fields are only used by the tskkey format */
+
+  /** ID of the next KI in the same group (GROUP_END for the last one) */
+  uint32_t *group_next;
+
+  /** Groups of KIs that share a partition hash, in order of creation */
+  timeseries_backend_kafka_group_t *groups;
+
+  /** Number of groups */
+  uint32_t groups_cnt;
+
+  /** Number of groups allocated */
+  uint32_t groups_alloc;
+
+  /** Number of KIs that have been added to groups */
+  uint32_t grouped_cnt;
+
+  /** Map from partition hash to group index */
+  khash_t(kafka_group) * group_idx;
+
+  /** Group indexes ordered by partition */
+  uint32_t *part_order;
+
+  /** Number of groups in part_order */
+  uint32_t part_order_groups;
+
+  /** Partition count part_order was built for */
+  int part_order_parts;
+
+  /** Partition count of the topic when the KP was last flushed (0 if not
+      known) */
+  int flush_parts;
+
+  /* the remaining fields are only used for delta encoding */
+
+  /** The last value sent for each KI */
+  uint64_t *last_values;
+
+  /** The flush (sequence number) each KI was last sent in */
+  uint32_t *sent_seq;
+
+  /** Sequence number of the last completed flush (0 if none) */
+  uint32_t flush_seq;
+
+  /** Time of the last completed flush */
+  uint32_t last_time;
+
+  /** Number of consecutive delta-encoded flushes */
+  uint32_t delta_flushes;
+
+  /** Is the current flush delta-encoded? */
+  int deltas;
+
+  /* the remaining fields are only used for key IDs */
+
+  /** ID of the key dictionary of this KP */
+  uint32_t dict_id;
+
+  /** Has each KI been defined (i.e., sent with its key name)? */
+  uint8_t *defined;
+
+  /** Number of flushes since the dictionary was last fully re-published */
+  uint32_t dict_age;
+
+  /** Is the dictionary being fully re-published by the current flush? */
+  int dict_full;
+
+} timeseries_backend_kafka_kp_state_t;
+
 /** Print usage information to stderr */
 static void usage(timeseries_backend_t *backend)
 {
   fprintf(stderr,
           "backend usage: %s [-p topic] -b broker-uri -c channel \n"
           "       -b <broker-uri>    kafka broker URI (required)\n"
+          "       -B <buffers>       max number of messages in flight, each\n"
+          "                            using a %dKB buffer (default: %d)\n"
           "       -c <channel>       metric channel to publish to (required)\n"
           "       -C <compression>   compression codec to use (default: %s)\n"
-          "       -f <format>        output format ('ascii', or 'tsk') "
-          "(default: %s)\n"
-          "       -p <topic-prefix>  topic prefix to use (default: %s)\n",
-          backend->name,       //
-          DEFAULT_COMPRESSION, //
-          DEFAULT_FORMAT_STR,  //
-          DEFAULT_TOPIC);
+          "       -D <flushes>       delta-encode values in up to <flushes>\n"
+          "                            consecutive KP flushes between flushes\n"
+          "                            of absolute values (requires -v 1\n"
+          "                            and -f tskkey)\n"
+          "                            (default: disabled)\n"
+          "       -f <format>        output format ('ascii', 'tsk', or "
+          "'tskkey') (default: %s)\n"
+          "       -i <flushes>       identify keys by numeric IDs, re-sending\n"
+          "                            all key names every <flushes> KP\n"
+          "                            flushes (requires -v 1 and -f\n"
+          "                            tskkey)\n"
+          "                            (default: disabled)\n"
+          "       -m <kbytes>        max size of the producer queue, which\n"
+          "                            buffers messages until Kafka is up\n"
+          "                            (default: librdkafka default)\n"
+          "       -p <topic-prefix>  topic prefix to use (default: %s)\n"
+          "       -q <policy>        what to do when the producer queue is\n"
+          "                            full (default: block):\n"
+          "                              block[:<msec>] wait (at most msec)\n"
+          "                              drop           drop the message\n"
+          "                              drop-oldest    drop queued messages\n"
+          "                              spool          fail the flush, so\n"
+          "                                             the flush spool\n"
+          "                                             replays it later\n"
+          "                            a KP flush that drops any messages\n"
+          "                            fails\n"
+          "       -s <msec>          interval between librdkafka statistics\n"
+          "                            reports, 0 to disable (default: %d)\n"
+          "       -v <version>       TSK message version to write (0 or 1)\n"
+          "                            (default: %d)\n",
+          backend->name,           //
+          BUFFER_LEN / 1024,       //
+          DEFAULT_BUFFER_CNT,      //
+          DEFAULT_COMPRESSION,     //
+          DEFAULT_FORMAT_STR,      //
+          DEFAULT_TOPIC,           //
+          DEFAULT_STATS_INTERVAL,  //
+          MESSAGE_VERSION);
 }
 
 /** Parse the arguments given to the backend */
@@ -221,12 +678,16 @@ static int parse_args(timeseries_backend_t *backend, int argc, char **argv)
 
   /* remember the argv strings DO NOT belong to us */
 
-  while ((opt = getopt(argc, argv, ":b:c:C:f:p:?")) >= 0) {
+  while ((opt = getopt(argc, argv, ":b:B:c:C:D:f:i:m:p:q:s:v:?")) >= 0) {
     switch (opt) {
     case 'b':
       state->broker_uri = strdup(optarg);
       break;
 
+    case 'B':
+      state->buffer_max = atoi(optarg);
+      break;
+
     case 'c':
       state->channel_name = strdup(optarg);
       state->channel_name_len = strlen(state->channel_name);
@@ -237,6 +698,10 @@ static int parse_args(timeseries_backend_t *backend, int argc, char **argv)
       state->compression_codec = strdup(optarg);
       break;
 
+    case 'D':
+      state->delta_max = strtoul(optarg, NULL, 10);
+      break;
+
     case 'f':
       if (strcmp(optarg, "ascii") == 0) {
         state->format = FORMAT_ASCII;
@@ -251,10 +716,54 @@ static int parse_args(timeseries_backend_t *backend, int argc, char **argv)
       }
       break;
 
+    case 'i':
+      state->dict_interval = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'm':
+      state->queue_max_kbytes = strtoul(optarg, NULL, 10);
+      break;
+
     case 'p':
+      free(state->topic_prefix);
       state->topic_prefix = strdup(optarg);
       break;
 
+    case 'q':
+      if (strcmp(optarg, "block") == 0) {
+        state->queue_full_policy = QUEUE_FULL_BLOCK;
+      } else if (strncmp(optarg, "block:", 6) == 0) {
+        state->queue_full_policy = QUEUE_FULL_BLOCK;
+        state->block_msec = strtoul(optarg + 6, NULL, 10);
+      } else if (strcmp(optarg, "drop") == 0) {
+        state->queue_full_policy = QUEUE_FULL_DROP;
+      } else if (strcmp(optarg, "drop-oldest") == 0) {
+#ifdef RD_KAFKA_PURGE_F_QUEUE
+        state->queue_full_policy = QUEUE_FULL_DROP_OLDEST;
+#else
+        fprintf(stderr, "ERROR: drop-oldest requires librdkafka >= 1.0\n");
+        usage(backend);
+        return -1;
+#endif
+      } else if (strcmp(optarg, "spool") == 0) {
+        state->queue_full_policy = QUEUE_FULL_SPOOL;
+      } else {
+        fprintf(stderr, "ERROR: Queue-full policy must be one of "
+                        "'block[:<msec>]', 'drop', 'drop-oldest', or "
+                        "'spool'\n");
+        usage(backend);
+        return -1;
+      }
+      break;
+
+    case 's':
+      state->stats_interval = atoi(optarg);
+      break;
+
+    case 'v':
+      state->version = atoi(optarg);
+      break;
+
     case '?':
     case ':':
     default:
@@ -275,111 +784,685 @@ static int parse_args(timeseries_backend_t *backend, int argc, char **argv)
     return -1;
   }
 
+  if (state->version != MESSAGE_VERSION &&
+      state->version != MESSAGE_VERSION_V1) {
+    fprintf(stderr, "ERROR: Message version must be %d or %d\n",
+            MESSAGE_VERSION, MESSAGE_VERSION_V1);
+    usage(backend);
+    return -1;
+  }
+
+  if (state->delta_max > 0 && state->version != MESSAGE_VERSION_V1) {
+    fprintf(stderr, "ERROR: Delta encoding requires message version %d\n",
+            MESSAGE_VERSION_V1);
+    usage(backend);
+    return -1;
+  }
+
+  /* the tsk format sends each flush to a different partition, so consumers
+     (in particular, those in a group) would get deltas without the values
+     they are relative to, and key IDs without their definitions. tskkey
+     keeps each key on one partition. */
+  if (state->delta_max > 0 && state->format != FORMAT_TSK_KEYPART) {
+    fprintf(stderr, "ERROR: Delta encoding requires the tskkey format\n");
+    usage(backend);
+    return -1;
+  }
+
+  if (state->dict_interval > 0 && state->format != FORMAT_TSK_KEYPART) {
+    fprintf(stderr, "ERROR: Key IDs require the tskkey format\n");
+    usage(backend);
+    return -1;
+  }
+
+  if (state->dict_interval > 0 && state->version != MESSAGE_VERSION_V1) {
+    fprintf(stderr, "ERROR: Key IDs require message version %d\n",
+            MESSAGE_VERSION_V1);
+    usage(backend);
+    return -1;
+  }
+
+  /* spooled flushes are replayed after newer ones, which they would have to
+     precede for the consumer to apply deltas and key IDs */
+  if (state->queue_full_policy == QUEUE_FULL_SPOOL &&
+      (state->delta_max > 0 || state->dict_interval > 0)) {
+    fprintf(stderr, "ERROR: The spool queue-full policy cannot be used with "
+                    "delta encoding or key IDs\n");
+    usage(backend);
+    return -1;
+  }
+
+  if (state->buffer_max < 1) {
+    fprintf(stderr, "ERROR: At least one message buffer is required\n");
+    usage(backend);
+    return -1;
+  }
+
   return 0;
 }
 
-static void kafka_error_callback(rd_kafka_t *rk, int err, const char *reason,
-                                 void *opaque)
+/** Get the current time in msec */
+static uint64_t now_msec()
 {
-  timeseries_backend_t *backend = (timeseries_backend_t *)opaque;
-
-  switch (err) {
-  // fatal errors:
-  case RD_KAFKA_RESP_ERR__BAD_COMPRESSION:
-  case RD_KAFKA_RESP_ERR__RESOLVE:
-    STATE(backend)->fatal_error = 1;
-  // fall through
+  struct timeval tv;
+  gettimeofday_wrap(&tv);
+  return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
 
-  // recoverable? errors:
-  case RD_KAFKA_RESP_ERR__DESTROY:
-  case RD_KAFKA_RESP_ERR__FAIL:
-  case RD_KAFKA_RESP_ERR__TRANSPORT:
-  case RD_KAFKA_RESP_ERR__ALL_BROKERS_DOWN:
-    STATE(backend)->connected = 0;
-    break;
-  }
+/** Get the state of the connection to Kafka */
+static timeseries_backend_conn_state_t
+conn_state_get(timeseries_backend_kafka_state_t *state)
+{
+  timeseries_backend_conn_state_t conn_state;
 
-  timeseries_log(__func__, "ERROR: %s (%d): %s", rd_kafka_err2str(err), err,
-                 reason);
+  pthread_mutex_lock(&state->conn_lock);
+  conn_state = state->conn_state;
+  pthread_mutex_unlock(&state->conn_lock);
 
-  // TODO: handle other errors
+  return conn_state;
 }
 
-static void kafka_delivery_callback(rd_kafka_t *rk,
-                                    const rd_kafka_message_t *rkmessage,
-                                    void *opaque)
+/** Update the state of the connection to Kafka
+ *
+ * Failures are permanent, and until we have connected for the first time,
+ * losing the connection just means that we are still connecting.
+ */
+static void conn_state_update(timeseries_backend_kafka_state_t *state,
+                              timeseries_backend_conn_state_t conn_state)
 {
-  if (rkmessage->err) {
-    timeseries_log(__func__,
-                   "ERROR: Message delivery failed: %s [%" PRId32 "]: %s\n",
-                   rd_kafka_topic_name(rkmessage->rkt), rkmessage->partition,
-                   rd_kafka_err2str(rkmessage->err));
+  timeseries_backend_conn_state_t old;
+
+  pthread_mutex_lock(&state->conn_lock);
+  old = state->conn_state;
+  if (old == conn_state || old == TIMESERIES_BACKEND_CONN_FAILED ||
+      (old == TIMESERIES_BACKEND_CONN_CONNECTING &&
+       conn_state == TIMESERIES_BACKEND_CONN_DISCONNECTED)) {
+    pthread_mutex_unlock(&state->conn_lock);
+    return;
+  }
+  state->conn_state = conn_state;
+  pthread_cond_signal(&state->conn_cond);
+  pthread_mutex_unlock(&state->conn_lock);
+
+  switch (conn_state) {
+  case TIMESERIES_BACKEND_CONN_CONNECTED:
+    timeseries_log(__func__, "INFO: Connected to Kafka");
+    break;
+  case TIMESERIES_BACKEND_CONN_DISCONNECTED:
+    timeseries_log(__func__, "WARN: Lost connection to Kafka, reconnecting");
+    break;
+  case TIMESERIES_BACKEND_CONN_FAILED:
+    timeseries_log(__func__, "ERROR: Kafka connection failed");
+    break;
+  default:
+    break;
   }
 }
 
-static int32_t time_partitioner(const rd_kafka_topic_t *rkt, const void *key,
-                                size_t keylen, int32_t partition_cnt,
-                                void *opaque, void *msg_opaque)
+/** Take a delivered message buffer from the pool, or NULL if none is free */
+static uint8_t *buffer_pop(timeseries_backend_kafka_state_t *state)
 {
-  assert(keylen == sizeof(uint32_t));
-  uint32_t time = ntohl(*(uint32_t *)key);
-  // truncate time to # minutes since epoch
-  // NB: the partition count MUST not be a multiple of the step (in minutes)
-  return (time / 60) % partition_cnt;
+  uint8_t *buf = NULL;
+
+  pthread_mutex_lock(&state->pool_lock);
+  if (state->buffers_free_cnt > 0) {
+    buf = state->buffers_free[--state->buffers_free_cnt];
+  }
+  pthread_mutex_unlock(&state->pool_lock);
+
+  return buf;
 }
 
-static int topic_connect(timeseries_backend_t *backend)
+/** Get a message buffer from the pool
+ *
+ * If all buffers are in flight (i.e. waiting for their delivery reports),
+ * this polls Kafka until one is delivered. If the queue-full policy does not
+ * allow us to wait (any longer), or we have not connected to Kafka yet (so
+ * nothing can be delivered), the copy buffer is returned instead.
+ */
+static uint8_t *buffer_get(timeseries_backend_t *backend)
 {
   timeseries_backend_kafka_state_t *state = STATE(backend);
-  rd_kafka_topic_conf_t *topic_conf = rd_kafka_topic_conf_new();
-  assert(topic_conf != NULL);
+  uint64_t start;
+  uint8_t *buf;
 
-  timeseries_log(__func__, "INFO: Checking topic connection...");
-  assert(state->topic_name != NULL);
+  if ((buf = buffer_pop(state)) != NULL) {
+    return buf;
+  }
 
-  // build the topic name
-  if (snprintf(state->topic_name, IDENTITY_MAX_LEN, "%s.%s",
-               state->topic_prefix, state->channel_name) >= IDENTITY_MAX_LEN) {
-    return -1;
+  if (state->buffers_cnt < state->buffer_max) {
+    if ((buf = malloc(BUFFER_LEN)) == NULL) {
+      timeseries_log(__func__, "ERROR: Could not allocate message buffer");
+      return NULL;
+    }
+    pthread_mutex_lock(&state->pool_lock);
+    state->buffers[state->buffers_cnt++] = buf;
+    pthread_mutex_unlock(&state->pool_lock);
+    return buf;
   }
 
-  /* NOTE: we recycle the time_partitioner here for key-based partitioning.
-   * This works because the key string actually gets evaluated as a 32-bit hash
-   * so it all looks the same to the partitioner.
-   */
-  if (state->format == FORMAT_TSK || state->format == FORMAT_TSK_KEYPART) {
-    // route all identical times to the same partition
-    rd_kafka_topic_conf_set_partitioner_cb(topic_conf, time_partitioner);
+  if (state->queue_full_policy == QUEUE_FULL_BLOCK &&
+      conn_state_get(state) != TIMESERIES_BACKEND_CONN_CONNECTING) {
+    state->buffer_waits++;
+    timeseries_log(__func__,
+                   "WARN: all message buffers in flight, waiting...");
+    start = now_msec();
+    while ((buf = buffer_pop(state)) == NULL &&
+           (state->block_msec == 0 ||
+            now_msec() - start < state->block_msec)) {
+      rd_kafka_poll(state->rdk_conn, state->block_msec == 0 ? 1000 : 10);
+    }
+  } else {
+    rd_kafka_poll(state->rdk_conn, 0);
+    buf = buffer_pop(state);
   }
-  // else: just round-robin the ascii-formatted data
 
-  // connect to kafka
-  if (state->rkt == NULL) {
-    timeseries_log(__func__, "DEBUG: Connecting to %s", state->topic_name);
-    if ((state->rkt = rd_kafka_topic_new(state->rdk_conn, state->topic_name,
-                                         topic_conf)) == NULL) {
-      return -1;
+  if (buf == NULL) {
+    if (state->copy_buffer == NULL &&
+        (state->copy_buffer = malloc(BUFFER_LEN)) == NULL) {
+      timeseries_log(__func__, "ERROR: Could not allocate message buffer");
+      return NULL;
     }
+    state->buffer_copies++;
+    return state->copy_buffer;
   }
 
-  return 0;
+  return buf;
 }
 
-static int producer_connect(timeseries_backend_t *backend)
+/** Find the flush generation for the given time
+ *
+ * @param state         Pointer to the kafka state
+ * @param time          Time of the generation to find
+ * @param create        If non-zero, replace the oldest generation if there is
+ *                      none for the time
+ * @return pointer to the generation, NULL if it was not found
+ *
+ * @note must be called with the gen lock held
+ */
+static kafka_gen_t *gen_get(timeseries_backend_kafka_state_t *state,
+                            uint32_t time, int create)
 {
-  timeseries_backend_kafka_state_t *state = STATE(backend);
-  rd_kafka_conf_t *conf = rd_kafka_conf_new();
-  char errstr[512];
+  kafka_gen_t *gen;
+  int i;
 
-  // Set the opaque pointer that will be passed to callbacks
-  rd_kafka_conf_set_opaque(conf, backend);
+  for (i = 0; i < GEN_CNT; i++) {
+    if (state->gens[i].used != 0 && state->gens[i].time == time) {
+      return &state->gens[i];
+    }
+  }
+  if (create == 0) {
+    return NULL;
+  }
 
-  // Set our error handler
-  rd_kafka_conf_set_error_cb(conf, kafka_error_callback);
+  gen = &state->gens[state->gens_next];
+  state->gens_next = (state->gens_next + 1) % GEN_CNT;
+  memset(gen, 0, sizeof(*gen));
+  gen->time = time;
+  gen->used = 1;
+  return gen;
+}
+
+/** Count a message of the current generation that will not be delivered */
+static void gen_failed(timeseries_backend_kafka_state_t *state)
+{
+  pthread_mutex_lock(&state->gen_lock);
+  gen_get(state, state->gen_time, 1)->failed++;
+  pthread_mutex_unlock(&state->gen_lock);
+}
+
+/** Produce a message. Messages in pool buffers are produced without copying,
+    and the buffer is returned to the pool by the delivery callback */
+static int produce(timeseries_backend_kafka_state_t *state, int32_t partition,
+                   uint8_t *buf, size_t len, void *key, size_t key_len)
+{
+  int copy = (buf == state->copy_buffer);
+  kafka_msg_t *msg;
+
+  if ((msg = malloc(sizeof(kafka_msg_t))) == NULL) {
+    timeseries_log(__func__, "ERROR: Could not allocate message tag");
+    return -1;
+  }
+  msg->buffer = copy ? NULL : buf;
+  msg->time = state->gen_time;
+  msg->produced_msec = now_msec();
+
+  if (rd_kafka_produce(state->rkt, partition, copy ? RD_KAFKA_MSG_F_COPY : 0,
+                       buf, len, key, key_len, msg) == -1) {
+    free(msg);
+    return -1;
+  }
+
+  pthread_mutex_lock(&state->gen_lock);
+  gen_get(state, state->gen_time, 1)->pending++;
+  pthread_mutex_unlock(&state->gen_lock);
+
+  return 0;
+}
+
+/** Handle a message that could not be produced because the producer queue is
+ *  full, according to the queue-full policy
+ *
+ * @param wait_start    Time the message started waiting (0 on the first call
+ *                      for each message)
+ * @return 1 if the message was dropped (so the buffer can be reused), -1 if
+ * it was dropped and the rest of the KP flush should be abandoned, 0 if it
+ * should be produced again
+ */
+static int queue_full(timeseries_backend_t *backend, uint64_t *wait_start)
+{
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  uint64_t now = now_msec();
+  int first = (*wait_start == 0);
+
+  if (first) {
+    state->queue_full_cnt++;
+    *wait_start = now;
+  }
+
+  /* until we have connected, the queue cannot drain, so blocking would stall
+     the caller for as long as Kafka is unreachable */
+  if (state->queue_full_policy == QUEUE_FULL_BLOCK &&
+      conn_state_get(state) == TIMESERIES_BACKEND_CONN_CONNECTING) {
+    if (state->dropped_msgs++ == 0) {
+      timeseries_log(__func__, "WARN: producer queue full before connecting "
+                               "to Kafka, dropping messages");
+    }
+    return 1;
+  }
+
+  switch (state->queue_full_policy) {
+  case QUEUE_FULL_BLOCK:
+    if (state->block_msec != 0 && now - *wait_start >= state->block_msec) {
+      timeseries_log(__func__,
+                     "WARN: producer queue full for %" PRIu32
+                     "ms, dropping message",
+                     state->block_msec);
+      state->dropped_msgs++;
+      return 1;
+    }
+    if (first) {
+      timeseries_log(__func__, "WARN: producer queue full, waiting...");
+    }
+    rd_kafka_poll(state->rdk_conn,
+                  state->block_msec == 0
+                    ? 1000
+                    : state->block_msec - (now - *wait_start));
+    state->queue_full_msec += now_msec() - now;
+    return 0;
+
+  case QUEUE_FULL_DROP_OLDEST:
+#ifdef RD_KAFKA_PURGE_F_QUEUE
+    if (first) {
+      // the delivery callback counts the purged messages
+      timeseries_log(__func__,
+                     "WARN: producer queue full, dropping queued messages");
+      rd_kafka_purge(state->rdk_conn, RD_KAFKA_PURGE_F_QUEUE);
+      rd_kafka_poll(state->rdk_conn, 0);
+      // the purged messages may include ones from this flush
+      state->flush_lost = 1;
+      return 0;
+    }
+#endif
+    // the queue is still full (of messages in flight)
+    state->dropped_msgs++;
+    return 1;
+
+  case QUEUE_FULL_SPOOL:
+    if (first) {
+      timeseries_log(__func__,
+                     "WARN: producer queue full, failing the flush");
+    }
+    state->dropped_msgs++;
+    return -1;
+
+  case QUEUE_FULL_DROP:
+    state->dropped_msgs++;
+    return 1;
+  }
+
+  return 0;
+}
+
+static void kafka_error_callback(rd_kafka_t *rk, int err, const char *reason,
+                                 void *opaque)
+{
+  timeseries_backend_t *backend = (timeseries_backend_t *)opaque;
+
+  switch (err) {
+  // fatal errors:
+  case RD_KAFKA_RESP_ERR__BAD_COMPRESSION:
+    conn_state_update(STATE(backend), TIMESERIES_BACKEND_CONN_FAILED);
+    break;
+
+  // recoverable errors (librdkafka keeps trying to reach the brokers, and
+  // on boot the network may come up after we do):
+  case RD_KAFKA_RESP_ERR__RESOLVE:
+  case RD_KAFKA_RESP_ERR__DESTROY:
+  case RD_KAFKA_RESP_ERR__FAIL:
+  case RD_KAFKA_RESP_ERR__TRANSPORT:
+  case RD_KAFKA_RESP_ERR__ALL_BROKERS_DOWN:
+    conn_state_update(STATE(backend), TIMESERIES_BACKEND_CONN_DISCONNECTED);
+    break;
+  }
+
+  timeseries_log(__func__, "ERROR: %s (%d): %s", rd_kafka_err2str(err), err,
+                 reason);
+
+  // TODO: handle other errors
+}
+
+static void kafka_delivery_callback(rd_kafka_t *rk,
+                                    const rd_kafka_message_t *rkmessage,
+                                    void *opaque)
+{
+  timeseries_backend_t *backend = (timeseries_backend_t *)opaque;
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  kafka_msg_t *msg = rkmessage->_private;
+  kafka_gen_t *gen;
+  uint64_t latency;
+  int bucket;
+
+  /* every message that we produce is tagged */
+  assert(msg != NULL);
+
+  /* librdkafka is done with the message buffer, so it can be reused */
+  if (msg->buffer != NULL) {
+    pthread_mutex_lock(&state->pool_lock);
+    assert(state->buffers_free_cnt < state->buffers_cnt);
+    state->buffers_free[state->buffers_free_cnt++] = msg->buffer;
+    pthread_mutex_unlock(&state->pool_lock);
+  }
+
+  pthread_mutex_lock(&state->gen_lock);
+  /* the generation may have been replaced by more recent ones */
+  if ((gen = gen_get(state, msg->time, 0)) != NULL && gen->pending > 0) {
+    gen->pending--;
+    if (rkmessage->err) {
+      gen->failed++;
+    } else {
+      gen->delivered++;
+    }
+  }
+  if (!rkmessage->err) {
+    latency = now_msec() - msg->produced_msec;
+    for (bucket = 0;
+         bucket < LATENCY_BUCKETS - 1 && latency >= (1ULL << bucket);
+         bucket++)
+      ;
+    state->latency_hist[bucket]++;
+    if (latency > state->latency_max) {
+      state->latency_max = latency;
+    }
+  }
+#ifdef RD_KAFKA_PURGE_F_QUEUE
+  if (rkmessage->err == RD_KAFKA_RESP_ERR__PURGE_QUEUE) {
+    state->purged_msgs++;
+  }
+#endif
+  pthread_mutex_unlock(&state->gen_lock);
+
+  free(msg);
+
+#ifdef RD_KAFKA_PURGE_F_QUEUE
+  if (rkmessage->err == RD_KAFKA_RESP_ERR__PURGE_QUEUE) {
+    return;
+  }
+#endif
+
+  if (rkmessage->err) {
+    timeseries_log(__func__,
+                   "ERROR: Message delivery failed: %s [%" PRId32 "]: %s\n",
+                   rd_kafka_topic_name(rkmessage->rkt), rkmessage->partition,
+                   rd_kafka_err2str(rkmessage->err));
+  } else {
+    conn_state_update(state, TIMESERIES_BACKEND_CONN_CONNECTED);
+  }
+}
+
+/** Skip JSON whitespace */
+static const char *skip_ws(const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+    p++;
+  }
+  return p;
+}
+
+/** Parse one JSON value of a librdkafka statistics report
+ *
+ * @param rdstats       Array (indexed by rdstat_t) to add the statistics to
+ * @param p             Pointer to the start of the value
+ * @param end           Pointer to the end of the report
+ * @param path          Path of the value (object keys separated by dots)
+ * @param path_len      Length of path
+ * @param depth         Nesting depth of the value
+ * @return pointer to the end of the value, NULL if the JSON is malformed
+ *
+ * Only unsigned integer values are recorded; everything else is skipped.
+ */
+static const char *rdstats_parse_value(uint64_t *rdstats, const char *p,
+                                       const char *end, char *path,
+                                       size_t path_len, int depth)
+{
+  const char *key;
+  size_t key_len, child_len;
+  uint64_t value;
+  int i;
+
+  p = skip_ws(p, end);
+  if (p == end) {
+    return NULL;
+  }
+
+  if (*p == '{' || *p == '[') {
+    char close = *p == '{' ? '}' : ']';
+    if (depth == STATS_MAX_DEPTH) {
+      return NULL;
+    }
+    p++;
+    p = skip_ws(p, end);
+    if (p < end && *p == close) {
+      return p + 1;
+    }
+    while (p < end) {
+      key = "*";
+      key_len = 1;
+      if (close == '}') {
+        // the key (we do not care about escapes: they never match)
+        p = skip_ws(p, end);
+        if (p == end || *p != '"') {
+          return NULL;
+        }
+        key = ++p;
+        while (p < end && *p != '"') {
+          p += (*p == '\\') ? 2 : 1;
+        }
+        if (p >= end) {
+          return NULL;
+        }
+        key_len = p++ - key;
+        p = skip_ws(p, end);
+        if (p == end || *p++ != ':') {
+          return NULL;
+        }
+        // broker and topic names are wildcards
+        if ((path_len == 7 && memcmp(path, "brokers", 7) == 0) ||
+            (path_len == 6 && memcmp(path, "topics", 6) == 0)) {
+          key = "*";
+          key_len = 1;
+        }
+      }
+      // values whose path does not fit cannot match any of our statistics
+      child_len = path_len + (path_len > 0) + key_len;
+      if (child_len < STATS_PATH_MAX) {
+        if (path_len > 0) {
+          path[path_len] = '.';
+        }
+        memcpy(path + child_len - key_len, key, key_len);
+      } else {
+        child_len = STATS_PATH_MAX;
+      }
+      if ((p = rdstats_parse_value(rdstats, p, end, path, child_len,
+                                   depth + 1)) == NULL) {
+        return NULL;
+      }
+      p = skip_ws(p, end);
+      if (p == end) {
+        return NULL;
+      }
+      if (*p == close) {
+        return p + 1;
+      }
+      if (*p++ != ',') {
+        return NULL;
+      }
+    }
+    return NULL;
+  }
+
+  if (*p == '"') {
+    p++;
+    while (p < end && *p != '"') {
+      p += (*p == '\\') ? 2 : 1;
+    }
+    return p < end ? p + 1 : NULL;
+  }
+
+  if (*p >= '0' && *p <= '9') {
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+      value = value * 10 + (*p++ - '0');
+    }
+    // fractions and exponents are not used by any of our statistics
+    while (p < end && (*p == '.' || *p == 'e' || *p == 'E' || *p == '+' ||
+                       *p == '-' || (*p >= '0' && *p <= '9'))) {
+      p++;
+    }
+    if (path_len < STATS_PATH_MAX) {
+      for (i = 0; i < RDSTAT_CNT; i++) {
+        if (strlen(rdstats_fields[i].path) == path_len &&
+            memcmp(rdstats_fields[i].path, path, path_len) == 0) {
+          if (rdstats_fields[i].max == 0) {
+            rdstats[i] += value;
+          } else if (value > rdstats[i]) {
+            rdstats[i] = value;
+          }
+          break;
+        }
+      }
+    }
+    return p;
+  }
+
+  // negative numbers, true, false and null
+  while (p < end && (*p == '-' || *p == '.' || *p == '+' ||
+                     (*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z') ||
+                     *p == 'E')) {
+    p++;
+  }
+  return p;
+}
+
+static int kafka_stats_callback(rd_kafka_t *rk, char *json, size_t json_len,
+                                void *opaque)
+{
+  timeseries_backend_t *backend = (timeseries_backend_t *)opaque;
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  uint64_t rdstats[RDSTAT_CNT];
+  char path[STATS_PATH_MAX];
+
+  memset(rdstats, 0, sizeof(rdstats));
+  if (rdstats_parse_value(rdstats, json, json + json_len, path, 0, 0) ==
+      NULL) {
+    timeseries_log(__func__, "WARN: Could not parse librdkafka statistics");
+    return 0;
+  }
+
+  pthread_mutex_lock(&state->rdstats_lock);
+  memcpy(state->rdstats, rdstats, sizeof(rdstats));
+  state->rdstats_cnt++;
+  pthread_mutex_unlock(&state->rdstats_lock);
+
+  // librdkafka frees the JSON
+  return 0;
+}
+
+static int32_t time_partitioner(const rd_kafka_topic_t *rkt, const void *key,
+                                size_t keylen, int32_t partition_cnt,
+                                void *opaque, void *msg_opaque)
+{
+  assert(keylen == sizeof(uint32_t));
+  uint32_t time = ntohl(*(uint32_t *)key);
+  // truncate time to # minutes since epoch
+  // NB: the partition count MUST not be a multiple of the step (in minutes)
+  return (time / 60) % partition_cnt;
+}
+
+static int topic_connect(timeseries_backend_t *backend)
+{
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  rd_kafka_topic_conf_t *topic_conf = rd_kafka_topic_conf_new();
+  assert(topic_conf != NULL);
+
+  timeseries_log(__func__, "INFO: Checking topic connection...");
+  assert(state->topic_name != NULL);
+
+  // build the topic name
+  if (snprintf(state->topic_name, IDENTITY_MAX_LEN, "%s.%s",
+               state->topic_prefix, state->channel_name) >= IDENTITY_MAX_LEN) {
+    return -1;
+  }
+
+  /* NOTE: we recycle the time_partitioner here for key-based partitioning.
+   * This works because the key string actually gets evaluated as a 32-bit hash
+   * so it all looks the same to the partitioner.
+   */
+  if (state->format == FORMAT_TSK || state->format == FORMAT_TSK_KEYPART) {
+    // route all identical times to the same partition
+    rd_kafka_topic_conf_set_partitioner_cb(topic_conf, time_partitioner);
+  }
+  // else: just round-robin the ascii-formatted data
+
+  // connect to kafka
+  if (state->rkt == NULL) {
+    timeseries_log(__func__, "DEBUG: Connecting to %s", state->topic_name);
+    if ((state->rkt = rd_kafka_topic_new(state->rdk_conn, state->topic_name,
+                                         topic_conf)) == NULL) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int producer_connect(timeseries_backend_t *backend)
+{
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  rd_kafka_conf_t *conf = rd_kafka_conf_new();
+  char errstr[512];
+
+  // Set the opaque pointer that will be passed to callbacks
+  rd_kafka_conf_set_opaque(conf, backend);
+
+  // Set our error handler
+  rd_kafka_conf_set_error_cb(conf, kafka_error_callback);
 
   // ask for delivery reports
   rd_kafka_conf_set_dr_msg_cb(conf, kafka_delivery_callback);
 
+  // and for statistics
+  if (state->stats_interval > 0) {
+    char interval[16];
+    snprintf(interval, sizeof(interval), "%d", state->stats_interval);
+    if (rd_kafka_conf_set(conf, "statistics.interval.ms", interval, errstr,
+                          sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+      timeseries_log(__func__, "ERROR: %s", errstr);
+      goto err;
+    }
+    rd_kafka_conf_set_stats_cb(conf, kafka_stats_callback);
+  }
+
   if (rd_kafka_conf_set(conf, "compression.codec", state->compression_codec,
                         errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
     timeseries_log(__func__, "ERROR: %s", errstr);
@@ -400,6 +1483,17 @@ static int producer_connect(timeseries_backend_t *backend)
     goto err;
   }
 
+  // messages wait in the producer queue until Kafka is reachable
+  if (state->queue_max_kbytes > 0) {
+    char kbytes[16];
+    snprintf(kbytes, sizeof(kbytes), "%" PRIu32, state->queue_max_kbytes);
+    if (rd_kafka_conf_set(conf, "queue.buffering.max.kbytes", kbytes, errstr,
+                          sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+      timeseries_log(__func__, "ERROR: %s", errstr);
+      goto err;
+    }
+  }
+
   if ((state->rdk_conn = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr,
                                       sizeof(errstr))) == NULL) {
     timeseries_log(__func__, "ERROR: Failed to create new producer: %s",
@@ -412,58 +1506,115 @@ static int producer_connect(timeseries_backend_t *backend)
     goto err;
   }
 
-  state->connected = 1;
-
-  // poll for errors
-  rd_kafka_poll(state->rdk_conn, 5000);
-
-  return state->fatal_error;
+  return 0;
 
 err:
   return -1;
 }
 
-static int kafka_connect(timeseries_backend_t *backend)
+/** Connect thread: waits for Kafka to become reachable, so that init does not
+    have to */
+static void *connect_thread(void *arg)
 {
-  timeseries_backend_kafka_state_t *state = STATE(backend);
-  int wait = 10;
-  int connect_retries = CONNECT_MAX_RETRIES;
-
-  while (state->connected == 0 && connect_retries > 0) {
-    if (producer_connect(backend) != 0) {
-      return -1;
+  timeseries_backend_kafka_state_t *state = arg;
+  const struct rd_kafka_metadata *md;
+  rd_kafka_resp_err_t err;
+  struct timespec ts;
+  int wait = CONNECT_RETRY_MIN;
+
+  pthread_mutex_lock(&state->conn_lock);
+  while (state->connect_shutdown == 0 &&
+         state->conn_state == TIMESERIES_BACKEND_CONN_CONNECTING) {
+    pthread_mutex_unlock(&state->conn_lock);
+
+    // a metadata request succeeds once a broker is reachable
+    if ((err = rd_kafka_metadata(state->rdk_conn, 0, state->rkt, &md,
+                                 METADATA_TIMEOUT)) ==
+        RD_KAFKA_RESP_ERR_NO_ERROR) {
+      rd_kafka_metadata_destroy(md);
+      conn_state_update(state, TIMESERIES_BACKEND_CONN_CONNECTED);
+      pthread_mutex_lock(&state->conn_lock);
+      break;
     }
-
-    connect_retries--;
-    if (state->connected == 0 && connect_retries > 0) {
-      timeseries_log(__func__,
-                     "WARN: Failed to connect to Kafka. Retrying in %d seconds",
-                     wait);
-      sleep(wait);
-      wait *= 2;
-      if (wait > 180) {
-        wait = 180;
-      }
+    timeseries_log(__func__,
+                   "WARN: Failed to connect to Kafka (%s). Retrying in %d "
+                   "seconds",
+                   rd_kafka_err2str(err), wait);
+
+    pthread_mutex_lock(&state->conn_lock);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += wait;
+    while (state->connect_shutdown == 0 &&
+           state->conn_state == TIMESERIES_BACKEND_CONN_CONNECTING &&
+           pthread_cond_timedwait(&state->conn_cond, &state->conn_lock, &ts) !=
+             ETIMEDOUT)
+      ;
+    wait *= 2;
+    if (wait > CONNECT_RETRY_MAX) {
+      wait = CONNECT_RETRY_MAX;
     }
   }
+  pthread_mutex_unlock(&state->conn_lock);
+
+  return NULL;
+}
+
+static int kafka_connect(timeseries_backend_t *backend)
+{
+  timeseries_backend_kafka_state_t *state = STATE(backend);
 
-  if (state->connected == 0) {
-    timeseries_log(
-      __func__, "ERROR: Failed to connect to Kafka after %d retries. Giving up",
-      CONNECT_MAX_RETRIES);
+  // create the producer and topic handles (neither waits for the brokers)
+  if (producer_connect(backend) != 0 || topic_connect(backend) != 0) {
     return -1;
   }
 
-  // connect to topics
-  if (topic_connect(backend) != 0) {
+  // messages are queued until the brokers are reachable, so wait for them in
+  // the background rather than holding up the caller
+  if (pthread_create(&state->connect_thread, NULL, connect_thread, state) !=
+      0) {
+    timeseries_log(__func__, "ERROR: Could not start connect thread");
     return -1;
   }
+  state->connect_thread_started = 1;
 
   return 0;
 }
 
-static int write_header(uint8_t *buf, size_t len, uint32_t time, char *channel,
-                        uint16_t channel_len)
+/** Hash the given key to choose its partition (for the tskkey format)
+ *
+ * The last term is stripped from the key if possible -- the last term is
+ * typically the exact metric being reported and it probably makes sense for
+ * similar metrics to be on the same partition.
+ *
+ * Example: consider the following keys...
+ *    geo.netacuity.SA.BR.pkt_cnt
+ *    geo.netacuity.SA.BR.ip_len
+ *    geo.netacuity.SA.BR.uniq_src_asn
+ *
+ * This stripping strategy will put all 3 keys on the same partition, which
+ * may be handy if our consumer wants to an analysis of traffic from Brazil.
+ */
+static uint32_t keypart_hash(const char *key, size_t key_len)
+{
+  uint32_t hash = 5381;
+  size_t i;
+
+  for (i = key_len; i > 0; i--) {
+    if (key[i - 1] == '.') {
+      key_len = i - 1;
+      break;
+    }
+  }
+
+  for (i = 0; i < key_len; i++) {
+    hash = ((hash << 5) + hash) + key[i];
+  }
+  return hash;
+}
+
+static int write_header(uint8_t *buf, size_t len, uint8_t version,
+                        uint8_t flags, uint32_t time, uint32_t base_time,
+                        uint32_t dict_id, char *channel, uint16_t channel_len)
 {
   // this function can be a bit sub-optimal because it isn't called a zillion
   // times
@@ -476,53 +1627,638 @@ static int write_header(uint8_t *buf, size_t len, uint32_t time, char *channel,
   written += HEADER_MAGIC_LEN;
 
   // write the message version
-  uint8_t version = MESSAGE_VERSION;
   SERIALIZE_VAL(buf, len, written, version);
 
   // the time of this batch
   time = htonl(time);
   SERIALIZE_VAL(buf, len, written, time);
 
-  // the name of the channel (to allow a single consumer to handle info from
-  // multiple channels)
-  uint16_t tmp16 = htons(channel_len);
-  SERIALIZE_VAL(buf, len, written, tmp16);
-  memcpy(buf, channel, channel_len);
-  buf += channel_len;
-  written += channel_len;
+  // the name of the channel (to allow a single consumer to handle info from
+  // multiple channels)
+  uint16_t tmp16 = htons(channel_len);
+  SERIALIZE_VAL(buf, len, written, tmp16);
+  assert(channel_len <= len - written);
+  memcpy(buf, channel, channel_len);
+  buf += channel_len;
+  written += channel_len;
+
+  if (version == MESSAGE_VERSION) {
+    return written;
+  }
+
+  // version 1 adds flags, the time that deltas are relative to, and the key
+  // dictionary that IDs refer to
+  SERIALIZE_VAL(buf, len, written, flags);
+  if ((flags & MESSAGE_FLAG_DELTA) != 0) {
+    base_time = htonl(base_time);
+    SERIALIZE_VAL(buf, len, written, base_time);
+  }
+  if ((flags & MESSAGE_FLAG_IDS) != 0) {
+    dict_id = htonl(dict_id);
+    SERIALIZE_VAL(buf, len, written, dict_id);
+  }
+
+  return written;
+}
+
+/** Write an unsigned LEB128 varint, returning the number of bytes written */
+static size_t write_varint(uint8_t *buf, uint64_t value)
+{
+  size_t written = 0;
+
+  while (value >= 0x80) {
+    buf[written++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  buf[written++] = (uint8_t)value;
+
+  return written;
+}
+
+/** Zigzag-encode a (two's complement) difference so that small negative
+    differences also encode as small varints */
+static uint64_t zigzag(uint64_t delta)
+{
+  return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+/** Get the length of the prefix the key shares with the previous key in the
+    message, and make the key the previous key */
+static size_t front_code(timeseries_backend_kafka_state_t *state,
+                         const char *key, size_t key_len)
+{
+  size_t shared = 0;
+  size_t max_shared =
+    key_len < state->prev_key_len ? key_len : state->prev_key_len;
+
+  while (shared < max_shared && key[shared] == state->prev_key[shared]) {
+    shared++;
+  }
+
+  state->prev_key = key;
+  state->prev_key_len = key_len;
+
+  return shared;
+}
+
+/** Write a version 1 key/value record
+ *
+ * The key is front-coded against the previous key in the message:
+ *   varint((shared prefix length << 1) | is_delta)
+ *   varint(suffix length)
+ *   suffix bytes
+ *   varint(value) (or varint(zigzag(value - previous value)) if is_delta)
+ */
+static int write_kv_v1(timeseries_backend_kafka_state_t *state, uint8_t *buf,
+                       size_t len, const char *key, size_t key_len,
+                       uint64_t value, int is_delta)
+{
+  size_t written = 0;
+  size_t shared = front_code(state, key, key_len);
+
+  // now we know the (maximum) size of the record we will write
+  assert((VARINT_MAX_LEN * 3) + (key_len - shared) <= len);
+
+  written += write_varint(buf + written, (shared << 1) | (is_delta != 0));
+  written += write_varint(buf + written, key_len - shared);
+  memcpy(buf + written, key + shared, key_len - shared);
+  written += key_len - shared;
+  written += write_varint(buf + written, value);
+
+  return written;
+}
+
+/** Write a version 1 key ID/value record
+ *
+ * IDs are mostly written in ascending order, so each is encoded as the
+ * (zigzag-encoded) gap from the ID following the previous ID in the message:
+ *   varint((gap << 2) | (defines key << 1) | is_delta)
+ *   if the record defines the key, the (front-coded) key:
+ *     varint(shared prefix length)
+ *     varint(suffix length)
+ *     suffix bytes
+ *   varint(value) (or varint(zigzag(value - previous value)) if is_delta)
+ */
+static int write_id_v1(timeseries_backend_kafka_state_t *state, uint8_t *buf,
+                       size_t len, uint32_t id, const char *key,
+                       size_t key_len, uint64_t value, int is_delta)
+{
+  size_t written = 0;
+  size_t shared;
+  uint64_t gap = zigzag((uint64_t)((int64_t)id - state->prev_id - 1));
+
+  state->prev_id = id;
+
+  written += write_varint(buf, (gap << 2) | ((key != NULL) << 1) |
+                                 (is_delta != 0));
+  if (key != NULL) {
+    shared = front_code(state, key, key_len);
+    assert((VARINT_MAX_LEN * 4) + (key_len - shared) <= len);
+    written += write_varint(buf + written, shared);
+    written += write_varint(buf + written, key_len - shared);
+    memcpy(buf + written, key + shared, key_len - shared);
+    written += key_len - shared;
+  } else {
+    assert((VARINT_MAX_LEN * 2) <= len);
+  }
+  written += write_varint(buf + written, value);
+
+  return written;
+}
+
+static int write_kv(uint8_t *buf, size_t len, const char *key, uint64_t value)
+{
+  size_t written = 0;
+  size_t key_len = strlen(key);
+  assert(key_len < UINT16_MAX);
+
+  // now we know the size of the message we will write
+  assert((key_len + sizeof(uint16_t) + sizeof(value)) <= len);
+
+  // write the key length (network byte order)
+  uint16_t tmp16 = htons(key_len);
+  SERIALIZE_VAL(buf, len, written, tmp16);
+
+  // copy the string in
+  memcpy(buf, key, key_len);
+  buf += key_len;
+  written += key_len;
+
+  // and then append the value (in network byte order)
+  value = htonll(value);
+  SERIALIZE_VAL(buf, len, written, value);
+
+  return written;
+}
+
+/** Write a pre-serialized key record followed by the value */
+static int write_record(uint8_t *buf, size_t len,
+                        timeseries_backend_kafka_kp_state_t *kp_state,
+                        uint32_t id, uint64_t value)
+{
+  size_t rec_len = kp_state->offsets[id + 1] - kp_state->offsets[id];
+
+  assert(id < kp_state->cnt);
+  assert((rec_len + sizeof(value)) <= len);
+
+  memcpy(buf, &kp_state->records[kp_state->offsets[id]], rec_len);
+
+  // and then append the value (in network byte order)
+  value = htonll(value);
+  memcpy(buf + rec_len, &value, sizeof(value));
+
+  return rec_len + sizeof(value);
+}
+
+/** Add the given KIs to the tskkey groups
+ *
+ * @return 0 if the KIs were grouped, -1 otherwise
+ *
+ * Groups only ever grow, so the grouping is maintained incrementally as keys
+ * are added rather than being recomputed at each flush.
+ */
+static int group_kis(timeseries_backend_kafka_kp_state_t *ks, uint32_t end_id)
+{
+  timeseries_backend_kafka_group_t *g;
+  uint32_t id, gi;
+  khiter_t k;
+  void *tmp;
+  int khret;
+
+  if ((tmp = realloc(ks->group_next, sizeof(uint32_t) * ks->alloc)) == NULL) {
+    return -1;
+  }
+  ks->group_next = tmp;
+
+  for (id = ks->grouped_cnt; id < end_id; id++) {
+    k = kh_put(kafka_group, ks->group_idx, ks->hashes[id], &khret);
+    if (khret < 0) {
+      return -1;
+    }
+    if (khret == 0) {
+      gi = kh_val(ks->group_idx, k);
+      g = &ks->groups[gi];
+      ks->group_next[g->tail] = id;
+      g->tail = id;
+    } else {
+      if (ks->groups_cnt == ks->groups_alloc) {
+        uint32_t new_alloc = ks->groups_alloc == 0 ? 64 : ks->groups_alloc * 2;
+        if ((tmp = realloc(ks->groups, sizeof(*ks->groups) * new_alloc)) ==
+            NULL) {
+          kh_del(kafka_group, ks->group_idx, k);
+          return -1;
+        }
+        ks->groups = tmp;
+        ks->groups_alloc = new_alloc;
+      }
+      gi = ks->groups_cnt++;
+      kh_val(ks->group_idx, k) = gi;
+      g = &ks->groups[gi];
+      g->hash = ks->hashes[id];
+      g->head = g->tail = id;
+    }
+    ks->group_next[id] = GROUP_END;
+    ks->grouped_cnt = id + 1;
+  }
+
+  return 0;
+}
+
+/** Discard all tskkey groups (they will be rebuilt on the next update) */
+static void group_reset(timeseries_backend_kafka_kp_state_t *ks)
+{
+  kh_clear(kafka_group, ks->group_idx);
+  ks->groups_cnt = 0;
+  ks->grouped_cnt = 0;
+  ks->part_order_groups = 0;
+}
+
+/** Get the partition that the time partitioner would pick for a group */
+static int32_t group_partition(timeseries_backend_kafka_group_t *g,
+                               int partition_cnt)
+{
+  return (g->hash / 60) % partition_cnt;
+}
+
+/** Order the tskkey groups by partition (if the order is out of date)
+ *
+ * @return 0 if part_order is valid, -1 otherwise
+ */
+static int group_order(timeseries_backend_kafka_kp_state_t *ks,
+                       int partition_cnt)
+{
+  uint32_t *pos;
+  uint32_t gi;
+  void *tmp;
+  int p;
+
+  if (ks->groups_cnt == 0 || (ks->part_order_groups == ks->groups_cnt &&
+                               ks->part_order_parts == partition_cnt)) {
+    return 0;
+  }
+
+  if ((tmp = realloc(ks->part_order, sizeof(uint32_t) * ks->groups_alloc)) ==
+        NULL ||
+      (pos = calloc(partition_cnt + 1, sizeof(uint32_t))) == NULL) {
+    if (tmp != NULL) {
+      ks->part_order = tmp;
+    }
+    return -1;
+  }
+  ks->part_order = tmp;
+
+  /* counting sort, so groups keep their creation order within a partition */
+  for (gi = 0; gi < ks->groups_cnt; gi++) {
+    pos[group_partition(&ks->groups[gi], partition_cnt) + 1]++;
+  }
+  for (p = 0; p < partition_cnt; p++) {
+    pos[p + 1] += pos[p];
+  }
+  for (gi = 0; gi < ks->groups_cnt; gi++) {
+    ks->part_order[pos[group_partition(&ks->groups[gi], partition_cnt)]++] =
+      gi;
+  }
+  free(pos);
+
+  ks->part_order_groups = ks->groups_cnt;
+  ks->part_order_parts = partition_cnt;
+  return 0;
+}
+
+/** Refresh the partition count of the topic (at most once every
+    PARTITION_CNT_REFRESH seconds) */
+static void refresh_partition_cnt(timeseries_backend_t *backend)
+{
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  const struct rd_kafka_metadata *md;
+  rd_kafka_resp_err_t err;
+  time_t now = time(NULL);
+
+  /* until we have connected, the request would just time out (we will try
+     again as soon as we connect) */
+  if (conn_state_get(state) != TIMESERIES_BACKEND_CONN_CONNECTED) {
+    return;
+  }
+
+  if (state->partition_cnt_time != 0 &&
+      now - state->partition_cnt_time < PARTITION_CNT_REFRESH) {
+    return;
+  }
+  state->partition_cnt_time = now;
+
+  if ((err = rd_kafka_metadata(state->rdk_conn, 0, state->rkt, &md,
+                               METADATA_TIMEOUT)) !=
+      RD_KAFKA_RESP_ERR_NO_ERROR) {
+    timeseries_log(__func__, "WARN: Could not get metadata for %s: %s",
+                   state->topic_name, rd_kafka_err2str(err));
+    return;
+  }
+
+  if (md->topic_cnt == 1 && md->topics[0].err == RD_KAFKA_RESP_ERR_NO_ERROR &&
+      md->topics[0].partition_cnt > 0) {
+    state->partition_cnt = md->topics[0].partition_cnt;
+  }
+  rd_kafka_metadata_destroy(md);
+}
+
+/** Generate a (probably) unique key dictionary ID */
+static uint32_t dict_id_new(void *salt)
+{
+  uint64_t x = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^
+               (uint64_t)(uintptr_t)salt;
+
+  // splitmix64 finalizer
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return (uint32_t)x;
+}
+
+/** Write the value of a KI, starting a new message (i.e. writing the header)
+ *  if needed
+ *
+ * @return the number of bytes written, -1 if an error occurred
+ */
+static int write_kp_record(timeseries_backend_t *backend, uint8_t *buf,
+                           size_t len, timeseries_kp_t *kp,
+                           timeseries_backend_kafka_kp_state_t *ks,
+                           uint32_t id, uint32_t time)
+{
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  uint64_t value = timeseries_kp_ki_get_value(kp, id);
+  const char *key;
+  size_t key_len;
+  size_t written = 0;
+  int is_delta = 0;
+  int s;
+
+  if (state->buffer_written == 0) {
+    // new message, so write the header
+    if ((s = write_header(buf, len, state->version,
+                          (ks->deltas ? MESSAGE_FLAG_DELTA : 0) |
+                            (ks->defined != NULL ? MESSAGE_FLAG_IDS : 0),
+                          time, ks->last_time, ks->dict_id,
+                          state->channel_name, state->channel_name_len)) <= 0) {
+      return -1;
+    }
+    written += s;
+    state->prev_key_len = 0;
+    state->prev_id = -1;
+  }
+
+  if (state->version == MESSAGE_VERSION) {
+    s = write_record(buf + written, len - written, ks, id, value);
+  } else {
+    // the records hold the length-prefixed key
+    key = (const char *)&ks->records[ks->offsets[id] + sizeof(uint16_t)];
+    key_len = ks->offsets[id + 1] - ks->offsets[id] - sizeof(uint16_t);
+
+    if (ks->sent_seq != NULL) {
+      // only keys sent in the last flush can be sent as a delta
+      is_delta = ks->deltas && ks->sent_seq[id] == ks->flush_seq;
+      if (is_delta) {
+        uint64_t delta = value - ks->last_values[id];
+        ks->last_values[id] = value;
+        value = zigzag(delta);
+      } else {
+        ks->last_values[id] = value;
+      }
+      ks->sent_seq[id] = ks->flush_seq + 1;
+    }
+
+    if (ks->defined == NULL) {
+      s = write_kv_v1(state, buf + written, len - written, key, key_len, value,
+                      is_delta);
+    } else if (ks->dict_full || ks->defined[id] == 0) {
+      // (re-)define this key
+      ks->defined[id] = 1;
+      s = write_id_v1(state, buf + written, len - written, id, key, key_len,
+                      value, is_delta);
+    } else {
+      s = write_id_v1(state, buf + written, len - written, id, NULL, 0, value,
+                      is_delta);
+    }
+  }
+
+  if (s <= 0) {
+    return -1;
+  }
+  return written + s;
+}
+
+/** Decide whether the KP flush that is starting can be delta-encoded, and
+    whether it must re-publish the whole key dictionary */
+static void delta_flush_begin(timeseries_backend_kafka_state_t *state,
+                              timeseries_backend_kafka_kp_state_t *ks)
+{
+  ks->deltas = ks->sent_seq != NULL && ks->flush_seq > 0 &&
+               ks->delta_flushes < state->delta_max;
+  ks->dict_full = ks->defined != NULL && ks->dict_age == 0;
+}
+
+/** Record the outcome of a KP flush for delta encoding and key IDs
+ *
+ * @return rc, or -1 if any of the messages of the flush were dropped
+ */
+static int delta_flush_end(timeseries_backend_t *backend,
+                           timeseries_backend_kafka_kp_state_t *ks,
+                           uint32_t time, int rc)
+{
+  /* the consumer will not see the lost messages (or will only see them after
+     later ones), so later flushes must not be relative to this one */
+  if (rc == 0 && STATE(backend)->flush_lost != 0) {
+    timeseries_log(__func__,
+                   "WARN: some messages for time %" PRIu32 " were not sent",
+                   time);
+    rc = -1;
+  }
+
+  if (ks != NULL && ks->defined != NULL) {
+    /* if some messages were not sent, the consumer may have missed key
+       definitions, so re-publish the whole dictionary in the next flush */
+    ks->dict_age =
+      (rc == 0) ? (ks->dict_age + 1) % STATE(backend)->dict_interval : 0;
+  }
+
+  if (ks == NULL || ks->sent_seq == NULL) {
+    return rc;
+  }
+
+  ks->flush_seq++;
+  if (rc == 0) {
+    ks->last_time = time;
+    ks->delta_flushes = ks->deltas ? ks->delta_flushes + 1 : 0;
+  } else {
+    /* the consumer may have missed some values, so the next flush must
+       contain only absolute values. since flush_seq has moved on, no KI is
+       considered to have been sent in the last flush */
+    ks->delta_flushes = UINT32_MAX;
+  }
+  return rc;
+}
+
+static int write_ascii(uint8_t *buf, size_t len, const char *key,
+                       uint64_t value, uint32_t time)
+{
+  return snprintf((char*)buf, len, "%s %" PRIu64 " %" PRIu32 "\n", key, value, time);
+}
+
+/** Write the resolved key (the version 0 key record, and a nul) for the given
+    key to buf (which must be large enough) */
+static size_t resolve_key(uint8_t *buf, const char *key, size_t key_len)
+{
+  uint16_t tmp16 = htons(key_len);
+
+  memcpy(buf, &tmp16, sizeof(tmp16));
+  memcpy(buf + sizeof(tmp16), key, key_len + 1);
+  return sizeof(tmp16) + key_len + 1;
+}
+
+/** Write the value of a key resolved by resolve_key, starting a new message
+ *  (i.e. writing the header) if needed
+ *
+ * @return the number of bytes written, -1 if an error occurred
+ *
+ * A resolved key is the (version 0) key record, followed by a nul so that the
+ * key can also be used as a string.
+ */
+static int write_resolved(timeseries_backend_t *backend, uint8_t *buf,
+                          size_t len, const uint8_t *id, size_t id_len,
+                          uint64_t value, uint32_t time)
+{
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  const char *key = (const char *)id + sizeof(uint16_t);
+  size_t key_len = id_len - sizeof(uint16_t) - 1;
+  size_t written = 0;
+  int s;
+
+  assert(id_len > sizeof(uint16_t) && id[id_len - 1] == '\0');
+
+  if (state->format == FORMAT_ASCII) {
+    return write_ascii(buf, len, key, value, time);
+  }
+
+  if (state->buffer_written == 0) {
+    // new message, so write the header
+    if ((s = write_header(buf, len, state->version, 0, time, 0, 0,
+                          state->channel_name, state->channel_name_len)) <=
+        0) {
+      return -1;
+    }
+    written += s;
+    state->prev_key_len = 0;
+  }
+
+  if (state->version == MESSAGE_VERSION) {
+    // the key record is ready to go
+    assert(id_len - 1 + sizeof(value) <= len - written);
+    memcpy(buf + written, id, id_len - 1);
+    written += id_len - 1;
+    value = htonll(value);
+    memcpy(buf + written, &value, sizeof(value));
+    written += sizeof(value);
+  } else {
+    if ((s = write_kv_v1(state, buf + written, len - written, key, key_len,
+                         value, 0)) <= 0) {
+      return -1;
+    }
+    written += s;
+    // the caller may free the key before the next one is written
+    memcpy(state->prev_key_buf, key, key_len);
+    state->prev_key = state->prev_key_buf;
+  }
 
   return written;
 }
 
-static int write_kv(uint8_t *buf, size_t len, const char *key, uint64_t value)
+/** Flush a KP using the tskkey format
+ *
+ * Keys are written a group (i.e. partition hash) at a time. If the partition
+ * count of the topic is known, the groups are ordered by partition and each
+ * message is filled with all the groups bound for one partition (which is
+ * the partition the time partitioner would have chosen for each of them).
+ * Otherwise each group is sent in its own message(s).
+ */
+static int kp_flush_keypart(timeseries_backend_t *backend, timeseries_kp_t *kp,
+                            timeseries_backend_kafka_kp_state_t *ks,
+                            uint32_t time)
 {
-  size_t written = 0;
-  size_t key_len = strlen(key);
-  assert(key_len < UINT16_MAX);
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  timeseries_backend_kafka_group_t *g;
+  uint8_t *ptr = state->buffer;
+  size_t len = BUFFER_LEN;
+  ssize_t s = 0;
+  uint32_t msgkey = 0;
+  uint32_t i, id;
+  int partition_cnt;
+  int32_t partition = DEFAULT_PARTITION;
+  int32_t last_partition = DEFAULT_PARTITION;
+
+  refresh_partition_cnt(backend);
+  partition_cnt = state->partition_cnt;
+
+  /* if partitions were added, keys have moved to other partitions, whose
+     consumers have not seen their earlier values or definitions */
+  if (partition_cnt > 0 && ks->flush_parts > 0 &&
+      partition_cnt != ks->flush_parts) {
+    timeseries_log(__func__, "WARN: partition count changed from %d to %d, "
+                             "sending absolute values and key names",
+                   ks->flush_parts, partition_cnt);
+    ks->deltas = 0;
+    ks->dict_full = ks->defined != NULL;
+  }
+  if (partition_cnt > 0) {
+    ks->flush_parts = partition_cnt;
+  }
 
-  // now we know the size of the message we will write
-  assert((key_len + sizeof(uint16_t) + sizeof(value)) <= len);
+  if (partition_cnt > 0 && group_order(ks, partition_cnt) != 0) {
+    timeseries_log(__func__, "WARN: Could not order groups by partition");
+    partition_cnt = 0;
+  }
 
-  // write the key length (network byte order)
-  uint16_t tmp16 = htons(key_len);
-  SERIALIZE_VAL(buf, len, written, tmp16);
+  for (i = 0; i < ks->groups_cnt; i++) {
+    if (partition_cnt > 0) {
+      g = &ks->groups[ks->part_order[i]];
+      partition = group_partition(g, partition_cnt);
+    } else {
+      g = &ks->groups[i];
+    }
 
-  // copy the string in
-  memcpy(buf, key, key_len);
-  buf += key_len;
-  written += key_len;
+    /* a message may only hold groups for a single partition */
+    if (state->buffer_written > 0 &&
+        (partition_cnt == 0 || partition != last_partition)) {
+      SEND_MSG(last_partition, state->buffer, state->buffer_written, msgkey,
+               ptr, len);
+    }
 
-  // and then append the value (in network byte order)
-  value = htonll(value);
-  SERIALIZE_VAL(buf, len, written, value);
+    /* KIs are in ID order, so stop at the first one the KP is not flushing */
+    for (id = g->head; id != GROUP_END && id < timeseries_kp_ki_cnt(kp);
+         id = ks->group_next[id]) {
+      if (timeseries_kp_ki_enabled(kp, id) == 0) {
+        continue;
+      }
 
-  return written;
-}
+      if ((s = write_kp_record(backend, ptr, (len - state->buffer_written), kp,
+                               ks, id, time)) <= 0) {
+        goto err;
+      }
+      state->buffer_written += s;
+      ptr += s;
+      msgkey = g->hash;
+      last_partition = partition;
 
-static int write_ascii(uint8_t *buf, size_t len, const char *key,
-                       uint64_t value, uint32_t time)
-{
-  return snprintf((char*)buf, len, "%s %" PRIu64 " %" PRIu32 "\n", key, value, time);
+      SEND_IF_FULL(last_partition, state->buffer, state->buffer_written,
+                   msgkey, ptr, len);
+    }
+  }
+
+  SEND_MSG(last_partition, state->buffer, state->buffer_written, msgkey, ptr,
+           len);
+
+  return 0;
+
+err:
+  return -1;
 }
 
 /* ===== PUBLIC FUNCTIONS BELOW THIS POINT ===== */
@@ -544,16 +2280,41 @@ int timeseries_backend_kafka_init(timeseries_backend_t *backend, int argc,
     return -1;
   }
   timeseries_backend_register_state(backend, state);
+  pthread_mutex_init(&state->conn_lock, NULL);
+  pthread_cond_init(&state->conn_cond, NULL);
+  pthread_mutex_init(&state->rdstats_lock, NULL);
+  pthread_mutex_init(&state->gen_lock, NULL);
+  pthread_mutex_init(&state->pool_lock, NULL);
 
   state->compression_codec = strdup(DEFAULT_COMPRESSION);
+  state->topic_prefix = strdup(DEFAULT_TOPIC);
   state->format = DEFAULT_FORMAT;
+  state->buffer_max = DEFAULT_BUFFER_CNT;
+  state->stats_interval = DEFAULT_STATS_INTERVAL;
 
   /* parse the command line args */
   if (parse_args(backend, argc, argv) != 0) {
     return -1;
   }
 
-  /* connect to kafka and create producer */
+  /* messages are produced without copying, so each message in flight holds
+     one of these buffers until its delivery report is received */
+  if ((state->buffers = malloc(sizeof(uint8_t *) * state->buffer_max)) ==
+        NULL ||
+      (state->buffers_free = malloc(sizeof(uint8_t *) * state->buffer_max)) ==
+        NULL ||
+      (state->buffer = buffer_get(backend)) == NULL) {
+    timeseries_log(__func__, "could not allocate message buffers");
+    goto err;
+  }
+
+  if (state->version == MESSAGE_VERSION_V1 &&
+      (state->prev_key_buf = malloc(UINT16_MAX)) == NULL) {
+    timeseries_log(__func__, "could not allocate key buffer");
+    goto err;
+  }
+
+  /* create the producer (this does not wait for kafka to be reachable) */
   if (kafka_connect(backend) != 0) {
     goto err;
   }
@@ -574,6 +2335,15 @@ void timeseries_backend_kafka_free(timeseries_backend_t *backend)
     return;
   }
 
+  if (state->connect_thread_started != 0) {
+    pthread_mutex_lock(&state->conn_lock);
+    state->connect_shutdown = 1;
+    pthread_cond_signal(&state->conn_cond);
+    pthread_mutex_unlock(&state->conn_lock);
+    pthread_join(state->connect_thread, NULL);
+    state->connect_thread_started = 0;
+  }
+
   if (state->rdk_conn != NULL) {
     int drain_wait_cnt = 12;
     rd_kafka_poll(state->rdk_conn, 0);
@@ -585,6 +2355,14 @@ void timeseries_backend_kafka_free(timeseries_backend_t *backend)
       rd_kafka_poll(state->rdk_conn, 5000);
       drain_wait_cnt--;
     }
+#ifdef RD_KAFKA_PURGE_F_QUEUE
+    /* give up on anything still queued, so that the delivery callback frees
+       the message tags */
+    if (rd_kafka_outq_len(state->rdk_conn) > 0) {
+      rd_kafka_purge(state->rdk_conn, RD_KAFKA_PURGE_F_QUEUE);
+      rd_kafka_poll(state->rdk_conn, 0);
+    }
+#endif
   }
 
   free(state->broker_uri);
@@ -599,6 +2377,9 @@ void timeseries_backend_kafka_free(timeseries_backend_t *backend)
   free(state->topic_prefix);
   state->topic_prefix = NULL;
 
+  free(state->prev_key_buf);
+  state->prev_key_buf = NULL;
+
   if (state->rkt != NULL) {
     rd_kafka_topic_destroy(state->rkt);
     state->rkt = NULL;
@@ -610,6 +2391,24 @@ void timeseries_backend_kafka_free(timeseries_backend_t *backend)
     state->rdk_conn = NULL;
   }
 
+  /* librdkafka no longer references any message buffers */
+  while (state->buffers_cnt > 0) {
+    free(state->buffers[--state->buffers_cnt]);
+  }
+  free(state->buffers);
+  state->buffers = NULL;
+  free(state->buffers_free);
+  state->buffers_free = NULL;
+  free(state->copy_buffer);
+  state->copy_buffer = NULL;
+  state->buffer = NULL;
+
+  pthread_mutex_destroy(&state->conn_lock);
+  pthread_cond_destroy(&state->conn_cond);
+  pthread_mutex_destroy(&state->rdstats_lock);
+  pthread_mutex_destroy(&state->gen_lock);
+  pthread_mutex_destroy(&state->pool_lock);
+
   timeseries_backend_free_state(backend);
   return;
 }
@@ -617,146 +2416,226 @@ void timeseries_backend_kafka_free(timeseries_backend_t *backend)
 int timeseries_backend_kafka_kp_init(timeseries_backend_t *backend,
                                      timeseries_kp_t *kp, void **kp_state_p)
 {
-  /* we do not need any state */
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  timeseries_backend_kafka_kp_state_t *kp_state;
+
   assert(kp_state_p != NULL);
   *kp_state_p = NULL;
+
+  /* the ascii format writes the keys directly */
+  if (state->format == FORMAT_ASCII) {
+    return 0;
+  }
+
+  if ((kp_state = malloc_zero(sizeof(timeseries_backend_kafka_kp_state_t))) ==
+        NULL ||
+      (kp_state->offsets = malloc_zero(sizeof(size_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc kafka KP state");
+    free(kp_state);
+    return -1;
+  }
+
+  if (state->format == FORMAT_TSK_KEYPART &&
+      (kp_state->group_idx = kh_init(kafka_group)) == NULL) {
+    timeseries_log(__func__, "could not malloc kafka KP state");
+    free(kp_state->offsets);
+    free(kp_state);
+    return -1;
+  }
+
+  /* a consumer may see dictionaries from many producers (and from many
+     restarts of a producer), so make this one's ID unlikely to collide */
+  kp_state->dict_id = dict_id_new(kp_state);
+
+  *kp_state_p = kp_state;
   return 0;
 }
 
 void timeseries_backend_kafka_kp_free(timeseries_backend_t *backend,
                                       timeseries_kp_t *kp, void *kp_state)
 {
-  /* we did not allocate any state */
-  assert(kp_state == NULL);
+  timeseries_backend_kafka_kp_state_t *ks = kp_state;
+
+  if (ks == NULL) {
+    return;
+  }
+
+  free(ks->records);
+  free(ks->offsets);
+  free(ks->hashes);
+  free(ks->group_next);
+  free(ks->groups);
+  free(ks->part_order);
+  free(ks->last_values);
+  free(ks->sent_seq);
+  free(ks->defined);
+  if (ks->group_idx != NULL) {
+    kh_destroy(kafka_group, ks->group_idx);
+  }
+  free(ks);
   return;
 }
 
 int timeseries_backend_kafka_kp_ki_update(timeseries_backend_t *backend,
-                                          timeseries_kp_t *kp)
+                                          timeseries_kp_t *kp,
+                                          uint32_t first_id, uint32_t end_id)
 {
-  /* we don't need to do anything */
+  timeseries_backend_kafka_kp_state_t *ks =
+    timeseries_kp_get_backend_state(kp, TIMESERIES_BACKEND_ID_KAFKA);
+  const char *key;
+  size_t key_len;
+  uint16_t tmp16;
+  uint32_t id;
+  void *tmp;
+
+  if (ks == NULL || first_id >= end_id) {
+    return 0;
+  }
+
+  /* if a previous update failed part-way, rebuild from first_id */
+  assert(first_id <= ks->cnt);
+  ks->cnt = first_id;
+  ks->records_len = ks->offsets[first_id];
+
+  if (end_id > ks->alloc) {
+    if ((tmp = realloc(ks->offsets, sizeof(size_t) * (end_id + 1))) == NULL) {
+      goto err;
+    }
+    ks->offsets = tmp;
+    if ((tmp = realloc(ks->hashes, sizeof(uint32_t) * end_id)) == NULL) {
+      goto err;
+    }
+    ks->hashes = tmp;
+    if (STATE(backend)->delta_max > 0) {
+      if ((tmp = realloc(ks->last_values, sizeof(uint64_t) * end_id)) ==
+          NULL) {
+        goto err;
+      }
+      ks->last_values = tmp;
+      if ((tmp = realloc(ks->sent_seq, sizeof(uint32_t) * end_id)) == NULL) {
+        goto err;
+      }
+      ks->sent_seq = tmp;
+      /* these KIs have never been sent */
+      memset(&ks->sent_seq[ks->alloc], 0,
+             sizeof(uint32_t) * (end_id - ks->alloc));
+    }
+    if (STATE(backend)->dict_interval > 0) {
+      if ((tmp = realloc(ks->defined, end_id)) == NULL) {
+        goto err;
+      }
+      ks->defined = tmp;
+      memset(&ks->defined[ks->alloc], 0, end_id - ks->alloc);
+    }
+    ks->alloc = end_id;
+  }
+
+  for (id = first_id; id < end_id; id++) {
+    key = timeseries_kp_ki_get_key(kp, id);
+    key_len = strlen(key);
+    assert(key_len < UINT16_MAX);
+
+    while (ks->records_len + sizeof(tmp16) + key_len > ks->records_alloc) {
+      size_t new_alloc = ks->records_alloc == 0 ? 4096 : ks->records_alloc * 2;
+      if ((tmp = realloc(ks->records, new_alloc)) == NULL) {
+        goto err;
+      }
+      ks->records = tmp;
+      ks->records_alloc = new_alloc;
+    }
+
+    // the key length (network byte order) followed by the key itself
+    tmp16 = htons(key_len);
+    memcpy(&ks->records[ks->records_len], &tmp16, sizeof(tmp16));
+    memcpy(&ks->records[ks->records_len + sizeof(tmp16)], key, key_len);
+    ks->records_len += sizeof(tmp16) + key_len;
+    ks->offsets[id + 1] = ks->records_len;
+
+    ks->hashes[id] = keypart_hash(key, key_len);
+    ks->cnt = id + 1;
+  }
+
+  if (ks->group_idx != NULL) {
+    /* KIs being re-added can't be taken out of their groups, so regroup */
+    if (first_id < ks->grouped_cnt) {
+      group_reset(ks);
+    }
+    if (group_kis(ks, end_id) != 0) {
+      group_reset(ks);
+      goto err;
+    }
+  }
+
   return 0;
+
+err:
+  timeseries_log(__func__, "could not grow kafka key records");
+  return -1;
 }
 
 void timeseries_backend_kafka_kp_ki_free(timeseries_backend_t *backend,
-                                         timeseries_kp_t *kp,
-                                         timeseries_kp_ki_t *ki, void *ki_state)
+                                         timeseries_kp_t *kp, uint32_t ki_id,
+                                         void *ki_state)
 {
   /* we did not allocate any state */
   assert(ki_state == NULL);
   return;
 }
 
-uint32_t keyhash(const char *key) {
-  uint32_t hash = 5381;
-  int c;
-
-  while ((c = *key++)) {
-    hash = ((hash << 5) + hash) + c;
-  }
-  return hash;
-}
-
 int timeseries_backend_kafka_kp_flush(timeseries_backend_t *backend,
                                       timeseries_kp_t *kp, uint32_t time)
 {
   timeseries_backend_kafka_state_t *state = STATE(backend);
-  timeseries_kp_ki_t *ki = NULL;
-  int id;
+  timeseries_backend_kafka_kp_state_t *ks =
+    timeseries_kp_get_backend_state(kp, TIMESERIES_BACKEND_ID_KAFKA);
+  uint32_t id;
 
   uint8_t *ptr = state->buffer;
   size_t len = BUFFER_LEN;
   ssize_t s = 0;
-  uint32_t thishash = 0, lasthash = 0, msgkey = 0;
-  const char *key = NULL;
-  char *sptr;
+  uint32_t msgkey = 0;
 
   assert(state->buffer_written == 0);
+  assert(state->format == FORMAT_ASCII || ks != NULL);
+  state->gen_time = time;
+  state->flush_lost = 0;
+  if (ptr == NULL && (ptr = state->buffer = buffer_get(backend)) == NULL) {
+    return -1;
+  }
 
+  if (ks != NULL) {
+    delta_flush_begin(state, ks);
+  }
 
-  TIMESERIES_KP_FOREACH_KI(kp, ki, id)
-  {
-    if (timeseries_kp_ki_enabled(ki) == 0) {
-      continue;
-    }
+  if (state->format == FORMAT_TSK_KEYPART) {
+    return delta_flush_end(backend, ks, time,
+                           kp_flush_keypart(backend, kp, ks, time));
+  }
 
+  TIMESERIES_KP_FOREACH_ENABLED_KI(kp, id)
+  {
     switch (state->format) {
     case FORMAT_ASCII:
       if ((s = write_ascii(ptr, (len - state->buffer_written),
-                           timeseries_kp_ki_get_key(ki),
-                           timeseries_kp_ki_get_value(ki), time)) <= 0) {
+                           timeseries_kp_ki_get_key(kp, id),
+                           timeseries_kp_ki_get_value(kp, id), time)) <= 0) {
         goto err;
       }
       msgkey = time;
       break;
 
     case FORMAT_TSK:
-      if (state->buffer_written == 0) {
-        // new message, so write the header
-        if ((s = write_header(ptr, (len - state->buffer_written), time,
-                              state->channel_name, state->channel_name_len)) <=
-            0) {
-          goto err;
-        }
-        state->buffer_written += s;
-        ptr += s;
-      }
-
-      if ((s = write_kv(ptr, (len - state->buffer_written),
-                        timeseries_kp_ki_get_key(ki),
-                        timeseries_kp_ki_get_value(ki))) <= 0) {
+      if ((s = write_kp_record(backend, ptr, (len - state->buffer_written), kp,
+                               ks, id, time)) <= 0) {
         goto err;
       }
       msgkey = time;
       break;
 
     case FORMAT_TSK_KEYPART:
-      key = timeseries_kp_ki_get_key(ki);
-      /* Strip the last term from the key if possible -- the last term is
-       * typically the exact metric being reported and it probably makes
-       * sense for similar metrics to be on the same partition.
-       *
-       * Example: consider the following keys...
-       *    geo.netacuity.SA.BR.pkt_cnt
-       *    geo.netacuity.SA.BR.ip_len
-       *    geo.netacuity.SA.BR.uniq_src_asn
-       *
-       * This stripping strategy will put all 3 keys on the same partition,
-       * which may be handy if our consumer wants to an analysis of
-       * traffic from Brazil.
-       */
-      sptr = strrchr(key, '.');
-      if (sptr != NULL) {
-        *sptr = '\0';
-        thishash = keyhash(key);
-        *sptr = '.';
-      } else {
-        thishash = keyhash(key);
-      }
-
-      if (thishash != lasthash && state->buffer_written > 0) {
-        SEND_MSG(DEFAULT_PARTITION, state->buffer, state->buffer_written,
-                 lasthash, ptr, len);
-      }
-
-      if (state->buffer_written == 0) {
-        // new message, so write the header
-        if ((s = write_header(ptr, (len - state->buffer_written), time,
-                              state->channel_name, state->channel_name_len)) <=
-            0) {
-          goto err;
-        }
-        state->buffer_written += s;
-        ptr += s;
-      }
-
-      if ((s = write_kv(ptr, (len - state->buffer_written), key,
-                        timeseries_kp_ki_get_value(ki))) <= 0) {
-        goto err;
-      }
-      lasthash = thishash;
-      msgkey = thishash;
-      break;
+      /* handled by kp_flush_keypart */
+      assert(0);
+      goto err;
     }
     state->buffer_written += s;
     ptr += s;
@@ -768,10 +2647,10 @@ int timeseries_backend_kafka_kp_flush(timeseries_backend_t *backend,
   SEND_MSG(DEFAULT_PARTITION, state->buffer, state->buffer_written, msgkey, ptr,
            len);
 
-  return 0;
+  return delta_flush_end(backend, ks, time, 0);
 
 err:
-  return -1;
+  return delta_flush_end(backend, ks, time, -1);
 }
 
 int timeseries_backend_kafka_set_single(timeseries_backend_t *backend,
@@ -784,8 +2663,11 @@ int timeseries_backend_kafka_set_single(timeseries_backend_t *backend,
   size_t len = BUFFER_LEN;
   ssize_t s = 0;
   uint32_t msgkey = time;
-  char *sptr;
   assert(state->buffer_written == 0);
+  state->gen_time = time;
+  if (ptr == NULL && (ptr = state->buffer = buffer_get(backend)) == NULL) {
+    return -1;
+  }
 
   switch (state->format) {
   case FORMAT_ASCII:
@@ -795,24 +2677,25 @@ int timeseries_backend_kafka_set_single(timeseries_backend_t *backend,
     break;
 
   case FORMAT_TSK_KEYPART:
-    sptr = strrchr(key, '.');
-    if (sptr != NULL) {
-      *sptr = '\0';
-      msgkey = keyhash(key);
-      *sptr = '.';
-    } else {
-      msgkey = keyhash(key);
-    }
+    msgkey = keypart_hash(key, strlen(key));
     /* FALL THROUGH */
   case FORMAT_TSK:
-    if ((s = write_header(ptr, (len - state->buffer_written), time,
-                          state->channel_name, state->channel_name_len)) <= 0) {
+    if ((s = write_header(ptr, (len - state->buffer_written), state->version, 0,
+                          time, 0, 0, state->channel_name,
+                          state->channel_name_len)) <= 0) {
       goto err;
     }
     state->buffer_written += s;
     ptr += s;
 
-    if ((s = write_kv(ptr, (len - state->buffer_written), key, value)) <= 0) {
+    if (state->version == MESSAGE_VERSION) {
+      s = write_kv(ptr, (len - state->buffer_written), key, value);
+    } else {
+      state->prev_key_len = 0;
+      s = write_kv_v1(state, ptr, (len - state->buffer_written), key,
+                      strlen(key), value, 0);
+    }
+    if (s <= 0) {
       goto err;
     }
     break;
@@ -835,25 +2718,113 @@ int timeseries_backend_kafka_set_single_by_id(timeseries_backend_t *backend,
                                               uint8_t *id, size_t id_len,
                                               uint64_t value, uint32_t time)
 {
-  /* we chose not to implement this for memory efficiency */
-  assert(0 && "Not implemented");
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+
+  uint8_t *ptr = state->buffer;
+  size_t len = BUFFER_LEN;
+  ssize_t s = 0;
+  uint32_t msgkey = time;
+  assert(state->buffer_written == 0);
+  state->gen_time = time;
+  if (ptr == NULL && (ptr = state->buffer = buffer_get(backend)) == NULL) {
+    return -1;
+  }
+
+  if (state->format == FORMAT_TSK_KEYPART) {
+    msgkey = keypart_hash((const char *)id + sizeof(uint16_t),
+                          id_len - sizeof(uint16_t) - 1);
+  }
+
+  if ((s = write_resolved(backend, ptr, len, id, id_len, value, time)) <= 0) {
+    goto err;
+  }
+  state->buffer_written += s;
+  ptr += s;
+
+  SEND_MSG(DEFAULT_PARTITION, state->buffer, state->buffer_written, msgkey, ptr,
+           len);
+
+  return 0;
+
+err:
   return -1;
 }
 
+int timeseries_backend_kafka_flush(timeseries_backend_t *backend)
+{
+  /* single values are produced as soon as they are set */
+  return 0;
+}
+
 int timeseries_backend_kafka_set_bulk_init(timeseries_backend_t *backend,
                                            uint32_t key_cnt, uint32_t time)
 {
-  /* we chose not to implement this for memory efficiency */
-  assert(0 && "Not implemented");
-  return -1;
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+
+  /* values are streamed into the message buffer as they are set, so nothing
+     else may be written until the bulk set is complete */
+  assert(state->bulk_expect == 0 && state->bulk_cnt == 0);
+  assert(state->buffer_written == 0);
+
+  state->bulk_expect = key_cnt;
+  state->bulk_time = time;
+  state->gen_time = time;
+  return 0;
 }
 
 int timeseries_backend_kafka_set_bulk_by_id(timeseries_backend_t *backend,
                                             uint8_t *id, size_t id_len,
                                             uint64_t value)
 {
-  /* we chose not to implement this for memory efficiency */
-  assert(0 && "Not implemented");
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+
+  uint8_t *ptr = state->buffer;
+  size_t len = BUFFER_LEN;
+  ssize_t s = 0;
+  uint32_t msgkey = state->bulk_time;
+  int done;
+
+  assert(state->bulk_expect > 0);
+  if (ptr == NULL && (ptr = state->buffer = buffer_get(backend)) == NULL) {
+    return -1;
+  }
+  ptr += state->buffer_written;
+
+  /* the bulk set is over after this value, even if it cannot be sent */
+  if ((done = (++state->bulk_cnt == state->bulk_expect)) != 0) {
+    state->bulk_cnt = 0;
+    state->bulk_expect = 0;
+  }
+
+  if (state->format == FORMAT_TSK_KEYPART) {
+    /* a message can only hold keys with the same partition hash */
+    msgkey = keypart_hash((const char *)id + sizeof(uint16_t),
+                          id_len - sizeof(uint16_t) - 1);
+    if (state->buffer_written > 0 && msgkey != state->bulk_msgkey) {
+      SEND_MSG(DEFAULT_PARTITION, state->buffer, state->buffer_written,
+               state->bulk_msgkey, ptr, len);
+    }
+    state->bulk_msgkey = msgkey;
+  }
+
+  if ((s = write_resolved(backend, ptr, (len - state->buffer_written), id,
+                          id_len, value, state->bulk_time)) <= 0) {
+    goto err;
+  }
+  state->buffer_written += s;
+  ptr += s;
+
+  if (done != 0) {
+    SEND_MSG(DEFAULT_PARTITION, state->buffer, state->buffer_written, msgkey,
+             ptr, len);
+  } else {
+    SEND_IF_FULL(DEFAULT_PARTITION, state->buffer, state->buffer_written,
+                 msgkey, ptr, len);
+  }
+
+  return 0;
+
+err:
   return -1;
 }
 
@@ -861,26 +2832,154 @@ size_t timeseries_backend_kafka_resolve_key(timeseries_backend_t *backend,
                                             const char *key,
                                             uint8_t **backend_key)
 {
-  *backend_key = NULL;
-  return 0;
+  size_t key_len = strlen(key);
+
+  if (key_len > UINT16_MAX) {
+    timeseries_log(__func__, "Key is too long (%zu bytes)", key_len);
+    *backend_key = NULL;
+    return 0;
+  }
+
+  if ((*backend_key = malloc(sizeof(uint16_t) + key_len + 1)) == NULL) {
+    return 0;
+  }
+  return resolve_key(*backend_key, key, key_len);
 }
 
 int timeseries_backend_kafka_resolve_key_bulk(
   timeseries_backend_t *backend, uint32_t keys_cnt, const char *const *keys,
   uint8_t **backend_keys, size_t *backend_key_lens, int *contig_alloc)
 {
+  size_t total = 0;
+  uint8_t *buf;
   int i;
 
+  assert(contig_alloc != NULL);
+  *contig_alloc = 0;
+
+  if (keys_cnt == 0) {
+    return 0;
+  }
+
+  /* the resolved keys are small, so put them all in one allocation */
   for (i = 0; i < keys_cnt; i++) {
-    if ((backend_key_lens[i] = timeseries_backend_kafka_resolve_key(
-           backend, keys[i], &(backend_keys[i]))) == 0) {
-      timeseries_log(__func__, "Could not resolve key ID");
+    backend_key_lens[i] = strlen(keys[i]);
+    if (backend_key_lens[i] > UINT16_MAX) {
+      timeseries_log(__func__, "Key is too long (%zu bytes)",
+                     backend_key_lens[i]);
       return -1;
     }
+    total += sizeof(uint16_t) + backend_key_lens[i] + 1;
   }
 
-  assert(contig_alloc != NULL);
-  *contig_alloc = 0;
+  if ((buf = malloc(total)) == NULL) {
+    timeseries_log(__func__, "Could not resolve key IDs");
+    return -1;
+  }
+
+  for (i = 0; i < keys_cnt; i++) {
+    backend_keys[i] = buf;
+    backend_key_lens[i] = resolve_key(buf, keys[i], backend_key_lens[i]);
+    buf += backend_key_lens[i];
+  }
+  *contig_alloc = 1;
+
+  return 0;
+}
+
+int timeseries_backend_kafka_get_stats(timeseries_backend_t *backend,
+                                       timeseries_backend_stats_cb_t *cb,
+                                       void *user)
+{
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  char name[64];
+  int in_flight;
+  int i;
+
+  pthread_mutex_lock(&state->pool_lock);
+  in_flight = state->buffers_cnt - state->buffers_free_cnt;
+  pthread_mutex_unlock(&state->pool_lock);
+  cb(backend, "buffers_in_flight",
+     in_flight - (state->buffer != NULL && state->buffer != state->copy_buffer),
+     user);
+  cb(backend, "buffer_waits", state->buffer_waits, user);
+  cb(backend, "buffer_copies", state->buffer_copies, user);
+  cb(backend, "queue_full_cnt", state->queue_full_cnt, user);
+  cb(backend, "queue_full_msec", state->queue_full_msec, user);
+  cb(backend, "dropped_msgs", state->dropped_msgs, user);
+  cb(backend, "conn_state", conn_state_get(state), user);
+
+  pthread_mutex_lock(&state->gen_lock);
+  for (i = 0; i < LATENCY_BUCKETS; i++) {
+    snprintf(name, sizeof(name), "delivery_latency_%s_%llums",
+             i < LATENCY_BUCKETS - 1 ? "lt" : "ge",
+             1ULL << (i < LATENCY_BUCKETS - 1 ? i : i - 1));
+    cb(backend, name, state->latency_hist[i], user);
+  }
+  cb(backend, "delivery_latency_max_msec", state->latency_max, user);
+  cb(backend, "purged_msgs", state->purged_msgs, user);
+  pthread_mutex_unlock(&state->gen_lock);
+
+  if (state->stats_interval > 0) {
+    uint64_t rdstats[RDSTAT_CNT];
+    uint64_t rdstats_cnt;
+
+    pthread_mutex_lock(&state->rdstats_lock);
+    memcpy(rdstats, state->rdstats, sizeof(rdstats));
+    rdstats_cnt = state->rdstats_cnt;
+    pthread_mutex_unlock(&state->rdstats_lock);
+
+    cb(backend, "rdkafka_stats_cnt", rdstats_cnt, user);
+    for (i = 0; i < RDSTAT_CNT; i++) {
+      cb(backend, rdstats_fields[i].name, rdstats[i], user);
+    }
+    // bytes sent to the brokers per 100 bytes of messages
+    cb(backend, "rdkafka_compression_pct",
+       rdstats[RDSTAT_TXMSG_BYTES] > 0
+         ? rdstats[RDSTAT_TX_BYTES] * 100 / rdstats[RDSTAT_TXMSG_BYTES]
+         : 0,
+       user);
+  }
 
   return 0;
 }
+
+timeseries_backend_conn_state_t
+timeseries_backend_kafka_conn_state(timeseries_backend_t *backend)
+{
+  return conn_state_get(STATE(backend));
+}
+
+timeseries_kp_flush_status_t
+timeseries_backend_kafka_flush_status(timeseries_backend_t *backend,
+                                      uint32_t time, int wait)
+{
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+  timeseries_kp_flush_status_t status;
+  kafka_gen_t *gen;
+
+  pthread_mutex_lock(&state->gen_lock);
+  while ((gen = gen_get(state, time, 0)) != NULL && gen->pending > 0 &&
+         wait != 0) {
+    /* delivery reports are only served by polling, and librdkafka times out
+       messages that cannot be delivered, so this does not wait forever. this
+       runs without the backend lock, so flushes may poll at the same time:
+       the delivery callback only touches state under its own locks */
+    pthread_mutex_unlock(&state->gen_lock);
+    rd_kafka_poll(state->rdk_conn, GEN_WAIT_POLL);
+    pthread_mutex_lock(&state->gen_lock);
+  }
+
+  if (gen == NULL) {
+    status = TIMESERIES_KP_FLUSH_UNKNOWN;
+  } else if (gen->failed > 0) {
+    status = TIMESERIES_KP_FLUSH_FAILED;
+  } else if (gen->pending > 0) {
+    status = TIMESERIES_KP_FLUSH_PENDING;
+  } else {
+    status = TIMESERIES_KP_FLUSH_DELIVERED;
+  }
+  pthread_mutex_unlock(&state->gen_lock);
+
+  return status;
+}
@@ -93,6 +93,14 @@ void timeseries_free(timeseries_t **timeseries_p)
   *timeseries_p = NULL;
   int id;
 
+  /* stop replaying spools first, the replay KPs use all the backends */
+  TIMESERIES_FOREACH_BACKEND_ID(id)
+  {
+    if (timeseries->backends[id - 1] != NULL) {
+      timeseries_backend_spool_free(timeseries->backends[id - 1]);
+    }
+  }
+
   /* loop across all backends and free each one */
   TIMESERIES_FOREACH_BACKEND_ID(id)
   {
@@ -132,6 +140,26 @@ int timeseries_enable_backend(timeseries_backend_t *backend,
   return rc;
 }
 
+int timeseries_enable_spool(timeseries_t *timeseries,
+                            timeseries_backend_t *backend, const char *dir,
+                            uint64_t max_size)
+{
+  assert(timeseries != NULL);
+  assert(backend != NULL);
+  assert(dir != NULL);
+
+  if (timeseries_backend_is_enabled(backend) == 0) {
+    timeseries_log(__func__, "backend (%s) must be enabled before spooling",
+                   backend->name);
+    return -1;
+  }
+
+  timeseries_log(__func__, "spooling failed flushes for backend (%s) to %s",
+                 backend->name, dir);
+
+  return timeseries_backend_spool_init(backend, timeseries, dir, max_size);
+}
+
 inline timeseries_backend_t *
 timeseries_get_backend_by_id(timeseries_t *timeseries,
                              timeseries_backend_id_t id)
@@ -170,14 +198,37 @@ int timeseries_set_single(timeseries_t *timeseries, const char *key,
 {
   int id;
   timeseries_backend_t *backend;
+  int rc;
   assert(timeseries != NULL);
 
   TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
   {
-    if (backend->set_single(backend, key, value, time) != 0) {
+    timeseries_backend_lock(backend);
+    rc = backend->set_single(backend, key, value, time);
+    timeseries_backend_unlock(backend);
+    if (rc != 0) {
       return -1;
     }
   }
 
   return 0;
 }
+
+int timeseries_flush(timeseries_t *timeseries)
+{
+  int id;
+  timeseries_backend_t *backend;
+  int rc = 0;
+  assert(timeseries != NULL);
+
+  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
+  {
+    timeseries_backend_lock(backend);
+    if (backend->flush(backend) != 0) {
+      rc = -1;
+    }
+    timeseries_backend_unlock(backend);
+  }
+
+  return rc;
+}
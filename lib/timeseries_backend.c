@@ -32,11 +32,19 @@
 
 #include "config.h"
 
+#include <arpa/inet.h>
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "utils.h"
 
@@ -91,6 +99,600 @@ static const backend_alloc_func_t backend_alloc_functions[] = {
 
 };
 
+/** Magic number at the start of each spooled snapshot ("TSSP") */
+#define SPOOL_MAGIC 0x54535350
+
+/** Length of the header of each spooled snapshot (magic, time, number of
+    keys and payload length, all uint32 in network byte order) */
+#define SPOOL_HDR_LEN 16
+
+/** Number of segments that the spool is divided into (the oldest segment is
+    discarded when the spool is full) */
+#define SPOOL_SEGMENTS 8
+
+/** Minimum time between replaying snapshots (ms) */
+#define SPOOL_REPLAY_GAP 100
+
+/** After replaying a snapshot, wait this many times as long as it took to
+    replay, so that replay uses at most 1/(SPOOL_REPLAY_BACKOFF+1) of the
+    backend's time */
+#define SPOOL_REPLAY_BACKOFF 3
+
+/** Time to wait before retrying a failed replay if no live flush has
+    succeeded in the meantime (ms) */
+#define SPOOL_RETRY_INTERVAL 30000
+
+/** Maximum length of an encoded varint */
+#define SPOOL_VARINT_MAX 10
+
+/** Structure which holds the state of a backend's flush spool
+ *
+ * The spool is a sequence of segment files, each of which holds a sequence of
+ * snapshots. A snapshot is a header followed by one record per key:
+ * varint(length of prefix shared with the previous key), varint(length of
+ * the rest of the key), the rest of the key, and varint(value).
+ */
+struct timeseries_backend_spool {
+  /** Backend that the spool belongs to */
+  timeseries_backend_t *backend;
+
+  /** Timeseries instance (used to create the replay KP) */
+  timeseries_t *timeseries;
+
+  /** Directory that the segments are stored in */
+  char *dir;
+
+  /** Maximum total size of the segments */
+  uint64_t max_size;
+
+  /** Size at which a new segment is started */
+  uint64_t segment_size;
+
+  /** Lock protecting the fields below */
+  pthread_mutex_t lock;
+
+  /** Signalled when a snapshot is spooled, the backend recovers, or the
+      replay thread should shut down */
+  pthread_cond_t cond;
+
+  /** Replay thread */
+  pthread_t thread;
+
+  /** Has the replay thread been started? */
+  int thread_started;
+
+  /** Should the replay thread exit? */
+  int shutdown;
+
+  /** Is the backend (thought to be) accepting writes? */
+  int healthy;
+
+  /** Sequence number of the oldest segment */
+  uint32_t first_seq;
+
+  /** Sequence number of the next segment to be created (the spool is empty
+      if this equals first_seq) */
+  uint32_t next_seq;
+
+  /** Segment being appended to (the newest segment), NULL if a new segment
+      should be started */
+  FILE *wfile;
+
+  /** Size of the segment being appended to */
+  uint64_t wsize;
+
+  /** Offset of the next snapshot to replay in the oldest segment */
+  uint64_t read_off;
+
+  /** Total size of all segments */
+  uint64_t size;
+
+  /** Buffer that snapshots are encoded into */
+  uint8_t *wbuf;
+  size_t wbuf_alloc;
+
+  /** Buffer that snapshots are read into (used by the replay thread) */
+  uint8_t *rbuf;
+  size_t rbuf_alloc;
+
+  /** Buffer that keys are decoded into (used by the replay thread) */
+  char *key;
+  size_t key_alloc;
+
+  /** KP that snapshots are replayed through (used by the replay thread) */
+  timeseries_kp_t *kp;
+
+  /** Statistics */
+  uint64_t spooled_snapshots;
+  uint64_t spooled_bytes;
+  uint64_t dropped_bytes;
+  uint64_t replayed_snapshots;
+  uint64_t replay_failures;
+  uint64_t errors;
+};
+
+static uint64_t now_msec()
+{
+  struct timeval tv;
+  gettimeofday_wrap(&tv);
+  return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+static int grow_buffer(void **buf, size_t *alloc, size_t len)
+{
+  size_t new_alloc = *alloc == 0 ? 4096 : *alloc;
+  void *tmp;
+
+  if (len <= *alloc) {
+    return 0;
+  }
+  while (new_alloc < len) {
+    new_alloc *= 2;
+  }
+  if ((tmp = realloc(*buf, new_alloc)) == NULL) {
+    return -1;
+  }
+  *buf = tmp;
+  *alloc = new_alloc;
+  return 0;
+}
+
+static size_t put_varint(uint8_t *buf, uint64_t v)
+{
+  size_t len = 0;
+
+  while (v >= 0x80) {
+    buf[len++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  buf[len++] = v;
+  return len;
+}
+
+/** Decode a varint, returning a pointer to the byte after it, or NULL if it
+    does not fit in the buffer */
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end,
+                                 uint64_t *v)
+{
+  int shift = 0;
+
+  *v = 0;
+  while (p < end && shift < 64) {
+    *v |= (uint64_t)(*p & 0x7f) << shift;
+    if ((*p++ & 0x80) == 0) {
+      return p;
+    }
+    shift += 7;
+  }
+  return NULL;
+}
+
+static int spool_path(timeseries_backend_spool_t *spool, uint32_t seq,
+                      char *path)
+{
+  if (snprintf(path, PATH_MAX, "%s/%s.%010" PRIu32 ".spool", spool->dir,
+               spool->backend->name, seq) >= PATH_MAX) {
+    timeseries_log(__func__, "ERROR: Spool path is too long");
+    return -1;
+  }
+  return 0;
+}
+
+/** Get the size of a segment (0 if it does not exist) */
+static uint64_t spool_segment_size(timeseries_backend_spool_t *spool,
+                                   uint32_t seq)
+{
+  char path[PATH_MAX];
+  struct stat st;
+
+  if (spool->wfile != NULL && seq == spool->next_seq - 1) {
+    return spool->wsize;
+  }
+  if (spool_path(spool, seq, path) != 0 || stat(path, &st) != 0) {
+    return 0;
+  }
+  return st.st_size;
+}
+
+/** Delete the oldest segment. Must be called with the spool locked */
+static void spool_drop_segment(timeseries_backend_spool_t *spool)
+{
+  char path[PATH_MAX];
+  uint64_t seg_size = spool_segment_size(spool, spool->first_seq);
+
+  assert(spool->first_seq != spool->next_seq);
+  if (spool->wfile != NULL && spool->first_seq == spool->next_seq - 1) {
+    fclose(spool->wfile);
+    spool->wfile = NULL;
+  }
+  if (spool_path(spool, spool->first_seq, path) == 0 && unlink(path) != 0 &&
+      errno != ENOENT) {
+    timeseries_log(__func__, "ERROR: Could not remove %s: %s", path,
+                   strerror(errno));
+  }
+
+  spool->size -= seg_size;
+  spool->first_seq++;
+  spool->read_off = 0;
+}
+
+/** Encode the enabled values of a KP into the spool's write buffer
+ *
+ * @return the length of the snapshot, 0 if there is nothing to spool, or -1
+ * if an error occurred
+ */
+static ssize_t spool_encode(timeseries_backend_spool_t *spool,
+                            timeseries_kp_t *kp, uint32_t time)
+{
+  const char *key;
+  const char *prev_key = "";
+  size_t key_len, prev_len = 0, shared;
+  size_t off = SPOOL_HDR_LEN;
+  uint32_t cnt = 0;
+  uint32_t hdr[4];
+  uint32_t id;
+
+  TIMESERIES_KP_FOREACH_ENABLED_KI(kp, id)
+  {
+    key = timeseries_kp_ki_get_key(kp, id);
+    key_len = strlen(key);
+    if (grow_buffer((void **)&spool->wbuf, &spool->wbuf_alloc,
+                    off + (SPOOL_VARINT_MAX * 3) + key_len) != 0) {
+      timeseries_log(__func__, "ERROR: Could not malloc spool buffer");
+      return -1;
+    }
+
+    for (shared = 0; shared < key_len && shared < prev_len &&
+                     key[shared] == prev_key[shared];
+         shared++)
+      ;
+    off += put_varint(&spool->wbuf[off], shared);
+    off += put_varint(&spool->wbuf[off], key_len - shared);
+    memcpy(&spool->wbuf[off], &key[shared], key_len - shared);
+    off += key_len - shared;
+    off += put_varint(&spool->wbuf[off], timeseries_kp_ki_get_value(kp, id));
+
+    prev_key = key;
+    prev_len = key_len;
+    cnt++;
+  }
+
+  if (cnt == 0) {
+    return 0;
+  }
+
+  hdr[0] = htonl(SPOOL_MAGIC);
+  hdr[1] = htonl(time);
+  hdr[2] = htonl(cnt);
+  hdr[3] = htonl(off - SPOOL_HDR_LEN);
+  memcpy(spool->wbuf, hdr, SPOOL_HDR_LEN);
+
+  return off;
+}
+
+/** Append the snapshot in the write buffer to the spool. Must be called with
+    the spool locked */
+static int spool_append(timeseries_backend_spool_t *spool, size_t len)
+{
+  char path[PATH_MAX];
+
+  if (len > spool->max_size) {
+    timeseries_log(__func__,
+                   "ERROR: Snapshot (%zu bytes) is larger than the spool",
+                   len);
+    return -1;
+  }
+
+  /* start a new segment if this one is full */
+  if (spool->wfile != NULL && spool->wsize > 0 &&
+      spool->wsize + len > spool->segment_size) {
+    fclose(spool->wfile);
+    spool->wfile = NULL;
+  }
+  if (spool->wfile == NULL) {
+    if (spool_path(spool, spool->next_seq, path) != 0) {
+      return -1;
+    }
+    if ((spool->wfile = fopen(path, "w")) == NULL) {
+      timeseries_log(__func__, "ERROR: Could not create %s: %s", path,
+                     strerror(errno));
+      return -1;
+    }
+    spool->next_seq++;
+    spool->wsize = 0;
+  }
+
+  if (fwrite(spool->wbuf, len, 1, spool->wfile) != 1 ||
+      fflush(spool->wfile) != 0) {
+    timeseries_log(__func__, "ERROR: Could not write to spool: %s",
+                   strerror(errno));
+    /* discard anything that was partially written */
+    clearerr(spool->wfile);
+    if (ftruncate(fileno(spool->wfile), spool->wsize) != 0 ||
+        fseeko(spool->wfile, spool->wsize, SEEK_SET) != 0) {
+      /* do not append anything more to this segment */
+      fclose(spool->wfile);
+      spool->wfile = NULL;
+    }
+    return -1;
+  }
+  spool->wsize += len;
+  spool->size += len;
+  spool->spooled_snapshots++;
+  spool->spooled_bytes += len;
+
+  /* make room by discarding the oldest segments */
+  while (spool->size > spool->max_size &&
+         spool->next_seq - spool->first_seq > 1) {
+    uint64_t dropped =
+      spool_segment_size(spool, spool->first_seq) - spool->read_off;
+    timeseries_log(__func__,
+                   "WARN: %s spool is full, discarding %" PRIu64 " bytes",
+                   spool->backend->name, dropped);
+    spool->dropped_bytes += dropped;
+    spool_drop_segment(spool);
+  }
+
+  return 0;
+}
+
+/** Read the next snapshot to replay into the read buffer. Must be called
+ * with the spool locked
+ *
+ * @return the length of the snapshot payload, 0 if the spool is empty, or -1
+ * if an error occurred
+ *
+ * Segments that have been completely replayed are removed.
+ */
+static ssize_t spool_read(timeseries_backend_spool_t *spool, uint32_t *time,
+                          uint32_t *cnt)
+{
+  char path[PATH_MAX];
+  uint64_t seg_size;
+  uint32_t hdr[4];
+  size_t len;
+  FILE *f;
+
+  while (spool->first_seq != spool->next_seq) {
+    seg_size = spool_segment_size(spool, spool->first_seq);
+    if (spool->read_off >= seg_size) {
+      spool_drop_segment(spool);
+      continue;
+    }
+
+    if (spool_path(spool, spool->first_seq, path) != 0) {
+      return -1;
+    }
+    if ((f = fopen(path, "r")) == NULL) {
+      timeseries_log(__func__, "ERROR: Could not open %s: %s", path,
+                     strerror(errno));
+      return -1;
+    }
+    if (fseeko(f, spool->read_off, SEEK_SET) != 0 ||
+        fread(hdr, SPOOL_HDR_LEN, 1, f) != 1 ||
+        ntohl(hdr[0]) != SPOOL_MAGIC ||
+        spool->read_off + SPOOL_HDR_LEN + ntohl(hdr[3]) > seg_size ||
+        grow_buffer((void **)&spool->rbuf, &spool->rbuf_alloc,
+                    ntohl(hdr[3])) != 0 ||
+        fread(spool->rbuf, ntohl(hdr[3]), 1, f) != 1) {
+      fclose(f);
+      timeseries_log(__func__,
+                     "ERROR: Corrupt snapshot in %s, discarding %" PRIu64
+                     " bytes",
+                     path, seg_size - spool->read_off);
+      spool->dropped_bytes += seg_size - spool->read_off;
+      spool_drop_segment(spool);
+      continue;
+    }
+    fclose(f);
+
+    *time = ntohl(hdr[1]);
+    *cnt = ntohl(hdr[2]);
+    len = ntohl(hdr[3]);
+    return len;
+  }
+
+  return 0;
+}
+
+/** Replay the snapshot in the read buffer to the backend
+ *
+ * @return 0 if the snapshot was written, -1 if the backend failed, or -2 if
+ * the snapshot is corrupt
+ */
+static int spool_replay(timeseries_backend_spool_t *spool, size_t len,
+                        uint32_t time, uint32_t cnt)
+{
+  const uint8_t *p = spool->rbuf;
+  const uint8_t *end = spool->rbuf + len;
+  uint64_t shared, suffix_len, value;
+  size_t key_len = 0;
+  uint32_t i;
+  int rc;
+
+  if (spool->kp == NULL &&
+      (spool->kp = timeseries_kp_init(spool->timeseries,
+                                      TIMESERIES_KP_RESET |
+                                        TIMESERIES_KP_DISABLE)) == NULL) {
+    timeseries_log(__func__, "ERROR: Could not create replay KP");
+    return -1;
+  }
+
+  for (i = 0; i < cnt; i++) {
+    if ((p = get_varint(p, end, &shared)) == NULL ||
+        (p = get_varint(p, end, &suffix_len)) == NULL || shared > key_len ||
+        suffix_len > (uint64_t)(end - p)) {
+      goto corrupt;
+    }
+    if (grow_buffer((void **)&spool->key, &spool->key_alloc,
+                    shared + suffix_len) != 0) {
+      timeseries_log(__func__, "ERROR: Could not malloc key buffer");
+      rc = -1;
+      goto err;
+    }
+    memcpy(&spool->key[shared], p, suffix_len);
+    p += suffix_len;
+    key_len = shared + suffix_len;
+    if ((p = get_varint(p, end, &value)) == NULL) {
+      goto corrupt;
+    }
+    if (timeseries_kp_upsert(spool->kp, spool->key, key_len, value, 0) < 0) {
+      rc = -1;
+      goto err;
+    }
+  }
+  if (p != end) {
+    goto corrupt;
+  }
+
+  timeseries_backend_lock(spool->backend);
+  rc = timeseries_kp_flush_backend(spool->kp, spool->backend, time);
+  timeseries_backend_unlock(spool->backend);
+  if (rc == 0) {
+    return 0;
+  }
+  goto err;
+
+corrupt:
+  timeseries_log(__func__, "ERROR: Corrupt snapshot for time %" PRIu32, time);
+  rc = -2;
+err:
+  /* start the next replay with a clean KP */
+  timeseries_kp_free(&spool->kp);
+  return rc;
+}
+
+/** Wait for the spool condition to be signalled, or for the given time to
+    pass. Must be called with the spool locked */
+static void spool_wait(timeseries_backend_spool_t *spool, uint64_t msec)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += msec / 1000;
+  ts.tv_nsec += (msec % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(&spool->cond, &spool->lock, &ts);
+}
+
+/** Replay thread: replays spooled snapshots while the backend is healthy */
+static void *spool_thread(void *data)
+{
+  timeseries_backend_spool_t *spool = data;
+  uint32_t seq, time, cnt;
+  uint64_t next_off, start, elapsed, until;
+  ssize_t len;
+  int rc;
+
+  pthread_mutex_lock(&spool->lock);
+  while (spool->shutdown == 0) {
+    if (spool->healthy == 0) {
+      /* wait for a live flush to succeed, but try again eventually in case
+         there are no live flushes */
+      until = now_msec() + SPOOL_RETRY_INTERVAL;
+      while (spool->shutdown == 0 && spool->healthy == 0 &&
+             now_msec() < until) {
+        spool_wait(spool, until - now_msec());
+      }
+      spool->healthy = 1;
+      continue;
+    }
+
+    if ((len = spool_read(spool, &time, &cnt)) <= 0) {
+      /* nothing to replay (or the spool cannot be read) */
+      spool_wait(spool, SPOOL_RETRY_INTERVAL);
+      continue;
+    }
+    seq = spool->first_seq;
+    next_off = spool->read_off + SPOOL_HDR_LEN + len;
+    pthread_mutex_unlock(&spool->lock);
+
+    start = now_msec();
+    rc = spool_replay(spool, len, time, cnt);
+    elapsed = now_msec() - start;
+
+    pthread_mutex_lock(&spool->lock);
+    if (rc == -1) {
+      timeseries_log(__func__,
+                     "WARN: Could not replay %s spool, pausing replay",
+                     spool->backend->name);
+      spool->replay_failures++;
+      spool->healthy = 0;
+      continue;
+    }
+    if (rc == 0) {
+      spool->replayed_snapshots++;
+    } else {
+      spool->dropped_bytes += SPOOL_HDR_LEN + len;
+    }
+    /* the segment may have been discarded while we were replaying */
+    if (spool->first_seq == seq) {
+      spool->read_off = next_off;
+    }
+
+    /* leave the backend to the live flushes for a while */
+    elapsed *= SPOOL_REPLAY_BACKOFF;
+    until = now_msec() + (elapsed > SPOOL_REPLAY_GAP ? elapsed
+                                                       : SPOOL_REPLAY_GAP);
+    while (spool->shutdown == 0 && now_msec() < until) {
+      spool_wait(spool, until - now_msec());
+    }
+  }
+  pthread_mutex_unlock(&spool->lock);
+
+  return NULL;
+}
+
+/** Find the segments left by a previous instance */
+static int spool_scan(timeseries_backend_spool_t *spool)
+{
+  DIR *dir;
+  struct dirent *ent;
+  size_t name_len = strlen(spool->backend->name);
+  uint32_t seq, min_seq = UINT32_MAX, max_seq = 0;
+  int n;
+
+  if ((dir = opendir(spool->dir)) == NULL) {
+    timeseries_log(__func__, "ERROR: Could not open spool directory %s: %s",
+                   spool->dir, strerror(errno));
+    return -1;
+  }
+  while ((ent = readdir(dir)) != NULL) {
+    n = 0;
+    if (strncmp(ent->d_name, spool->backend->name, name_len) != 0 ||
+        ent->d_name[name_len] != '.' ||
+        sscanf(&ent->d_name[name_len + 1], "%" SCNu32 ".spool%n", &seq, &n) !=
+          1 ||
+        n == 0 || ent->d_name[name_len + 1 + n] != '\0') {
+      continue;
+    }
+    if (seq < min_seq) {
+      min_seq = seq;
+    }
+    if (seq > max_seq) {
+      max_seq = seq;
+    }
+  }
+  closedir(dir);
+
+  if (min_seq == UINT32_MAX) {
+    return 0;
+  }
+
+  spool->first_seq = min_seq;
+  spool->next_seq = max_seq + 1;
+  for (seq = min_seq; seq != spool->next_seq; seq++) {
+    spool->size += spool_segment_size(spool, seq);
+  }
+  timeseries_log(__func__, "INFO: Replaying %" PRIu64 " bytes from %s spool",
+                 spool->size, spool->backend->name);
+
+  return 0;
+}
+
 /* ========== PROTECTED FUNCTIONS ========== */
 
 timeseries_backend_t *timeseries_backend_alloc(timeseries_backend_id_t id)
@@ -111,6 +713,7 @@ timeseries_backend_t *timeseries_backend_alloc(timeseries_backend_id_t id)
   /* get the core backend details (id, name) from the backend plugin */
   memcpy(backend, backend_alloc_functions[id - 1](),
          sizeof(timeseries_backend_t));
+  pthread_mutex_init(&backend->lock, NULL);
 
   return backend;
 }
@@ -159,6 +762,7 @@ void timeseries_backend_free(timeseries_backend_t **backend_p)
   }
 
   /* finally, free the actual backend structure */
+  pthread_mutex_destroy(&backend->lock);
   free(backend);
 
   return;
@@ -181,6 +785,139 @@ void timeseries_backend_free_state(timeseries_backend_t *backend)
   backend->state = NULL;
 }
 
+int timeseries_backend_spool_init(timeseries_backend_t *backend,
+                                  timeseries_t *timeseries, const char *dir,
+                                  uint64_t max_size)
+{
+  timeseries_backend_spool_t *spool;
+
+  assert(backend != NULL && timeseries != NULL && dir != NULL);
+
+  if (backend->spool != NULL) {
+    timeseries_log(__func__, "backend (%s) is already spooling",
+                   backend->name);
+    return -1;
+  }
+
+  if ((spool = malloc_zero(sizeof(timeseries_backend_spool_t))) == NULL ||
+      (spool->dir = strdup(dir)) == NULL) {
+    timeseries_log(__func__, "could not malloc spool");
+    free(spool);
+    return -1;
+  }
+  spool->backend = backend;
+  spool->timeseries = timeseries;
+  spool->max_size = max_size;
+  spool->segment_size = max_size / SPOOL_SEGMENTS;
+  spool->healthy = 1;
+  pthread_mutex_init(&spool->lock, NULL);
+  pthread_cond_init(&spool->cond, NULL);
+  backend->spool = spool;
+
+  if (spool_scan(spool) != 0) {
+    goto err;
+  }
+
+  if (pthread_create(&spool->thread, NULL, spool_thread, spool) != 0) {
+    timeseries_log(__func__, "could not start spool thread");
+    goto err;
+  }
+  spool->thread_started = 1;
+
+  return 0;
+
+err:
+  timeseries_backend_spool_free(backend);
+  return -1;
+}
+
+void timeseries_backend_spool_free(timeseries_backend_t *backend)
+{
+  timeseries_backend_spool_t *spool;
+
+  assert(backend != NULL);
+  if ((spool = backend->spool) == NULL) {
+    return;
+  }
+
+  if (spool->thread_started != 0) {
+    pthread_mutex_lock(&spool->lock);
+    spool->shutdown = 1;
+    pthread_cond_signal(&spool->cond);
+    pthread_mutex_unlock(&spool->lock);
+    pthread_join(spool->thread, NULL);
+  }
+  backend->spool = NULL;
+
+  timeseries_kp_free(&spool->kp);
+  if (spool->wfile != NULL) {
+    fclose(spool->wfile);
+  }
+  if (spool->first_seq != spool->next_seq) {
+    timeseries_log(__func__, "INFO: %" PRIu64 " bytes left in %s spool",
+                   spool->size - spool->read_off, backend->name);
+  }
+
+  pthread_cond_destroy(&spool->cond);
+  pthread_mutex_destroy(&spool->lock);
+  free(spool->wbuf);
+  free(spool->rbuf);
+  free(spool->key);
+  free(spool->dir);
+  free(spool);
+}
+
+int timeseries_backend_spool_kp(timeseries_backend_t *backend,
+                                timeseries_kp_t *kp, uint32_t time)
+{
+  timeseries_backend_spool_t *spool = backend->spool;
+  ssize_t len;
+  int rc = -1;
+
+  if (spool == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&spool->lock);
+  spool->healthy = 0;
+  if ((len = spool_encode(spool, kp, time)) == 0 ||
+      (len > 0 && spool_append(spool, len) == 0)) {
+    rc = 0;
+    pthread_cond_signal(&spool->cond);
+  } else {
+    spool->errors++;
+  }
+  pthread_mutex_unlock(&spool->lock);
+
+  return rc;
+}
+
+void timeseries_backend_spool_recovered(timeseries_backend_t *backend)
+{
+  timeseries_backend_spool_t *spool = backend->spool;
+
+  if (spool == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&spool->lock);
+  if (spool->healthy == 0) {
+    spool->healthy = 1;
+    pthread_cond_signal(&spool->cond);
+  }
+  pthread_mutex_unlock(&spool->lock);
+}
+
+void timeseries_backend_lock(timeseries_backend_t *backend)
+{
+  pthread_mutex_lock(&backend->lock);
+}
+
+void timeseries_backend_unlock(timeseries_backend_t *backend)
+{
+  pthread_mutex_unlock(&backend->lock);
+}
+
 /* ========== PUBLIC FUNCTIONS ========== */
 
 inline int timeseries_backend_is_enabled(timeseries_backend_t *backend)
@@ -203,3 +940,51 @@ inline const char *timeseries_backend_get_name(timeseries_backend_t *backend)
 
   return backend->name;
 }
+
+int timeseries_backend_get_stats(timeseries_backend_t *backend,
+                                 timeseries_backend_stats_cb_t *cb, void *user)
+{
+  assert(backend != NULL);
+  assert(cb != NULL);
+
+  timeseries_backend_spool_t *spool = backend->spool;
+  int rc;
+
+  if (backend->enabled == 0) {
+    return -1;
+  }
+
+  timeseries_backend_lock(backend);
+  rc = backend->get_stats(backend, cb, user);
+  timeseries_backend_unlock(backend);
+
+  if (spool != NULL) {
+    pthread_mutex_lock(&spool->lock);
+    cb(backend, "flush_spool_snapshots", spool->spooled_snapshots, user);
+    cb(backend, "flush_spool_bytes", spool->spooled_bytes, user);
+    cb(backend, "flush_spool_pending_bytes", spool->size - spool->read_off,
+       user);
+    cb(backend, "flush_spool_segments", spool->next_seq - spool->first_seq,
+       user);
+    cb(backend, "flush_spool_dropped_bytes", spool->dropped_bytes, user);
+    cb(backend, "flush_spool_replayed_snapshots", spool->replayed_snapshots,
+       user);
+    cb(backend, "flush_spool_replay_failures", spool->replay_failures, user);
+    cb(backend, "flush_spool_errors", spool->errors, user);
+    pthread_mutex_unlock(&spool->lock);
+  }
+
+  return rc;
+}
+
+timeseries_backend_conn_state_t
+timeseries_backend_get_conn_state(timeseries_backend_t *backend)
+{
+  assert(backend != NULL);
+
+  if (backend->enabled == 0) {
+    return TIMESERIES_BACKEND_CONN_FAILED;
+  }
+
+  return backend->conn_state(backend);
+}
@@ -34,6 +34,7 @@
 #define __TIMESERIES_BACKEND_INT_H
 
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "timeseries_kp_int.h"
 #include "timeseries_backend_pub.h"
@@ -52,6 +53,9 @@
 #define TIMESERIES_BACKEND_STATE(type, backend)                                \
   ((timeseries_backend_##type##_state_t *)(backend)->state)
 
+/** Opaque struct holding the state of a backend's flush spool */
+typedef struct timeseries_backend_spool timeseries_backend_spool_t;
+
 /** Convenience macro that defines all the function prototypes for the
  * timeseries
  * backend API
@@ -66,10 +70,11 @@
   void timeseries_backend_##provname##_kp_free(                                \
     timeseries_backend_t *backend, timeseries_kp_t *kp, void *kp_state);       \
   int timeseries_backend_##provname##_kp_ki_update(                            \
-    timeseries_backend_t *backend, timeseries_kp_t *kp);                       \
+    timeseries_backend_t *backend, timeseries_kp_t *kp, uint32_t first_id,     \
+    uint32_t end_id);                                                          \
   void timeseries_backend_##provname##_kp_ki_free(                             \
-    timeseries_backend_t *backend, timeseries_kp_t *kp,                        \
-    timeseries_kp_ki_t *ki, void *ki_state);                                   \
+    timeseries_backend_t *backend, timeseries_kp_t *kp, uint32_t ki_id,        \
+    void *ki_state);                                                           \
   int timeseries_backend_##provname##_kp_flush(                                \
     timeseries_backend_t *backend, timeseries_kp_t *kp, uint32_t time);        \
   int timeseries_backend_##provname##_set_single(                              \
@@ -78,6 +83,7 @@
   int timeseries_backend_##provname##_set_single_by_id(                        \
     timeseries_backend_t *backend, uint8_t *id, size_t id_len, uint64_t value, \
     uint32_t time);                                                            \
+  int timeseries_backend_##provname##_flush(timeseries_backend_t *backend);    \
   int timeseries_backend_##provname##_set_bulk_init(                           \
     timeseries_backend_t *backend, uint32_t key_cnt, uint32_t time);           \
   int timeseries_backend_##provname##_set_bulk_by_id(                          \
@@ -87,7 +93,14 @@
     timeseries_backend_t *backend, const char *key, uint8_t **backend_key);    \
   int timeseries_backend_##provname##_resolve_key_bulk(                        \
     timeseries_backend_t *backend, uint32_t keys_cnt, const char *const *keys, \
-    uint8_t **backend_keys, size_t *backend_key_lens, int *contig_alloc);
+    uint8_t **backend_keys, size_t *backend_key_lens, int *contig_alloc);      \
+  int timeseries_backend_##provname##_get_stats(                               \
+    timeseries_backend_t *backend, timeseries_backend_stats_cb_t *cb,          \
+    void *user);                                                               \
+  timeseries_backend_conn_state_t timeseries_backend_##provname##_conn_state(  \
+    timeseries_backend_t *backend);                                            \
+  timeseries_kp_flush_status_t timeseries_backend_##provname##_flush_status(   \
+    timeseries_backend_t *backend, uint32_t time, int wait);
 
 /** Convenience macro that defines all the function pointers for the timeseries
  * backend API
@@ -101,10 +114,15 @@
     timeseries_backend_##provname##_kp_flush,                                  \
     timeseries_backend_##provname##_set_single,                                \
     timeseries_backend_##provname##_set_single_by_id,                          \
+    timeseries_backend_##provname##_flush,                                     \
     timeseries_backend_##provname##_set_bulk_init,                             \
     timeseries_backend_##provname##_set_bulk_by_id,                            \
     timeseries_backend_##provname##_resolve_key,                               \
-    timeseries_backend_##provname##_resolve_key_bulk, 0, NULL
+    timeseries_backend_##provname##_resolve_key_bulk,                          \
+    timeseries_backend_##provname##_get_stats,                                 \
+    timeseries_backend_##provname##_conn_state,                                \
+    timeseries_backend_##provname##_flush_status, 0, NULL, NULL,               \
+    PTHREAD_MUTEX_INITIALIZER
 
 /** Structure which represents a metadata backend */
 struct timeseries_backend {
@@ -181,29 +199,35 @@ struct timeseries_backend {
    *
    * @param      backend     Pointer to a backend instance
    * @param      kp          Pointer to the KP to update
+   * @param      first_id    ID of the first KI to update
+   * @param      end_id      ID after the last KI to update
    * @return 0 if state was updated successfully, -1 otherwise
    *
    * For example: the DBATS backend needs to ask DBATS what the internal key id
    * is for the string key.
    *
-   * Backends should use the TIMESERIES_KP_FOREACH_KI macro to iterate over all
-   * KIs in the KP and then use the timeseries_kp_get_ki and
-   * timeseries_kp_ki_get_backend_state functions to get a pointer to the state
-   * to update.
+   * The KP tracks how many KIs each backend has already updated, so only the
+   * KIs with IDs in [first_id, end_id) (i.e. those added since the last call)
+   * need to be updated, whether or not they are enabled. Backends should use
+   * the timeseries_kp_ki_get_backend_state and
+   * timeseries_kp_ki_set_backend_state functions to access the state to
+   * update. If this function fails, the same range (and possibly more) will
+   * be passed again next time.
    */
-  int (*kp_ki_update)(timeseries_backend_t *backend, timeseries_kp_t *kp);
+  int (*kp_ki_update)(timeseries_backend_t *backend, timeseries_kp_t *kp,
+                      uint32_t first_id, uint32_t end_id);
 
   /** Free the backend-specific state in the given Key Info object.
    *
    * @param backend    Pointer to a backend instance
    * @param kp         Pointer to the KP the KI is a member of
-   * @param kv         Pointer to the KI to free state for
+   * @param ki_id      ID of the KI to free state for
    * @param ki_state   Pointer to the state to free
    *
-   * @note This function should free the state created by kp_kv_add.
+   * @note This function should free the state created by kp_ki_update.
    */
   void (*kp_ki_free)(timeseries_backend_t *backend, timeseries_kp_t *kp,
-                     timeseries_kp_ki_t *ki, void *ki_state);
+                     uint32_t ki_id, void *ki_state);
 
   /** Flush the current values in the given Key Package to the database
    *
@@ -242,6 +266,17 @@ struct timeseries_backend {
   int (*set_single_by_id)(timeseries_backend_t *backend, uint8_t *id,
                           size_t id_len, uint64_t value, uint32_t time);
 
+  /** Write any values buffered by set_single and set_single_by_id to the
+   * database
+   *
+   * @param backend     Pointer to the backend instance to flush
+   * @return 0 if the buffered values were written successfully, -1 otherwise
+   *
+   * Backends may buffer single values (e.g. to write many of them in one
+   * transaction) until this function is called or the backend is freed.
+   */
+  int (*flush)(timeseries_backend_t *backend);
+
   /** Prepare to write a bulk set of values to the database
    *
    * @param backend     Pointer to the backend instance to write to
@@ -311,6 +346,44 @@ struct timeseries_backend {
                           const char *const *keys, uint8_t **backend_keys,
                           size_t *backend_key_lens, int *contig_alloc);
 
+  /** Report backend-specific statistics
+   *
+   * @param backend     Pointer to the backend to report statistics for
+   * @param cb          Callback to invoke once for each statistic
+   * @param user        User pointer to pass to the callback
+   * @return 0 if the statistics were reported successfully, -1 otherwise
+   */
+  int (*get_stats)(timeseries_backend_t *backend,
+                   timeseries_backend_stats_cb_t *cb, void *user);
+
+  /** Get the state of the backend's connection to its database
+   *
+   * @param backend     Pointer to the backend to get the state of
+   * @return the connection state of the backend
+   *
+   * @note this may be called from any thread, so backends that change their
+   * connection state from a background thread must protect it.
+   */
+  timeseries_backend_conn_state_t (*conn_state)(
+    timeseries_backend_t *backend);
+
+  /** Get the delivery status of the values written for the given time
+   *
+   * @param backend     Pointer to the backend to get the status of
+   * @param time        Time of the values
+   * @param wait        If non-zero, wait until none are pending
+   * @return the delivery status of the values
+   *
+   * This is only called for times that were flushed successfully, so backends
+   * that have written the values by the time kp_flush returns simply report
+   * them as delivered.
+   *
+   * @note Unlike the other calls, this is made without the backend lock (see
+   * timeseries_backend_lock), so it may run concurrently with them.
+   */
+  timeseries_kp_flush_status_t (*flush_status)(timeseries_backend_t *backend,
+                                               uint32_t time, int wait);
+
   /** }@ */
 
   /**
@@ -328,6 +401,13 @@ struct timeseries_backend {
   /** An opaque pointer to backend-specific state if needed by the backend */
   void *state;
 
+  /** Spool for Key Package flushes that fail (NULL unless spooling has been
+   * enabled for this backend) */
+  timeseries_backend_spool_t *spool;
+
+  /** Serializes calls into the backend (see timeseries_backend_lock) */
+  pthread_mutex_t lock;
+
   /** }@ */
 };
 
@@ -368,6 +448,78 @@ void timeseries_backend_free(timeseries_backend_t **backend_p);
 
 /** }@ */
 
+/**
+ * @name Backend spool functions
+ *
+ * These functions are used by the timeseries framework to keep the values of
+ * Key Package flushes that a backend fails to write in a local spool, and to
+ * replay them once the backend recovers.
+ *
+ * @{ */
+
+/** Enable the flush spool for a backend
+ *
+ * @param backend       Pointer to an enabled backend
+ * @param timeseries    The timeseries object that the backend belongs to
+ * @param dir           Directory to store the spool segments in
+ * @param max_size      Maximum number of bytes to keep in the spool
+ * @return 0 if the spool was enabled, -1 otherwise
+ *
+ * Segments left in the directory by a previous instance are replayed.
+ */
+int timeseries_backend_spool_init(timeseries_backend_t *backend,
+                                  timeseries_t *timeseries, const char *dir,
+                                  uint64_t max_size);
+
+/** Stop replaying and free the flush spool for a backend (if enabled)
+ *
+ * @param backend       Pointer to the backend to free the spool for
+ *
+ * Anything that has not been replayed stays on disk. This must be called
+ * while all backends are still enabled, since the replay thread uses a Key
+ * Package of its own.
+ */
+void timeseries_backend_spool_free(timeseries_backend_t *backend);
+
+/** Append the enabled values of a Key Package to the flush spool
+ *
+ * @param backend       Pointer to the backend that failed to flush the KP
+ * @param kp            Pointer to the KP that could not be flushed
+ * @param time          The timestamp the values were to be flushed with
+ * @return 0 if the values were spooled, -1 if the backend has no spool or
+ * they could not be written to it
+ */
+int timeseries_backend_spool_kp(timeseries_backend_t *backend,
+                                timeseries_kp_t *kp, uint32_t time);
+
+/** Tell the flush spool that a flush to the backend succeeded
+ *
+ * @param backend       Pointer to the backend that was flushed
+ *
+ * If replay has been paused because the backend was failing, it resumes.
+ */
+void timeseries_backend_spool_recovered(timeseries_backend_t *backend);
+
+/** Acquire exclusive use of a backend
+ *
+ * @param backend       Pointer to the backend to lock
+ *
+ * A backend may be used by several threads at once (background and parallel
+ * KP flushes, other KPs, single-value writes and the spool replay thread), but
+ * backends themselves are not thread-safe, so the framework must hold this
+ * lock whenever it calls into the backend (except for flush_status, which may
+ * wait for a long time).
+ */
+void timeseries_backend_lock(timeseries_backend_t *backend);
+
+/** Release a backend locked with timeseries_backend_lock
+ *
+ * @param backend       Pointer to the backend to unlock
+ */
+void timeseries_backend_unlock(timeseries_backend_t *backend);
+
+/** }@ */
+
 /**
  * @name Backend convenience functions
  *
@@ -60,6 +60,17 @@ typedef struct timeseries_backend timeseries_backend_t;
  *
  * @{ */
 
+/** Callback used to report a single backend statistic
+ *
+ * @param backend       The backend reporting the statistic
+ * @param name          Name of the statistic
+ * @param value         Current value of the statistic
+ * @param user          User pointer passed to timeseries_backend_get_stats
+ */
+typedef void(timeseries_backend_stats_cb_t)(timeseries_backend_t *backend,
+                                            const char *name, uint64_t value,
+                                            void *user);
+
 /** @} */
 
 /**
@@ -87,6 +98,24 @@ typedef enum timeseries_backend_id {
 
 } timeseries_backend_id_t;
 
+/** State of a backend's connection to its database */
+typedef enum timeseries_backend_conn_state {
+  /** The backend has not connected yet. Values written are queued until it
+      does */
+  TIMESERIES_BACKEND_CONN_CONNECTING = 0,
+
+  /** The backend is connected */
+  TIMESERIES_BACKEND_CONN_CONNECTED = 1,
+
+  /** The backend has lost its connection and is reconnecting. Values written
+      are queued until it does */
+  TIMESERIES_BACKEND_CONN_DISCONNECTED = 2,
+
+  /** The backend has failed and will not reconnect (or is not enabled) */
+  TIMESERIES_BACKEND_CONN_FAILED = 3,
+
+} timeseries_backend_conn_state_t;
+
 /** @} */
 
 /** Check if the given backend is enabled already
@@ -111,4 +140,30 @@ timeseries_backend_get_id(timeseries_backend_t *backend);
  */
 const char *timeseries_backend_get_name(timeseries_backend_t *backend);
 
+/** Get the statistics maintained by the given backend
+ *
+ * @param backend       The backend to get statistics for
+ * @param cb            Callback to invoke once for each statistic
+ * @param user          User pointer to pass to the callback
+ * @return 0 if the statistics were reported, -1 if the backend is not enabled
+ * or an error occurred
+ *
+ * The statistics reported (if any) are specific to each backend. Counters
+ * are cumulative since the backend was enabled.
+ */
+int timeseries_backend_get_stats(timeseries_backend_t *backend,
+                                 timeseries_backend_stats_cb_t *cb, void *user);
+
+/** Get the state of the given backend's connection to its database
+ *
+ * @param backend       The backend to get the connection state of
+ * @return the connection state of the backend
+ *
+ * Backends that connect in the background (e.g. Kafka) are enabled before
+ * they have connected, so this can be used to find out whether values are
+ * being written or just queued.
+ */
+timeseries_backend_conn_state_t
+timeseries_backend_get_conn_state(timeseries_backend_t *backend);
+
 #endif /* __TIMESERIES_BACKEND_PUB_H */
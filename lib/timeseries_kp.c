@@ -34,6 +34,7 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -49,38 +50,213 @@
 
 /* ========== PRIVATE DATA STRUCTURES/FUNCTIONS ========== */
 
-KHASH_MAP_INIT_STR(strint, int);
+/** A key as stored in the key hash
+ *
+ * Keys are identified by a pointer and length rather than a nul-terminated
+ * string so that callers can look up keys in place (e.g. straight out of a
+ * message buffer). The hash of the key is computed once and cached alongside
+ * it, so the hash never needs to rehash the key strings when it grows.
+ */
+typedef struct kp_key {
+  /** Pointer to the (not necessarily nul-terminated) key string */
+  const char *key;
 
-struct timeseries_kp_ki {
-  /** Key string */
-  char *key;
+  /** Length of the key string */
+  uint32_t len;
 
-  /** Value */
-  uint64_t value;
+  /** Cached hash of the key string */
+  uint32_t hash;
+} kp_key_t;
 
-  /** Backend-specific state
-   * @note index of backend is given by (timeseries_backend_id_t - 1)
-   */
-  void *backend_state[TIMESERIES_BACKEND_ID_LAST];
+#define kp_key_hash_func(k) ((k).hash)
+#define kp_key_hash_equal(a, b)                                                \
+  ((a).hash == (b).hash && (a).len == (b).len &&                               \
+   memcmp((a).key, (b).key, (a).len) == 0)
 
-  /** Should this KI be skipped? */
-  uint8_t disabled;
-};
+KHASH_INIT(keyid, kp_key_t, int, 1, kp_key_hash_func, kp_key_hash_equal);
+
+/** Number of key IDs tracked by each word of the enabled bitmap */
+#define BITMAP_WORD_BITS 64
+
+/** Number of bitmap words needed to track the given number of keys */
+#define BITMAP_WORDS(cnt) (((cnt) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+/** Minimum number of keys to allocate room for when the KI columns grow */
+#define KI_ALLOC_MIN 1024
+
+/** Default size of a key string arena chunk */
+#define KEY_CHUNK_LEN (64 * 1024)
+
+/** Number of recent flushes whose results are kept for
+    timeseries_kp_flush_status */
+#define FLUSH_LOG_LEN 16
+
+/** A chunk of memory that key strings are packed into
+ *
+ * Chunks are never reallocated, so pointers to keys stored in them remain
+ * valid for the life of the KP.
+ */
+typedef struct kp_key_chunk {
+  /** The next (older) chunk in the arena */
+  struct kp_key_chunk *next;
+
+  /** Number of bytes of data that are in use */
+  size_t used;
+
+  /** Total number of bytes of data in this chunk */
+  size_t len;
+
+  /** Key string data */
+  char data[];
+} kp_key_chunk_t;
+
+/** A KI column that has been replaced by a larger copy
+ *
+ * When flushing in the background, the flush thread reads the key and backend
+ * columns without holding the dictionary lock, so a column that grows is kept
+ * until the flush that may be reading it has finished.
+ */
+typedef struct kp_retired_col {
+  /** The next retired column */
+  struct kp_retired_col *next;
+
+  /** The old column */
+  void *col;
+} kp_retired_col_t;
+
+/** State for flushing a single backend on its own thread */
+typedef struct kp_backend_flush {
+  /** Key Package being flushed */
+  timeseries_kp_t *kp;
+
+  /** Backend to flush the KP to */
+  timeseries_backend_t *backend;
+
+  /** Thread that is flushing the backend */
+  pthread_t thread;
+
+  /** The timestamp to associate the values with */
+  uint32_t time;
+
+  /** Result of the flush */
+  int rc;
+} kp_backend_flush_t;
 
-/** Structure which holds state for a Key Package */
+/** The result of a recent flush (see timeseries_kp_flush_status) */
+typedef struct kp_flush_record {
+  /** Time that the values were flushed for */
+  uint32_t time;
+
+  /** Is this record in use? */
+  int used;
+
+  /** Result of the flush for each backend (as in backend_status) */
+  int backend_status[TIMESERIES_BACKEND_ID_LAST];
+} kp_flush_record_t;
+
+/** A snapshot of the KP values that is waiting to be flushed in the background
+ *
+ * When the KP resets values (or disables keys) after a flush, the snapshot
+ * columns are swapped with the live ones rather than copied, so the snapshot
+ * buffers double as standby buffers for the next interval.
+ */
+typedef struct kp_snapshot {
+  /** Column of values */
+  uint64_t *values;
+
+  /** Bitmap of enabled keys */
+  uint64_t *enabled;
+
+  /** Number of keys that the columns have room for */
+  uint32_t alloc;
+
+  /** Number of keys in the snapshot */
+  uint32_t cnt;
+
+  /** Number of leading values that are known to be zero */
+  uint32_t zeroed;
+
+  /** Time to flush the snapshot with */
+  uint32_t time;
+} kp_snapshot_t;
+
+/** Bounded queue of snapshots to be flushed by a background thread */
+typedef struct kp_flush_queue {
+  /** Thread that flushes snapshots to the backends */
+  pthread_t thread;
+
+  /** Lock protecting the queue state */
+  pthread_mutex_t lock;
+
+  /** Signalled when a snapshot is queued (or the thread should shut down) */
+  pthread_cond_t queued_cond;
+
+  /** Signalled when a snapshot has been flushed */
+  pthread_cond_t done_cond;
+
+  /** Ring of snapshot slots */
+  kp_snapshot_t *slots;
+
+  /** Number of snapshot slots (i.e. the maximum number of pending flushes) */
+  int depth;
+
+  /** Index of the slot that will be flushed next */
+  int head;
+
+  /** Number of snapshots waiting to be (or being) flushed */
+  int queued;
+
+  /** Should the thread exit once the queue is empty? */
+  int shutdown;
+
+  /** Has a background flush failed since the last timeseries_kp_flush_wait? */
+  int error;
+} kp_flush_queue_t;
+
+/** Structure which holds state for a Key Package
+ *
+ * Key Info (KI) state is stored column-wise: each field has its own array
+ * indexed by the key ID. This allows a flush to stream through just the values
+ * and the enabled bitmap without dragging the key strings and backend state
+ * pointers through the cache.
+ */
 struct timeseries_kp {
   /** Timeseries instance that this key package is associated with */
   timeseries_t *timeseries;
 
-  /** Dynamically allocated array of Key Info objects */
-  timeseries_kp_ki_t *key_infos;
+  /** Column of key strings (the strings themselves live in key_chunks) */
+  char **keys;
+
+  /** Arena of key string chunks (most recently allocated first) */
+  kp_key_chunk_t *key_chunks;
+
+  /** Column of values */
+  uint64_t *values;
+
+  /** Bitmap of enabled keys (bit set if the key should be flushed) */
+  uint64_t *enabled;
+
+  /** Per-backend KI state columns
+   * @note index of backend is given by (timeseries_backend_id_t - 1)
+   * @note a column is NULL until the backend first stores state in it
+   */
+  void **ki_backend_state[TIMESERIES_BACKEND_ID_LAST];
+
+  /** Per-backend fixed-width KI ID columns
+   * @note index of backend is given by (timeseries_backend_id_t - 1)
+   * @note a column is NULL until the backend first asks for it
+   */
+  uint32_t *ki_backend_ids[TIMESERIES_BACKEND_ID_LAST];
 
   /** Hash of key names -> key ids */
-  khash_t(strint) * key_id_hash;
+  khash_t(keyid) * key_id_hash;
 
   /** Number of keys in the Key Package */
   uint32_t key_infos_cnt;
 
+  /** Number of keys that the KI columns have room for */
+  uint32_t key_infos_alloc;
+
   /** Number of enabled keys in the Key Package */
   uint32_t key_infos_enabled_cnt;
 
@@ -97,8 +273,89 @@ struct timeseries_kp {
   /** Should the the keys be disabled after a flush? */
   int disable;
 
-  /** Have keys been added since the last call to [backend]->kp_ki_update? */
-  int dirty;
+  /** Should the backends be flushed in parallel? */
+  int parallel;
+
+  /** Result of the most recent flush for each backend (0 if the backend was
+   * flushed successfully, -1 otherwise) */
+  int backend_status[TIMESERIES_BACKEND_ID_LAST];
+
+  /** Number of KIs that each backend has resolved (i.e. KIs with IDs below
+   * this have been passed to [backend]->kp_ki_update) */
+  uint32_t resolved_cnt[TIMESERIES_BACKEND_ID_LAST];
+
+  /** Lock protecting the key dictionary and KI columns
+   *
+   * Held for writing while shards (or, when flushing in the background, the
+   * caller) add keys, and for reading while a flush is taken. The background
+   * flush thread only holds it while each backend resolves new keys.
+   */
+  pthread_rwlock_t dict_lock;
+
+  /** Writer shards attached to this KP */
+  timeseries_kp_shard_t **shards;
+
+  /** Number of writer shards attached to this KP */
+  int shards_cnt;
+
+  /** Method used to combine the values written by different shards */
+  timeseries_kp_combine_t combine;
+
+  /** Sequence number of the most recent shard write (used to find the last
+   * writer when combine is TIMESERIES_KP_COMBINE_LAST) */
+  uint64_t write_seq;
+
+  /** Columns that backends read values from while flushing (either the live
+   * columns or a snapshot being flushed in the background) */
+  uint64_t *view_values;
+  uint64_t *view_enabled;
+  uint32_t view_cnt;
+
+  /** Queue of snapshots to flush (NULL unless flushing in the background) */
+  kp_flush_queue_t *flush_queue;
+
+  /** KI columns replaced since the last background flush finished (protected
+   * by dict_lock) */
+  kp_retired_col_t *retired_cols;
+
+  /** Ring of the results of the most recent flushes */
+  kp_flush_record_t flush_log[FLUSH_LOG_LEN];
+
+  /** Index of the flush log record that will be used next */
+  int flush_log_next;
+
+  /** Lock protecting the flush log (which the flush thread writes) */
+  pthread_mutex_t flush_log_lock;
+};
+
+/** Structure which holds state for a writer shard of a Key Package
+ *
+ * A shard caches the IDs of the keys it has written in its own hash (keyed on
+ * the KP's copies of the key strings), and keeps its own value columns so that
+ * writers never touch the KP columns. Only keys written since the last flush
+ * have their bit set in the shard's written bitmap.
+ */
+struct timeseries_kp_shard {
+  /** Key Package that this shard writes to */
+  timeseries_kp_t *kp;
+
+  /** Hash of key names -> key ids for keys this shard has written */
+  khash_t(keyid) * key_id_hash;
+
+  /** Column of values written since the last flush */
+  uint64_t *values;
+
+  /** Column of write sequence numbers (only for TIMESERIES_KP_COMBINE_LAST) */
+  uint64_t *seqs;
+
+  /** Bitmap of keys written since the last flush */
+  uint64_t *written;
+
+  /** Number of keys that the shard columns have room for */
+  uint32_t alloc;
+
+  /** Lock protecting the shard columns from a concurrent flush */
+  pthread_mutex_t lock;
 };
 
 /** Get the timeseries object associated with the given Key Package
@@ -115,31 +372,247 @@ static timeseries_t *kp_get_timeseries(timeseries_kp_t *kp);
  */
 static void kp_reset_disable(timeseries_kp_t *kp);
 
-/** Initialize the given Key Info object
+/** Build the hash key for the given key string
+ *
+ * @param key           Pointer to the key string
+ * @param key_len       Length of the key string
+ * @return a hash key with the hash of the key string computed
+ */
+static kp_key_t kp_key_make(const char *key, size_t key_len);
+
+/** Grow the KI columns so that they can hold the given number of keys
+ *
+ * @param kp            Pointer to the Key Package to grow
+ * @param cnt           Number of keys the columns must be able to hold
+ * @return 0 if the columns were grown successfully, -1 otherwise
+ */
+static int kp_grow(timeseries_kp_t *kp, uint32_t cnt);
+
+/** Grow a KI column that the background flush thread may be reading
+ *
+ * @param kp            Pointer to the Key Package the column belongs to
+ * @param col           Pointer to the column to grow (may be NULL)
+ * @param old_size      Number of bytes in use in the column
+ * @param new_size      Number of bytes the column must hold
+ * @return pointer to the grown column, NULL if an error occurred
+ *
+ * Without a flush thread this is just realloc. Otherwise the column is copied
+ * and the old one is retired (the caller must hold the dict lock for writing).
+ */
+static void *kp_col_grow(timeseries_kp_t *kp, void *col, size_t old_size,
+                         size_t new_size);
+
+/** Free the KI columns retired by kp_col_grow
+ *
+ * @param kp            Pointer to the Key Package to free the columns of
+ */
+static void kp_retired_free(timeseries_kp_t *kp);
+
+/** Make sure that there is room in the key arena for the given number of bytes
+ *
+ * @param kp            Pointer to the Key Package
+ * @param len           Number of bytes that must be available
+ * @return 0 if there is room in the arena, -1 if a chunk could not be allocated
+ */
+static int kp_key_arena_reserve(timeseries_kp_t *kp, size_t len);
+
+/** Copy the given key into the key arena
+ *
+ * @param kp            Pointer to the Key Package
+ * @param key           Pointer to the key string to copy
+ * @param key_len       Length of the key string (excluding the nul)
+ * @return pointer to the (nul-terminated) copy of the key, NULL if an error
+ * occurred
+ */
+static char *kp_key_arena_strndup(timeseries_kp_t *kp, const char *key,
+                                  size_t key_len);
+
+/** Initialize the Key Info with the given ID
  *
- * @param ki            Pointer to the Key Info object to initialize
- * @param kp            Pointer to the Key Package this KI is associated with
+ * @param kp            Pointer to the Key Package the KI belongs to
+ * @param id            ID of the KI to initialize
  * @param key           Pointer to a key string
+ * @param key_len       Length of the key string
  * @return 0 if the KI was initialized successfully, -1 otherwise
  */
-static int kp_ki_init(timeseries_kp_ki_t *ki, timeseries_kp_t *kp,
-                      const char *key);
+static int kp_ki_init(timeseries_kp_t *kp, uint32_t id, const char *key,
+                      size_t key_len);
 
-/** Free the given Key Info object
+/** Create a new KI for a key that has just been inserted into the key hash
+ *
+ * @param kp            Pointer to the Key Package to add the KI to
+ * @param k             Hash iterator returned by kh_put for the key
+ * @param key           Pointer to the key string
+ * @param key_len       Length of the key string
+ * @return the ID of the new KI, -1 if an error occurred
+ *
+ * The hash entry is updated to point at the KP's own copy of the key.
+ */
+static int kp_ki_add(timeseries_kp_t *kp, khiter_t k, const char *key,
+                     size_t key_len);
+
+/** Free the Key Info with the given ID
  *
- * @param ki_p          Pointer to a KI object to free
  * @param kp            Pointer to the KP object this KI is associated with
+ * @param id            ID of the KI to free
  *
- * @note does NOT free the memory for the actual KI structure
+ * @note does NOT shrink the KI columns
  */
-static void kp_ki_free(timeseries_kp_ki_t *ki, timeseries_kp_t *kp);
+static void kp_ki_free(timeseries_kp_t *kp, uint32_t id);
 
-/** Set the value of the given KI to the given value
+/** Find the first set bit in a bitmap at or after the given index
+ *
+ * @param bitmap        Pointer to the bitmap to search
+ * @param cnt           Number of bits in the bitmap
+ * @param id            Index to start searching from
+ * @return the index of the next set bit, cnt if there are none
  *
- * @param ki            Pointer to the KI object to set the value of
- * @param value         Value to set
+ * @note bits past cnt must never be set
  */
-static void kp_ki_set(timeseries_kp_ki_t *ki, uint64_t value);
+static uint32_t bitmap_next(const uint64_t *bitmap, uint32_t cnt, uint32_t id);
+
+/** Grow the shard columns so that they can hold the given key ID
+ *
+ * @param shard         Pointer to the shard to grow
+ * @param id            Key ID that the columns must be able to hold
+ * @return 0 if the columns were grown successfully, -1 otherwise
+ *
+ * @note must be called with the shard lock held
+ */
+static int shard_grow(timeseries_kp_shard_t *shard, uint32_t id);
+
+/** Look up (or add) a key in the KP dictionary and cache it in a shard
+ *
+ * @param shard         Pointer to the shard that is writing the key
+ * @param hkey          Hash key for the key string
+ * @return the ID of the key, -1 if an error occurred
+ */
+static int shard_resolve_key(timeseries_kp_shard_t *shard, kp_key_t hkey);
+
+/** Write a value for the given key to a shard
+ *
+ * @param shard         Pointer to the shard to write to
+ * @param id            ID of the key to write
+ * @param value         Value to write
+ * @param flags         Bitwise OR of TIMESERIES_KP_UPSERT_* flags (or 0)
+ * @return 0 if the value was written successfully, -1 otherwise
+ */
+static int shard_write(timeseries_kp_shard_t *shard, uint32_t id,
+                       uint64_t value, int flags);
+
+/** Combine the values written to all shards into the KP columns
+ *
+ * @param kp            Pointer to the Key Package to merge the shards of
+ *
+ * @note must be called with the dict lock held
+ */
+static void kp_merge_shards(timeseries_kp_t *kp);
+
+/** Point the backend accessors at the given columns
+ *
+ * @param kp            Pointer to the Key Package
+ * @param values        Column of values to flush
+ * @param enabled       Bitmap of keys to flush
+ * @param cnt           Number of keys in the columns
+ */
+static void kp_set_view(timeseries_kp_t *kp, uint64_t *values,
+                        uint64_t *enabled, uint32_t cnt);
+
+/** Hand the current view of the KP to all enabled backends
+ *
+ * @param kp            Pointer to the Key Package to flush
+ * @param time          The timestamp to associate the values with
+ * @return 0 if the data was written successfully, -1 otherwise
+ *
+ * @note must be called with the dict lock held
+ */
+static int kp_flush_backends(timeseries_kp_t *kp, uint32_t time);
+
+/** Have a backend resolve the KIs in the current view that it has not yet seen
+ *
+ * @param kp            Pointer to the Key Package
+ * @param backend       Pointer to the backend to resolve keys for
+ * @return 0 if the keys were resolved successfully, -1 otherwise
+ */
+static int kp_ki_update_backend(timeseries_kp_t *kp,
+                                timeseries_backend_t *backend);
+
+/** Resolve keys (if needed) and flush the current view of the KP to a backend
+ *
+ * @param kp            Pointer to the Key Package to flush
+ * @param backend       Pointer to the backend to flush to
+ * @param time          The timestamp to associate the values with
+ * @return 0 if the data was written successfully, -1 otherwise
+ */
+static int kp_flush_backend(timeseries_kp_t *kp, timeseries_backend_t *backend,
+                            uint32_t time);
+
+/** Flush a backend from its own thread
+ *
+ * @param data          Pointer to a kp_backend_flush_t
+ * @return NULL
+ */
+static void *kp_flush_backend_thread(void *data);
+
+/** Snapshot the live KP columns into the given snapshot slot
+ *
+ * @param kp            Pointer to the Key Package
+ * @param snap          Pointer to the (free) slot to snapshot into
+ * @return 0 if the snapshot was taken successfully, -1 otherwise
+ *
+ * @note must be called with the dict lock held
+ */
+static int kp_snapshot_take(timeseries_kp_t *kp, kp_snapshot_t *snap);
+
+/** Queue a snapshot of the KP to be flushed by the background thread
+ *
+ * @param kp            Pointer to the Key Package to flush
+ * @param time          The timestamp to associate the values with
+ * @return 0 if the snapshot was queued successfully, -1 otherwise
+ */
+static int kp_flush_async(timeseries_kp_t *kp, uint32_t time);
+
+/** Wait until all queued snapshots have been flushed
+ *
+ * @param q             Pointer to the flush queue
+ */
+static void kp_flush_drain(kp_flush_queue_t *q);
+
+/** Main loop of the background flush thread
+ *
+ * @param data          Pointer to the Key Package to flush
+ * @return NULL
+ */
+static void *kp_flush_thread(void *data);
+
+/** Record the result of a flush (i.e. backend_status) in the flush log
+ *
+ * @param kp            Pointer to the Key Package that was flushed
+ * @param time          The timestamp the values were flushed with
+ */
+static void kp_flush_log_add(timeseries_kp_t *kp, uint32_t time);
+
+/** Get the delivery status of a recent flush
+ *
+ * @param kp            Pointer to the Key Package
+ * @param time          The timestamp the values were flushed with
+ * @param wait          If non-zero, wait for the backends to deliver the
+ *                      values
+ * @return the delivery status of the values
+ */
+static timeseries_kp_flush_status_t kp_flush_status(timeseries_kp_t *kp,
+                                                    uint32_t time, int wait);
+
+/** Add a KI, taking the dict lock if a background flush may be running
+ *
+ * @param kp            Pointer to the Key Package to add the KI to
+ * @param k             Hash iterator returned by kh_put for the key
+ * @param key           Pointer to the key string
+ * @param key_len       Length of the key string
+ * @return the ID of the new KI, -1 if an error occurred
+ */
+static int kp_ki_add_locked(timeseries_kp_t *kp, khiter_t k, const char *key,
+                            size_t key_len);
 
 static timeseries_t *kp_get_timeseries(timeseries_kp_t *kp)
 {
@@ -149,70 +622,864 @@ static timeseries_t *kp_get_timeseries(timeseries_kp_t *kp)
 
 static void kp_reset_disable(timeseries_kp_t *kp)
 {
-  int i;
-  if (kp->reset == 0 && kp->disable == 0) {
+  if (kp->key_infos_cnt == 0) {
     return;
   }
 
-  for (i = 0; i < kp->key_infos_cnt; i++) {
-    if (kp->reset != 0) {
-      kp_ki_set(&kp->key_infos[i], 0);
+  if (kp->reset != 0) {
+    memset(kp->values, 0, sizeof(uint64_t) * kp->key_infos_cnt);
+  }
+
+  if (kp->disable != 0) {
+    memset(kp->enabled, 0,
+           sizeof(uint64_t) * BITMAP_WORDS(kp->key_infos_cnt));
+    kp->key_infos_enabled_cnt = 0;
+  }
+}
+
+static kp_key_t kp_key_make(const char *key, size_t key_len)
+{
+  kp_key_t k = {key, key_len, 2166136261U};
+  size_t i;
+
+  /* 32-bit FNV-1a */
+  for (i = 0; i < key_len; i++) {
+    k.hash = (k.hash ^ (uint8_t)key[i]) * 16777619U;
+  }
+
+  return k;
+}
+
+static int kp_grow(timeseries_kp_t *kp, uint32_t cnt)
+{
+  char **new_keys;
+  uint64_t *new_values;
+  uint64_t *new_enabled;
+  void **new_state;
+  uint32_t *new_ids;
+  int id;
+
+  if (cnt <= kp->key_infos_alloc) {
+    return 0;
+  }
+
+  if ((new_keys = kp_col_grow(kp, kp->keys,
+                              sizeof(char *) * kp->key_infos_alloc,
+                              sizeof(char *) * cnt)) == NULL) {
+    return -1;
+  }
+  /* published with release semantics for a background flush that is reading
+     the key column (see timeseries_kp_ki_get_key) */
+  __atomic_store_n(&kp->keys, new_keys, __ATOMIC_RELEASE);
+
+  if ((new_values = realloc(kp->values, sizeof(uint64_t) * cnt)) == NULL) {
+    return -1;
+  }
+  kp->values = new_values;
+
+  if (BITMAP_WORDS(cnt) > BITMAP_WORDS(kp->key_infos_alloc)) {
+    if ((new_enabled = realloc(kp->enabled, sizeof(uint64_t) *
+                                              BITMAP_WORDS(cnt))) == NULL) {
+      return -1;
+    }
+    memset(&new_enabled[BITMAP_WORDS(kp->key_infos_alloc)], 0,
+           sizeof(uint64_t) *
+             (BITMAP_WORDS(cnt) - BITMAP_WORDS(kp->key_infos_alloc)));
+    kp->enabled = new_enabled;
+  }
+
+  TIMESERIES_FOREACH_BACKEND_ID(id)
+  {
+    if (kp->ki_backend_state[id - 1] == NULL) {
+      continue;
+    }
+    if ((new_state = kp_col_grow(kp, kp->ki_backend_state[id - 1],
+                                 sizeof(void *) * kp->key_infos_alloc,
+                                 sizeof(void *) * cnt)) == NULL) {
+      return -1;
+    }
+    __atomic_store_n(&kp->ki_backend_state[id - 1], new_state,
+                     __ATOMIC_RELEASE);
+  }
+
+  TIMESERIES_FOREACH_BACKEND_ID(id)
+  {
+    if (kp->ki_backend_ids[id - 1] == NULL) {
+      continue;
+    }
+    if ((new_ids = kp_col_grow(kp, kp->ki_backend_ids[id - 1],
+                               sizeof(uint32_t) * kp->key_infos_alloc,
+                               sizeof(uint32_t) * cnt)) == NULL) {
+      return -1;
+    }
+    __atomic_store_n(&kp->ki_backend_ids[id - 1], new_ids, __ATOMIC_RELEASE);
+  }
+
+  kp->key_infos_alloc = cnt;
+  return 0;
+}
+
+static void *kp_col_grow(timeseries_kp_t *kp, void *col, size_t old_size,
+                         size_t new_size)
+{
+  kp_retired_col_t *retired;
+  void *new_col;
+
+  if (kp->flush_queue == NULL || col == NULL) {
+    return realloc(col, new_size);
+  }
+
+  if ((retired = malloc(sizeof(kp_retired_col_t))) == NULL) {
+    return NULL;
+  }
+  if ((new_col = malloc(new_size)) == NULL) {
+    free(retired);
+    return NULL;
+  }
+  memcpy(new_col, col, old_size);
+
+  retired->col = col;
+  retired->next = kp->retired_cols;
+  kp->retired_cols = retired;
+
+  return new_col;
+}
+
+static void kp_retired_free(timeseries_kp_t *kp)
+{
+  kp_retired_col_t *retired;
+
+  while ((retired = kp->retired_cols) != NULL) {
+    kp->retired_cols = retired->next;
+    free(retired->col);
+    free(retired);
+  }
+}
+
+static int kp_key_arena_reserve(timeseries_kp_t *kp, size_t len)
+{
+  kp_key_chunk_t *chunk = kp->key_chunks;
+  size_t chunk_len = KEY_CHUNK_LEN;
+
+  if (chunk != NULL && (chunk->len - chunk->used) >= len) {
+    return 0;
+  }
+
+  /* the remainder of the current chunk (if any) is abandoned */
+  if (len > chunk_len) {
+    chunk_len = len;
+  }
+  if ((chunk = malloc(sizeof(kp_key_chunk_t) + chunk_len)) == NULL) {
+    return -1;
+  }
+  chunk->used = 0;
+  chunk->len = chunk_len;
+  chunk->next = kp->key_chunks;
+  kp->key_chunks = chunk;
+
+  return 0;
+}
+
+static char *kp_key_arena_strndup(timeseries_kp_t *kp, const char *key,
+                                  size_t key_len)
+{
+  char *cpy;
+
+  if (kp_key_arena_reserve(kp, key_len + 1) != 0) {
+    return NULL;
+  }
+
+  cpy = &kp->key_chunks->data[kp->key_chunks->used];
+  memcpy(cpy, key, key_len);
+  cpy[key_len] = '\0';
+  kp->key_chunks->used += key_len + 1;
+
+  return cpy;
+}
+
+static int kp_ki_init(timeseries_kp_t *kp, uint32_t id, const char *key,
+                      size_t key_len)
+{
+  int bid;
+
+  if ((kp->keys[id] = kp_key_arena_strndup(kp, key, key_len)) == NULL) {
+    return -1;
+  }
+
+  /* zero out the KI */
+  kp->values[id] = 0;
+  kp->enabled[id / BITMAP_WORD_BITS] |= 1ULL << (id % BITMAP_WORD_BITS);
+  TIMESERIES_FOREACH_BACKEND_ID(bid)
+  {
+    if (kp->ki_backend_state[bid - 1] != NULL) {
+      kp->ki_backend_state[bid - 1][id] = NULL;
+    }
+  }
+
+  return 0;
+}
+
+static int kp_ki_add(timeseries_kp_t *kp, khiter_t k, const char *key,
+                     size_t key_len)
+{
+  uint32_t this_id = kp->key_infos_cnt;
+
+  /* first we may need to grow the KI columns (geometrically, so that building
+     a large KP does not copy the columns once per key) */
+  if (this_id == kp->key_infos_alloc &&
+      kp_grow(kp, kp->key_infos_alloc < KI_ALLOC_MIN
+                    ? KI_ALLOC_MIN
+                    : kp->key_infos_alloc * 2) != 0) {
+    timeseries_log(__func__, "could not realloc KP KI columns");
+    return -1;
+  }
+
+  if (kp_ki_init(kp, this_id, key, key_len) != 0) {
+    return -1;
+  }
+
+  /* the hash must reference our copy of the key, not the caller's */
+  kh_key(kp->key_id_hash, k).key = kp->keys[this_id];
+  kh_val(kp->key_id_hash, k) = this_id;
+
+  kp->key_infos_cnt++;
+  kp->key_infos_enabled_cnt++;
+
+  return this_id;
+}
+
+static void kp_ki_free(timeseries_kp_t *kp, uint32_t id)
+{
+  timeseries_t *timeseries = kp_get_timeseries(kp);
+  assert(timeseries != NULL);
+  timeseries_backend_t *backend;
+  int bid;
+
+  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, bid)
+  {
+    timeseries_backend_lock(backend);
+    backend->kp_ki_free(backend, kp, id,
+                        timeseries_kp_ki_get_backend_state(kp, id, bid));
+    timeseries_backend_unlock(backend);
+    if (kp->ki_backend_state[bid - 1] != NULL) {
+      kp->ki_backend_state[bid - 1][id] = NULL;
+    }
+  }
+
+  return;
+}
+
+static uint32_t bitmap_next(const uint64_t *bitmap, uint32_t cnt, uint32_t id)
+{
+  uint32_t word_idx = id / BITMAP_WORD_BITS;
+  uint32_t words_cnt = BITMAP_WORDS(cnt);
+  uint64_t word;
+
+  if (id >= cnt) {
+    return cnt;
+  }
+
+  /* ignore the bits for the IDs before this one */
+  word = bitmap[word_idx] & (~0ULL << (id % BITMAP_WORD_BITS));
+
+  /* skip over words with no bits set */
+  while (word == 0) {
+    if (++word_idx == words_cnt) {
+      return cnt;
+    }
+    word = bitmap[word_idx];
+  }
+
+  /* bits past cnt are never set, so this is a valid index */
+  return (word_idx * BITMAP_WORD_BITS) + __builtin_ctzll(word);
+}
+
+static int shard_grow(timeseries_kp_shard_t *shard, uint32_t id)
+{
+  uint32_t cnt = shard->alloc < KI_ALLOC_MIN ? KI_ALLOC_MIN : shard->alloc * 2;
+  uint64_t *new_col;
+
+  if (id < shard->alloc) {
+    return 0;
+  }
+  if (cnt <= id) {
+    cnt = id + 1;
+  }
+
+  if ((new_col = realloc(shard->values, sizeof(uint64_t) * cnt)) == NULL) {
+    return -1;
+  }
+  shard->values = new_col;
+  memset(&shard->values[shard->alloc], 0,
+         sizeof(uint64_t) * (cnt - shard->alloc));
+
+  if (shard->kp->combine == TIMESERIES_KP_COMBINE_LAST) {
+    if ((new_col = realloc(shard->seqs, sizeof(uint64_t) * cnt)) == NULL) {
+      return -1;
     }
-    if (kp->disable != 0) {
-      timeseries_kp_disable_key(kp, i);
+    shard->seqs = new_col;
+  }
+
+  if (BITMAP_WORDS(cnt) > BITMAP_WORDS(shard->alloc)) {
+    if ((new_col = realloc(shard->written,
+                           sizeof(uint64_t) * BITMAP_WORDS(cnt))) == NULL) {
+      return -1;
+    }
+    memset(&new_col[BITMAP_WORDS(shard->alloc)], 0,
+           sizeof(uint64_t) *
+             (BITMAP_WORDS(cnt) - BITMAP_WORDS(shard->alloc)));
+    shard->written = new_col;
+  }
+
+  shard->alloc = cnt;
+  return 0;
+}
+
+static int shard_resolve_key(timeseries_kp_shard_t *shard, kp_key_t hkey)
+{
+  timeseries_kp_t *kp = shard->kp;
+  khiter_t k;
+  int ret;
+  int id;
+
+  pthread_rwlock_wrlock(&kp->dict_lock);
+  k = kh_put(keyid, kp->key_id_hash, hkey, &ret);
+  if (ret == -1) {
+    pthread_rwlock_unlock(&kp->dict_lock);
+    timeseries_log(__func__, "could not add key to hash");
+    return -1;
+  }
+  if (ret == 0) {
+    id = kh_val(kp->key_id_hash, k);
+  } else if ((id = kp_ki_add(kp, k, hkey.key, hkey.len)) == -1) {
+    kh_del(keyid, kp->key_id_hash, k);
+    pthread_rwlock_unlock(&kp->dict_lock);
+    return -1;
+  } else {
+    /* the key will be enabled when a value written for it is merged */
+    timeseries_kp_disable_key(kp, id);
+  }
+  /* the KP copy of the key is never moved, so the shard hash can share it */
+  hkey.key = kp->keys[id];
+  pthread_rwlock_unlock(&kp->dict_lock);
+
+  k = kh_put(keyid, shard->key_id_hash, hkey, &ret);
+  if (ret == -1) {
+    timeseries_log(__func__, "could not add key to shard hash");
+    return -1;
+  }
+  kh_val(shard->key_id_hash, k) = id;
+
+  return id;
+}
+
+static int shard_write(timeseries_kp_shard_t *shard, uint32_t id,
+                       uint64_t value, int flags)
+{
+  pthread_mutex_lock(&shard->lock);
+
+  if (id >= shard->alloc && shard_grow(shard, id) != 0) {
+    pthread_mutex_unlock(&shard->lock);
+    timeseries_log(__func__, "could not realloc shard columns");
+    return -1;
+  }
+
+  /* values are zeroed when they are merged, so adding is always safe */
+  if ((flags & TIMESERIES_KP_UPSERT_ADD) != 0) {
+    shard->values[id] += value;
+  } else {
+    shard->values[id] = value;
+  }
+  shard->written[id / BITMAP_WORD_BITS] |= 1ULL << (id % BITMAP_WORD_BITS);
+
+  if (shard->seqs != NULL) {
+    shard->seqs[id] =
+      __atomic_add_fetch(&shard->kp->write_seq, 1, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+  return 0;
+}
+
+/** Has the given shard written the given key since the last flush? */
+#define SHARD_WRITTEN(shard, id)                                               \
+  ((id) < (shard)->alloc &&                                                    \
+   (((shard)->written[(id) / BITMAP_WORD_BITS] >> ((id) % BITMAP_WORD_BITS)) & \
+    1))
+
+static void kp_merge_shards(timeseries_kp_t *kp)
+{
+  timeseries_kp_shard_t *shard, *other;
+  uint64_t value, seq;
+  uint32_t id;
+  int i, j;
+
+  for (i = 0; i < kp->shards_cnt; i++) {
+    pthread_mutex_lock(&kp->shards[i]->lock);
+  }
+
+  for (i = 0; i < kp->shards_cnt; i++) {
+    shard = kp->shards[i];
+    for (id = bitmap_next(shard->written, shard->alloc, 0); id < shard->alloc;
+         id = bitmap_next(shard->written, shard->alloc, id + 1)) {
+      /* an earlier shard that wrote this key has already merged it */
+      for (j = 0; j < i; j++) {
+        if (SHARD_WRITTEN(kp->shards[j], id)) {
+          break;
+        }
+      }
+      if (j < i) {
+        continue;
+      }
+
+      value = shard->values[id];
+      seq = shard->seqs != NULL ? shard->seqs[id] : 0;
+      for (j = i + 1; j < kp->shards_cnt; j++) {
+        other = kp->shards[j];
+        if (!SHARD_WRITTEN(other, id)) {
+          continue;
+        }
+        switch (kp->combine) {
+        case TIMESERIES_KP_COMBINE_SUM:
+          value += other->values[id];
+          break;
+        case TIMESERIES_KP_COMBINE_MAX:
+          if (other->values[id] > value) {
+            value = other->values[id];
+          }
+          break;
+        case TIMESERIES_KP_COMBINE_LAST:
+          if (other->seqs[id] > seq) {
+            value = other->values[id];
+            seq = other->seqs[id];
+          }
+          break;
+        }
+      }
+
+      kp->values[id] = value;
+      timeseries_kp_enable_key(kp, id);
+    }
+  }
+
+  /* now that every shard has been merged, clear out the written values */
+  for (i = 0; i < kp->shards_cnt; i++) {
+    shard = kp->shards[i];
+    for (id = bitmap_next(shard->written, shard->alloc, 0); id < shard->alloc;
+         id = bitmap_next(shard->written, shard->alloc, id + 1)) {
+      shard->values[id] = 0;
+    }
+    memset(shard->written, 0, sizeof(uint64_t) * BITMAP_WORDS(shard->alloc));
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+static void kp_set_view(timeseries_kp_t *kp, uint64_t *values,
+                        uint64_t *enabled, uint32_t cnt)
+{
+  kp->view_values = values;
+  kp->view_enabled = enabled;
+  kp->view_cnt = cnt;
+}
+
+static int kp_ki_update_backend(timeseries_kp_t *kp,
+                                timeseries_backend_t *backend)
+{
+  uint32_t *resolved_cnt = &kp->resolved_cnt[backend->id - 1];
+  uint32_t cnt = timeseries_kp_ki_cnt(kp);
+
+  /* only the keys added since the last update need to be resolved, and the
+     watermark is only advanced once they all have been */
+  if (*resolved_cnt >= cnt) {
+    return 0;
+  }
+  if (backend->kp_ki_update(backend, kp, *resolved_cnt, cnt) != 0) {
+    return -1;
+  }
+  *resolved_cnt = cnt;
+
+  return 0;
+}
+
+static int kp_flush_backend(timeseries_kp_t *kp, timeseries_backend_t *backend,
+                            uint32_t time)
+{
+  int rc;
+
+  timeseries_backend_lock(backend);
+
+  /* the flush thread only needs the dictionary while the backend resolves any
+     new keys. after that it only reads KI columns, which are retired rather
+     than freed when the caller grows them */
+  if (kp->flush_queue != NULL) {
+    pthread_rwlock_rdlock(&kp->dict_lock);
+  }
+  rc = kp_ki_update_backend(kp, backend);
+  if (kp->flush_queue != NULL) {
+    pthread_rwlock_unlock(&kp->dict_lock);
+  }
+  if (rc == 0) {
+    rc = backend->kp_flush(backend, kp, time);
+  }
+
+  timeseries_backend_unlock(backend);
+
+  if (rc == 0) {
+    timeseries_backend_spool_recovered(backend);
+    return 0;
+  }
+
+  /* if the backend has a spool, the values will be written once it
+     recovers */
+  if (timeseries_backend_spool_kp(backend, kp, time) == 0) {
+    timeseries_log(__func__, "flush to %s backend failed, values spooled",
+                   timeseries_backend_get_name(backend));
+    return 0;
+  }
+
+  return -1;
+}
+
+static void *kp_flush_backend_thread(void *data)
+{
+  kp_backend_flush_t *f = (kp_backend_flush_t *)data;
+  f->rc = kp_flush_backend(f->kp, f->backend, f->time);
+  return NULL;
+}
+
+static int kp_flush_backends(timeseries_kp_t *kp, uint32_t time)
+{
+  int id;
+  timeseries_backend_t *backend;
+  timeseries_t *timeseries = kp_get_timeseries(kp);
+  assert(timeseries != NULL);
+  kp_backend_flush_t flushes[TIMESERIES_BACKEND_ID_LAST];
+  int started[TIMESERIES_BACKEND_ID_LAST];
+  int rc = 0;
+
+  TIMESERIES_FOREACH_BACKEND_ID(id)
+  {
+    kp->backend_status[id - 1] = -1;
+    started[id - 1] = 0;
+  }
+
+  if (kp->parallel == 0) {
+    TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
+    {
+      if ((kp->backend_status[id - 1] =
+             kp_flush_backend(kp, backend, time)) != 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  /* the backends only read the view, and each only writes its own state, so
+     they can all be flushed at once. each thread holds its backend's lock (in
+     kp_flush_backend), so a backend that is also written by another KP or by
+     timeseries_set_single is still only used by one thread at a time */
+  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
+  {
+    flushes[id - 1].kp = kp;
+    flushes[id - 1].backend = backend;
+    flushes[id - 1].time = time;
+    flushes[id - 1].rc = -1;
+    if (pthread_create(&flushes[id - 1].thread, NULL, kp_flush_backend_thread,
+                       &flushes[id - 1]) != 0) {
+      /* fall back to flushing this backend ourselves */
+      kp_flush_backend_thread(&flushes[id - 1]);
+    } else {
+      started[id - 1] = 1;
+    }
+  }
+
+  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
+  {
+    if (started[id - 1] != 0) {
+      pthread_join(flushes[id - 1].thread, NULL);
+    }
+    if ((kp->backend_status[id - 1] = flushes[id - 1].rc) != 0) {
+      timeseries_log(__func__, "flush to %s backend failed",
+                     timeseries_backend_get_name(backend));
+      rc = -1;
+    }
+  }
+
+  return rc;
+}
+
+static int kp_snapshot_take(timeseries_kp_t *kp, kp_snapshot_t *snap)
+{
+  uint32_t cnt = kp->key_infos_cnt;
+  uint32_t words = BITMAP_WORDS(kp->key_infos_alloc);
+  uint64_t *tmp;
+
+  /* the snapshot columns may be swapped with the live ones, so they need at
+     least as much room as the live columns */
+  if (snap->alloc < kp->key_infos_alloc) {
+    if ((tmp = realloc(snap->values, sizeof(uint64_t) * kp->key_infos_alloc)) ==
+        NULL) {
+      return -1;
+    }
+    snap->values = tmp;
+    if ((tmp = realloc(snap->enabled, sizeof(uint64_t) * words)) == NULL) {
+      return -1;
+    }
+    memset(&tmp[BITMAP_WORDS(snap->alloc)], 0,
+           sizeof(uint64_t) * (words - BITMAP_WORDS(snap->alloc)));
+    snap->enabled = tmp;
+    snap->alloc = kp->key_infos_alloc;
+  }
+
+  snap->cnt = cnt;
+  if (cnt == 0) {
+    return 0;
+  }
+
+  if (kp->reset != 0) {
+    /* the standby column becomes the live one, so it must be all zeroes */
+    if (snap->zeroed < cnt) {
+      memset(&snap->values[snap->zeroed], 0,
+             sizeof(uint64_t) * (cnt - snap->zeroed));
+    }
+    tmp = kp->values;
+    kp->values = snap->values;
+    snap->values = tmp;
+    snap->zeroed = 0;
+  } else {
+    memcpy(snap->values, kp->values, sizeof(uint64_t) * cnt);
+  }
+
+  if (kp->disable != 0) {
+    /* the standby bitmap is cleared by the flush thread */
+    tmp = kp->enabled;
+    kp->enabled = snap->enabled;
+    snap->enabled = tmp;
+    kp->key_infos_enabled_cnt = 0;
+  } else {
+    memcpy(snap->enabled, kp->enabled, sizeof(uint64_t) * BITMAP_WORDS(cnt));
+  }
+
+  /* the swapped columns may be larger than the KP thinks, but never smaller */
+  snap->alloc = kp->key_infos_alloc;
+
+  return 0;
+}
+
+static int kp_flush_async(timeseries_kp_t *kp, uint32_t time)
+{
+  kp_flush_queue_t *q = kp->flush_queue;
+  kp_snapshot_t *snap;
+  int rc;
+
+  /* block until the flush thread has room for another snapshot */
+  pthread_mutex_lock(&q->lock);
+  while (q->queued == q->depth) {
+    pthread_cond_wait(&q->done_cond, &q->lock);
+  }
+  snap = &q->slots[(q->head + q->queued) % q->depth];
+  pthread_mutex_unlock(&q->lock);
+
+  /* only this thread queues snapshots, so the slot will stay free */
+  pthread_rwlock_rdlock(&kp->dict_lock);
+  if (kp->shards_cnt > 0) {
+    kp_merge_shards(kp);
+  }
+  rc = kp_snapshot_take(kp, snap);
+  pthread_rwlock_unlock(&kp->dict_lock);
+
+  if (rc != 0) {
+    timeseries_log(__func__, "could not realloc KP snapshot columns");
+    return -1;
+  }
+  snap->time = time;
+
+  pthread_mutex_lock(&q->lock);
+  q->queued++;
+  pthread_cond_signal(&q->queued_cond);
+  pthread_mutex_unlock(&q->lock);
+
+  return 0;
+}
+
+static void kp_flush_drain(kp_flush_queue_t *q)
+{
+  pthread_mutex_lock(&q->lock);
+  while (q->queued > 0) {
+    pthread_cond_wait(&q->done_cond, &q->lock);
+  }
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void *kp_flush_thread(void *data)
+{
+  timeseries_kp_t *kp = (timeseries_kp_t *)data;
+  kp_flush_queue_t *q = kp->flush_queue;
+  kp_snapshot_t *snap;
+  int rc;
+
+  pthread_mutex_lock(&q->lock);
+  while (1) {
+    while (q->queued == 0 && q->shutdown == 0) {
+      pthread_cond_wait(&q->queued_cond, &q->lock);
+    }
+    if (q->queued == 0) {
+      /* shutting down, and everything has been flushed */
+      break;
+    }
+    snap = &q->slots[q->head];
+    pthread_mutex_unlock(&q->lock);
+
+    /* the caller may keep adding keys while this flushes */
+    kp_set_view(kp, snap->values, snap->enabled, snap->cnt);
+    rc = kp_flush_backends(kp, snap->time);
+    kp_flush_log_add(kp, snap->time);
+
+    /* nothing is reading the columns that were replaced during the flush */
+    pthread_rwlock_wrlock(&kp->dict_lock);
+    kp_retired_free(kp);
+    pthread_rwlock_unlock(&kp->dict_lock);
+
+    /* prepare the slot to be swapped back in as the live columns */
+    if (snap->cnt > 0 && kp->reset != 0) {
+      memset(snap->values, 0, sizeof(uint64_t) * snap->cnt);
+      snap->zeroed = snap->cnt;
+    }
+    if (snap->cnt > 0 && kp->disable != 0) {
+      memset(snap->enabled, 0, sizeof(uint64_t) * BITMAP_WORDS(snap->cnt));
+    }
+
+    pthread_mutex_lock(&q->lock);
+    if (rc != 0) {
+      q->error = 1;
     }
+    q->head = (q->head + 1) % q->depth;
+    q->queued--;
+    pthread_cond_broadcast(&q->done_cond);
   }
+  pthread_mutex_unlock(&q->lock);
+
+  return NULL;
 }
 
-static int kp_ki_init(timeseries_kp_ki_t *ki, timeseries_kp_t *kp,
-                      const char *key)
+static int kp_ki_add_locked(timeseries_kp_t *kp, khiter_t k, const char *key,
+                            size_t key_len)
 {
-  assert(ki != NULL);
+  int id;
 
-  if ((ki->key = strdup(key)) == NULL) {
-    kp_ki_free(ki, kp);
-    return -1;
+  /* the flush thread reads the key and backend state columns, which may move
+     when they grow */
+  if (kp->flush_queue == NULL) {
+    return kp_ki_add(kp, k, key, key_len);
   }
 
-  /* zero out the structure */
-  ki->value = 0;
-  ki->disabled = 0;
-  memset(&ki->backend_state, 0, sizeof(void *) * TIMESERIES_BACKEND_ID_LAST);
+  pthread_rwlock_wrlock(&kp->dict_lock);
+  id = kp_ki_add(kp, k, key, key_len);
+  pthread_rwlock_unlock(&kp->dict_lock);
 
-  return 0;
+  return id;
+}
+
+static void kp_flush_log_add(timeseries_kp_t *kp, uint32_t time)
+{
+  kp_flush_record_t *rec;
+
+  pthread_mutex_lock(&kp->flush_log_lock);
+  rec = &kp->flush_log[kp->flush_log_next];
+  kp->flush_log_next = (kp->flush_log_next + 1) % FLUSH_LOG_LEN;
+  rec->time = time;
+  rec->used = 1;
+  memcpy(rec->backend_status, kp->backend_status,
+         sizeof(rec->backend_status));
+  pthread_mutex_unlock(&kp->flush_log_lock);
 }
 
-static void kp_ki_free(timeseries_kp_ki_t *ki, timeseries_kp_t *kp)
+static timeseries_kp_flush_status_t kp_flush_status(timeseries_kp_t *kp,
+                                                    uint32_t time, int wait)
 {
+  kp_flush_queue_t *q = kp->flush_queue;
+  kp_flush_record_t rec;
   timeseries_t *timeseries = kp_get_timeseries(kp);
-  assert(timeseries != NULL);
   timeseries_backend_t *backend;
-  int id;
+  timeseries_kp_flush_status_t status, backend_status;
+  int i, id;
 
-  if (ki == NULL) {
-    return;
+  /* a snapshot for this time may still be waiting for the flush thread */
+  if (q != NULL) {
+    pthread_mutex_lock(&q->lock);
+    for (i = 0; i < q->queued; i++) {
+      if (q->slots[(q->head + i) % q->depth].time == time) {
+        pthread_mutex_unlock(&q->lock);
+        return TIMESERIES_KP_FLUSH_PENDING;
+      }
+    }
+    pthread_mutex_unlock(&q->lock);
   }
 
-  free(ki->key);
-  ki->key = NULL;
+  /* find the most recent flush for this time */
+  rec.used = 0;
+  pthread_mutex_lock(&kp->flush_log_lock);
+  for (i = 1; i <= FLUSH_LOG_LEN; i++) {
+    kp_flush_record_t *r =
+      &kp->flush_log[(kp->flush_log_next + FLUSH_LOG_LEN - i) % FLUSH_LOG_LEN];
+    if (r->used != 0 && r->time == time) {
+      rec = *r;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&kp->flush_log_lock);
+  if (rec.used == 0) {
+    return TIMESERIES_KP_FLUSH_UNKNOWN;
+  }
 
+  /* a failure anywhere is a failure, otherwise anything pending (or unknown)
+     means the flush is not known to be delivered */
+  status = TIMESERIES_KP_FLUSH_DELIVERED;
   TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
   {
-    backend->kp_ki_free(backend, kp, ki, ki->backend_state[id - 1]);
-    ki->backend_state[id - 1] = NULL;
+    if (rec.backend_status[id - 1] != 0) {
+      return TIMESERIES_KP_FLUSH_FAILED;
+    }
+    /* not under the backend lock: waiting may take as long as the backend
+       takes to give up on the values, and must not stall other writers */
+    backend_status = backend->flush_status(backend, time, wait);
+    if (backend_status == TIMESERIES_KP_FLUSH_FAILED) {
+      return TIMESERIES_KP_FLUSH_FAILED;
+    }
+    if (backend_status == TIMESERIES_KP_FLUSH_PENDING ||
+        status == TIMESERIES_KP_FLUSH_DELIVERED) {
+      status = backend_status;
+    }
   }
 
-  return;
+  return status;
 }
 
-static void kp_ki_set(timeseries_kp_ki_t *ki, uint64_t value)
-{
-  ki->value = value;
-}
+/** State passed to kp_backend_stat by timeseries_kp_add_backend_stats */
+typedef struct kp_backend_stats {
+  timeseries_kp_t *kp;
+  const char *key_prefix;
+  int error;
+} kp_backend_stats_t;
 
-static uint64_t kp_ki_get(timeseries_kp_ki_t *ki)
+static void kp_backend_stat(timeseries_backend_t *backend, const char *name,
+                            uint64_t value, void *user)
 {
-  return ki->value;
+  kp_backend_stats_t *ctx = user;
+  char key[1024];
+  int len;
+
+  len = snprintf(key, sizeof(key), "%s.%s.%s", ctx->key_prefix,
+                 timeseries_backend_get_name(backend), name);
+  if (len < 0 || (size_t)len >= sizeof(key)) {
+    timeseries_log(__func__, "stat key too long: %s", name);
+    ctx->error = 1;
+    return;
+  }
+
+  if (timeseries_kp_upsert(ctx->kp, key, len, value, 0) < 0) {
+    ctx->error = 1;
+  }
 }
 
 /* ========== PROTECTED FUNCTIONS ========== */
@@ -228,45 +1495,100 @@ int timeseries_kp_enabled_size(timeseries_kp_t *kp)
   return kp->key_infos_enabled_cnt;
 }
 
-timeseries_kp_ki_t *timeseries_kp_get_ki(timeseries_kp_t *kp, int id)
+const char *timeseries_kp_ki_get_key(timeseries_kp_t *kp, uint32_t id)
+{
+  assert(kp != NULL && id < kp->view_cnt);
+  /* a background flush reads the keys while the caller may grow the column */
+  return __atomic_load_n(&kp->keys, __ATOMIC_ACQUIRE)[id];
+}
+
+uint32_t timeseries_kp_ki_cnt(timeseries_kp_t *kp)
 {
   assert(kp != NULL);
-  if (id >= 0 && id < kp->key_infos_cnt) {
-    return &kp->key_infos[id];
-  }
-  return NULL;
+  return kp->view_cnt;
 }
 
-const char *timeseries_kp_ki_get_key(timeseries_kp_ki_t *ki)
+uint64_t timeseries_kp_ki_get_value(timeseries_kp_t *kp, uint32_t id)
 {
-  assert(ki != NULL);
-  return ki->key;
+  assert(kp != NULL && id < kp->view_cnt);
+  return kp->view_values[id];
 }
 
-uint64_t timeseries_kp_ki_get_value(timeseries_kp_ki_t *ki)
+int timeseries_kp_ki_enabled(timeseries_kp_t *kp, uint32_t id)
 {
-  assert(ki != NULL);
-  return ki->value;
+  assert(kp != NULL && id < kp->view_cnt);
+  return (kp->view_enabled[id / BITMAP_WORD_BITS] >> (id % BITMAP_WORD_BITS)) &
+         1;
 }
 
-int timeseries_kp_ki_enabled(timeseries_kp_ki_t *ki)
+uint32_t timeseries_kp_ki_next_enabled(timeseries_kp_t *kp, uint32_t id)
 {
-  return !ki->disabled;
+  return bitmap_next(kp->view_enabled, kp->view_cnt, id);
 }
 
-void *timeseries_kp_ki_get_backend_state(timeseries_kp_ki_t *ki,
-                                         timeseries_backend_id_t id)
+void *timeseries_kp_ki_get_backend_state(timeseries_kp_t *kp, uint32_t id,
+                                         timeseries_backend_id_t backend_id)
 {
-  assert(ki != NULL);
-  return ki->backend_state[id - 1];
+  void **col;
+
+  assert(kp != NULL && id < kp->key_infos_cnt);
+  if ((col = __atomic_load_n(&kp->ki_backend_state[backend_id - 1],
+                             __ATOMIC_ACQUIRE)) == NULL) {
+    return NULL;
+  }
+  return col[id];
+}
+
+int timeseries_kp_ki_set_backend_state(timeseries_kp_t *kp, uint32_t id,
+                                       timeseries_backend_id_t backend_id,
+                                       void *ki_state)
+{
+  assert(kp != NULL && id < kp->key_infos_cnt);
+
+  /* lazily create the state column the first time this backend needs it */
+  if (kp->ki_backend_state[backend_id - 1] == NULL) {
+    if (ki_state == NULL) {
+      return 0;
+    }
+    if ((kp->ki_backend_state[backend_id - 1] =
+           calloc(kp->key_infos_alloc, sizeof(void *))) == NULL) {
+      timeseries_log(__func__, "could not malloc KI backend state column");
+      return -1;
+    }
+  }
+
+  kp->ki_backend_state[backend_id - 1][id] = ki_state;
+  return 0;
+}
+
+uint32_t *timeseries_kp_ki_backend_ids(timeseries_kp_t *kp,
+                                       timeseries_backend_id_t backend_id)
+{
+  uint32_t *col;
+
+  assert(kp != NULL);
+
+  /* a background flush only reads an existing column (it is created while
+     the backend resolves keys, with the dict lock held) */
+  if ((col = __atomic_load_n(&kp->ki_backend_ids[backend_id - 1],
+                             __ATOMIC_ACQUIRE)) != NULL) {
+    return col;
+  }
+  if ((col = calloc(kp->key_infos_alloc > 0 ? kp->key_infos_alloc : 1,
+                    sizeof(uint32_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc KI backend ID column");
+    return NULL;
+  }
+  __atomic_store_n(&kp->ki_backend_ids[backend_id - 1], col, __ATOMIC_RELEASE);
+
+  return col;
 }
 
-void timeseries_kp_ki_set_backend_state(timeseries_kp_ki_t *ki,
-                                        timeseries_backend_id_t id,
-                                        void *ki_state)
+void *timeseries_kp_get_backend_state(timeseries_kp_t *kp,
+                                      timeseries_backend_id_t backend_id)
 {
-  assert(ki != NULL);
-  ki->backend_state[id - 1] = ki_state;
+  assert(kp != NULL);
+  return kp->backend_state[backend_id - 1];
 }
 
 /* ========== PUBLIC FUNCTIONS ========== */
@@ -277,6 +1599,7 @@ timeseries_kp_t *timeseries_kp_init(timeseries_t *timeseries, int flags)
   timeseries_kp_t *kp = NULL;
   int id;
   timeseries_backend_t *backend;
+  int rc;
 
   /* we only need to malloc the Package, keys will be malloc'd on the fly */
   if ((kp = malloc_zero(sizeof(timeseries_kp_t))) == NULL) {
@@ -285,7 +1608,7 @@ timeseries_kp_t *timeseries_kp_init(timeseries_t *timeseries, int flags)
   }
 
   /* prep the key hash */
-  if ((kp->key_id_hash = kh_init(strint)) == NULL) {
+  if ((kp->key_id_hash = kh_init(keyid)) == NULL) {
     timeseries_log(__func__, "could not init key hash");
     return NULL;
   }
@@ -293,14 +1616,21 @@ timeseries_kp_t *timeseries_kp_init(timeseries_t *timeseries, int flags)
   /* save the timeseries pointer */
   kp->timeseries = timeseries;
 
+  pthread_rwlock_init(&kp->dict_lock, NULL);
+  pthread_mutex_init(&kp->flush_log_lock, NULL);
+
   /* check the flags */
   kp->reset = flags & TIMESERIES_KP_RESET;
   kp->disable = flags & TIMESERIES_KP_DISABLE;
+  kp->parallel = flags & TIMESERIES_KP_PARALLEL_FLUSH;
 
   /* let each backend store some state about this kp, if they like */
   TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
   {
-    if (backend->kp_init(backend, kp, &kp->backend_state[id - 1]) != 0) {
+    timeseries_backend_lock(backend);
+    rc = backend->kp_init(backend, kp, &kp->backend_state[id - 1]);
+    timeseries_backend_unlock(backend);
+    if (rc != 0) {
       return NULL;
     }
   }
@@ -311,6 +1641,7 @@ timeseries_kp_t *timeseries_kp_init(timeseries_t *timeseries, int flags)
 void timeseries_kp_free(timeseries_kp_t **kp_p)
 {
   timeseries_kp_t *kp;
+  timeseries_kp_shard_t *shard;
   timeseries_t *timeseries;
   timeseries_backend_t *backend;
   int i, id;
@@ -322,21 +1653,72 @@ void timeseries_kp_free(timeseries_kp_t **kp_p)
   }
   *kp_p = NULL;
 
+  /* let the flush thread finish any pending flushes */
+  if (kp->flush_queue != NULL) {
+    kp_flush_queue_t *q = kp->flush_queue;
+    pthread_mutex_lock(&q->lock);
+    q->shutdown = 1;
+    pthread_cond_signal(&q->queued_cond);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+
+    for (i = 0; i < q->depth; i++) {
+      free(q->slots[i].values);
+      free(q->slots[i].enabled);
+    }
+    free(q->slots);
+    kp_retired_free(kp);
+    pthread_cond_destroy(&q->queued_cond);
+    pthread_cond_destroy(&q->done_cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+    kp->flush_queue = NULL;
+  }
+
+  /* free any shards that the writers did not free */
+  while (kp->shards_cnt > 0) {
+    shard = kp->shards[kp->shards_cnt - 1];
+    timeseries_kp_shard_free(&shard);
+  }
+  free(kp->shards);
+  kp->shards = NULL;
+  pthread_rwlock_destroy(&kp->dict_lock);
+  pthread_mutex_destroy(&kp->flush_log_lock);
+
   /* destroy the key hash */
-  kh_destroy(strint, kp->key_id_hash);
+  kh_destroy(keyid, kp->key_id_hash);
 
   for (i = 0; i < kp->key_infos_cnt; i++) {
-    kp_ki_free(&kp->key_infos[i], kp);
+    kp_ki_free(kp, i);
   }
 
-  free(kp->key_infos);
-  kp->key_infos = NULL;
+  free(kp->keys);
+  kp->keys = NULL;
+  while (kp->key_chunks != NULL) {
+    kp_key_chunk_t *next = kp->key_chunks->next;
+    free(kp->key_chunks);
+    kp->key_chunks = next;
+  }
+  free(kp->values);
+  kp->values = NULL;
+  free(kp->enabled);
+  kp->enabled = NULL;
+  TIMESERIES_FOREACH_BACKEND_ID(id)
+  {
+    free(kp->ki_backend_state[id - 1]);
+    kp->ki_backend_state[id - 1] = NULL;
+    free(kp->ki_backend_ids[id - 1]);
+    kp->ki_backend_ids[id - 1] = NULL;
+  }
   kp->key_infos_cnt = 0;
+  kp->key_infos_alloc = 0;
 
   timeseries = kp_get_timeseries(kp);
   TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
   {
+    timeseries_backend_lock(backend);
     backend->kp_free(backend, kp, kp->backend_state[id - 1]);
+    timeseries_backend_unlock(backend);
     kp->backend_state[id - 1] = NULL;
   }
 
@@ -347,52 +1729,116 @@ void timeseries_kp_free(timeseries_kp_t **kp_p)
 }
 
 int timeseries_kp_add_key(timeseries_kp_t *kp, const char *key)
+{
+  assert(key != NULL);
+  return timeseries_kp_add_key_n(kp, key, strlen(key));
+}
+
+int timeseries_kp_add_key_n(timeseries_kp_t *kp, const char *key,
+                            size_t key_len)
 {
   assert(kp != NULL);
   assert(key != NULL);
   int ret;
   khiter_t k;
-  int this_id = kp->key_infos_cnt;
-  timeseries_kp_ki_t *ki = NULL;
+  int this_id;
 
-  /* first we need to realloc the array of keys */
-  if ((kp->key_infos = realloc(kp->key_infos, sizeof(timeseries_kp_ki_t) *
-                                                (this_id + 1))) == NULL) {
-    timeseries_log(__func__, "could not realloc KP KI array");
+  /* add a lookup in the hash */
+  k = kh_put(keyid, kp->key_id_hash, kp_key_make(key, key_len), &ret);
+  if (ret == -1) {
+    timeseries_log(__func__, "could not add key to hash");
     return -1;
   }
 
-  ki = &kp->key_infos[this_id];
-  assert(ki != NULL);
-
-  if (kp_ki_init(ki, kp, key) != 0) {
-    return -1;
+  if ((this_id = kp_ki_add_locked(kp, k, key, key_len)) == -1 && ret != 0) {
+    kh_del(keyid, kp->key_id_hash, k);
   }
 
-  /* now add a lookup in the hash */
-  k = kh_put(strint, kp->key_id_hash, timeseries_kp_ki_get_key(ki), &ret);
+  return this_id;
+}
+
+int timeseries_kp_upsert(timeseries_kp_t *kp, const char *key, size_t key_len,
+                         uint64_t value, int flags)
+{
+  assert(kp != NULL);
+  assert(key != NULL);
+  int ret;
+  khiter_t k;
+  int id;
+
+  /* a single probe either finds the existing key or makes room for it */
+  k = kh_put(keyid, kp->key_id_hash, kp_key_make(key, key_len), &ret);
   if (ret == -1) {
     timeseries_log(__func__, "could not add key to hash");
     return -1;
   }
-  kh_val(kp->key_id_hash, k) = this_id;
 
-  kp->key_infos_cnt++;
-  kp->key_infos_enabled_cnt++;
+  if (ret == 0) {
+    id = kh_val(kp->key_id_hash, k);
+    timeseries_kp_enable_key(kp, id);
+  } else if ((id = kp_ki_add_locked(kp, k, key, key_len)) == -1) {
+    kh_del(keyid, kp->key_id_hash, k);
+    return -1;
+  }
 
-  /* backends will need to update their state */
-  kp->dirty = 1;
+  if ((flags & TIMESERIES_KP_UPSERT_ADD) != 0) {
+    kp->values[id] += value;
+  } else {
+    kp->values[id] = value;
+  }
 
-  return this_id;
+  return id;
+}
+
+int timeseries_kp_reserve(timeseries_kp_t *kp, uint32_t n_keys,
+                          size_t n_key_bytes)
+{
+  assert(kp != NULL);
+  int rc;
+
+  if (kp->flush_queue != NULL) {
+    pthread_rwlock_wrlock(&kp->dict_lock);
+  }
+  rc = kp_grow(kp, kp->key_infos_cnt + n_keys);
+  if (kp->flush_queue != NULL) {
+    pthread_rwlock_unlock(&kp->dict_lock);
+  }
+  if (rc != 0) {
+    timeseries_log(__func__, "could not realloc KP KI columns");
+    return -1;
+  }
+
+  /* leave room for the nul terminators too */
+  if (n_key_bytes > 0 && kp_key_arena_reserve(kp, n_key_bytes + n_keys) != 0) {
+    timeseries_log(__func__, "could not malloc key arena chunk");
+    return -1;
+  }
+
+  /* khash keeps its load factor below 0.77, so size the buckets to match */
+  if (kh_resize(keyid, kp->key_id_hash,
+                (kp->key_infos_cnt + n_keys) / 0.75 + 1) != 0) {
+    timeseries_log(__func__, "could not resize key hash");
+    return -1;
+  }
+
+  return 0;
 }
 
 int timeseries_kp_get_key(timeseries_kp_t *kp, const char *key)
+{
+  assert(key != NULL);
+  return timeseries_kp_get_key_n(kp, key, strlen(key));
+}
+
+int timeseries_kp_get_key_n(timeseries_kp_t *kp, const char *key,
+                            size_t key_len)
 {
   khiter_t k;
   assert(kp != NULL);
 
   /* just check the hash */
-  if ((k = kh_get(strint, kp->key_id_hash, key)) == kh_end(kp->key_id_hash)) {
+  if ((k = kh_get(keyid, kp->key_id_hash, kp_key_make(key, key_len))) ==
+      kh_end(kp->key_id_hash)) {
     return -1;
   }
   return kh_val(kp->key_id_hash, k);
@@ -403,28 +1849,30 @@ const char *timeseries_kp_get_key_name(timeseries_kp_t *kp, uint32_t key)
   if (key >= kp->key_infos_cnt) {
     return NULL;
   }
-  return kp->key_infos[key].key;
+  return kp->keys[key];
 }
 
 void timeseries_kp_disable_key(timeseries_kp_t *kp, uint32_t key)
 {
-  if (kp->key_infos[key].disabled == 0) {
-    kp->key_infos[key].disabled = 1;
+  uint64_t mask = 1ULL << (key % BITMAP_WORD_BITS);
+  if ((kp->enabled[key / BITMAP_WORD_BITS] & mask) != 0) {
+    kp->enabled[key / BITMAP_WORD_BITS] &= ~mask;
     kp->key_infos_enabled_cnt--;
   }
 }
 
 void timeseries_kp_enable_key(timeseries_kp_t *kp, uint32_t key)
 {
-  if (kp->key_infos[key].disabled != 0) {
-    kp->key_infos[key].disabled = 0;
+  uint64_t mask = 1ULL << (key % BITMAP_WORD_BITS);
+  if ((kp->enabled[key / BITMAP_WORD_BITS] & mask) == 0) {
+    kp->enabled[key / BITMAP_WORD_BITS] |= mask;
     kp->key_infos_enabled_cnt++;
   }
 }
 
 uint64_t timeseries_kp_get(timeseries_kp_t *kp, uint32_t key)
 {
-  return kp_ki_get(&kp->key_infos[key]);
+  return kp->values[key];
 }
 
 void timeseries_kp_set(timeseries_kp_t *kp, uint32_t key, uint64_t value)
@@ -432,7 +1880,26 @@ void timeseries_kp_set(timeseries_kp_t *kp, uint32_t key, uint64_t value)
   assert(kp != NULL);
   assert(key < kp->key_infos_cnt);
 
-  kp_ki_set(&kp->key_infos[key], value);
+  kp->values[key] = value;
+}
+
+void timeseries_kp_add(timeseries_kp_t *kp, uint32_t key, uint64_t delta)
+{
+  assert(kp != NULL);
+  assert(key < kp->key_infos_cnt);
+
+  kp->values[key] += delta;
+}
+
+void timeseries_kp_add_atomic(timeseries_kp_t *kp, uint32_t key,
+                              uint64_t delta)
+{
+  assert(kp != NULL);
+  assert(key < kp->key_infos_cnt);
+
+  /* we only need the increment itself to be atomic, there is no ordering
+     with respect to other memory operations */
+  __atomic_fetch_add(&kp->values[key], delta, __ATOMIC_RELAXED);
 }
 
 int timeseries_kp_resolve(timeseries_kp_t *kp)
@@ -441,44 +1908,312 @@ int timeseries_kp_resolve(timeseries_kp_t *kp)
   timeseries_backend_t *backend;
   timeseries_t *timeseries = kp_get_timeseries(kp);
   assert(timeseries != NULL);
+  int rc = 0;
+
+  /* the backends must not be used by the flush thread at the same time */
+  if (kp->flush_queue != NULL) {
+    kp_flush_drain(kp->flush_queue);
+  }
 
-  /* this is a forced resolve, so we always resolve, but we mark the KP as not
-     dirty */
-  kp->dirty = 0;
+  pthread_rwlock_rdlock(&kp->dict_lock);
+  kp_set_view(kp, kp->values, kp->enabled, kp->key_infos_cnt);
 
   TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
   {
-    if (backend->kp_ki_update(backend, kp) != 0) {
-      return -1;
+    timeseries_backend_lock(backend);
+    rc = kp_ki_update_backend(kp, backend);
+    timeseries_backend_unlock(backend);
+    if (rc != 0) {
+      break;
     }
   }
 
-  return 0;
+  pthread_rwlock_unlock(&kp->dict_lock);
+  return rc;
 }
 
 int timeseries_kp_flush(timeseries_kp_t *kp, uint32_t time)
 {
-  int id;
-  timeseries_backend_t *backend;
-  int dirty;
-  timeseries_t *timeseries = kp_get_timeseries(kp);
-  assert(timeseries != NULL);
+  int rc;
 
-  dirty = kp->dirty;
-  kp->dirty = 0;
+  if (kp->flush_queue != NULL) {
+    return kp_flush_async(kp, time);
+  }
 
-  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
-  {
-    if (dirty != 0 && backend->kp_ki_update(backend, kp) != 0) {
-      kp->dirty = 1; /* otherwise the next call won't resolve keys */
-      return -1;
-    }
+  /* shards may not add keys (and so move the KI columns) while we flush */
+  pthread_rwlock_rdlock(&kp->dict_lock);
 
-    if (backend->kp_flush(backend, kp, time) != 0) {
-      return -1;
-    }
+  if (kp->shards_cnt > 0) {
+    kp_merge_shards(kp);
+  }
+
+  kp_set_view(kp, kp->values, kp->enabled, kp->key_infos_cnt);
+  if ((rc = kp_flush_backends(kp, time)) == 0) {
+    kp_reset_disable(kp);
+  }
+  kp_flush_log_add(kp, time);
+
+  pthread_rwlock_unlock(&kp->dict_lock);
+  return rc;
+}
+
+int timeseries_kp_flush_sync(timeseries_kp_t *kp, uint32_t time)
+{
+  assert(kp != NULL);
+
+  if (timeseries_kp_flush(kp, time) != 0) {
+    return -1;
   }
 
+  /* nothing else may write to the backends while we wait for them */
+  if (kp->flush_queue != NULL) {
+    kp_flush_drain(kp->flush_queue);
+  }
+
+  return kp_flush_status(kp, time, 1) == TIMESERIES_KP_FLUSH_DELIVERED ? 0
+                                                                        : -1;
+}
+
+timeseries_kp_flush_status_t timeseries_kp_flush_status(timeseries_kp_t *kp,
+                                                        uint32_t time)
+{
+  assert(kp != NULL);
+  return kp_flush_status(kp, time, 0);
+}
+
+int timeseries_kp_flush_backend(timeseries_kp_t *kp,
+                                timeseries_backend_t *backend, uint32_t time)
+{
+  assert(kp != NULL && backend != NULL);
+  assert(kp->shards_cnt == 0 && kp->flush_queue == NULL);
+
+  kp_set_view(kp, kp->values, kp->enabled, kp->key_infos_cnt);
+  if (kp_ki_update_backend(kp, backend) != 0 ||
+      backend->kp_flush(backend, kp, time) != 0) {
+    return -1;
+  }
   kp_reset_disable(kp);
+
+  return 0;
+}
+
+int timeseries_kp_set_async(timeseries_kp_t *kp, int queue_depth)
+{
+  assert(kp != NULL);
+  kp_flush_queue_t *q;
+
+  if (kp->flush_queue != NULL) {
+    timeseries_log(__func__, "background flushing is already enabled");
+    return -1;
+  }
+  if (queue_depth < 1) {
+    timeseries_log(__func__, "queue depth must be at least 1");
+    return -1;
+  }
+
+  if ((q = malloc_zero(sizeof(kp_flush_queue_t))) == NULL ||
+      (q->slots = calloc(queue_depth, sizeof(kp_snapshot_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc flush queue");
+    free(q);
+    return -1;
+  }
+  q->depth = queue_depth;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->queued_cond, NULL);
+  pthread_cond_init(&q->done_cond, NULL);
+
+  kp->flush_queue = q;
+  if (pthread_create(&q->thread, NULL, kp_flush_thread, kp) != 0) {
+    timeseries_log(__func__, "could not start flush thread");
+    kp->flush_queue = NULL;
+    pthread_cond_destroy(&q->queued_cond);
+    pthread_cond_destroy(&q->done_cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q->slots);
+    free(q);
+    return -1;
+  }
+
+  return 0;
+}
+
+int timeseries_kp_flush_wait(timeseries_kp_t *kp)
+{
+  kp_flush_queue_t *q;
+  int rc;
+
+  assert(kp != NULL);
+  if ((q = kp->flush_queue) == NULL) {
+    return 0;
+  }
+
+  kp_flush_drain(q);
+
+  pthread_mutex_lock(&q->lock);
+  rc = q->error != 0 ? -1 : 0;
+  q->error = 0;
+  pthread_mutex_unlock(&q->lock);
+
+  return rc;
+}
+
+int timeseries_kp_get_backend_status(timeseries_kp_t *kp,
+                                     timeseries_backend_id_t id)
+{
+  assert(kp != NULL);
+  assert(id >= TIMESERIES_BACKEND_ID_FIRST && id <= TIMESERIES_BACKEND_ID_LAST);
+  return kp->backend_status[id - 1];
+}
+
+int timeseries_kp_add_backend_stats(timeseries_kp_t *kp,
+                                    timeseries_backend_t *backend,
+                                    const char *key_prefix)
+{
+  assert(kp != NULL);
+  assert(backend != NULL);
+  assert(key_prefix != NULL);
+
+  kp_backend_stats_t ctx = {kp, key_prefix, 0};
+
+  if (timeseries_backend_get_stats(backend, kp_backend_stat, &ctx) != 0) {
+    return -1;
+  }
+
+  return ctx.error != 0 ? -1 : 0;
+}
+
+int timeseries_kp_set_combine(timeseries_kp_t *kp,
+                              timeseries_kp_combine_t combine)
+{
+  assert(kp != NULL);
+
+  if (kp->shards_cnt > 0) {
+    timeseries_log(__func__, "combine method must be set before adding shards");
+    return -1;
+  }
+
+  kp->combine = combine;
   return 0;
 }
+
+timeseries_kp_shard_t *timeseries_kp_shard_init(timeseries_kp_t *kp)
+{
+  assert(kp != NULL);
+  timeseries_kp_shard_t *shard;
+  timeseries_kp_shard_t **new_shards;
+
+  if ((shard = malloc_zero(sizeof(timeseries_kp_shard_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc KP shard");
+    return NULL;
+  }
+  shard->kp = kp;
+  pthread_mutex_init(&shard->lock, NULL);
+
+  if ((shard->key_id_hash = kh_init(keyid)) == NULL) {
+    timeseries_log(__func__, "could not init shard key hash");
+    goto err;
+  }
+
+  pthread_rwlock_wrlock(&kp->dict_lock);
+  if ((new_shards = realloc(kp->shards, sizeof(timeseries_kp_shard_t *) *
+                                          (kp->shards_cnt + 1))) == NULL) {
+    pthread_rwlock_unlock(&kp->dict_lock);
+    timeseries_log(__func__, "could not realloc KP shards");
+    goto err;
+  }
+  kp->shards = new_shards;
+  kp->shards[kp->shards_cnt++] = shard;
+  pthread_rwlock_unlock(&kp->dict_lock);
+
+  return shard;
+
+err:
+  if (shard->key_id_hash != NULL) {
+    kh_destroy(keyid, shard->key_id_hash);
+  }
+  pthread_mutex_destroy(&shard->lock);
+  free(shard);
+  return NULL;
+}
+
+void timeseries_kp_shard_free(timeseries_kp_shard_t **shard_p)
+{
+  timeseries_kp_shard_t *shard;
+  timeseries_kp_t *kp;
+  int i;
+
+  assert(shard_p != NULL);
+  shard = *shard_p;
+  if (shard == NULL) {
+    return;
+  }
+  *shard_p = NULL;
+  kp = shard->kp;
+
+  /* detach the shard so that flushes no longer merge it */
+  pthread_rwlock_wrlock(&kp->dict_lock);
+  for (i = 0; i < kp->shards_cnt; i++) {
+    if (kp->shards[i] == shard) {
+      /* keep the order (which is also the merge lock order) intact */
+      memmove(&kp->shards[i], &kp->shards[i + 1],
+              sizeof(timeseries_kp_shard_t *) * (kp->shards_cnt - i - 1));
+      kp->shards_cnt--;
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&kp->dict_lock);
+
+  kh_destroy(keyid, shard->key_id_hash);
+  free(shard->values);
+  free(shard->seqs);
+  free(shard->written);
+  pthread_mutex_destroy(&shard->lock);
+  free(shard);
+}
+
+int timeseries_kp_shard_upsert(timeseries_kp_shard_t *shard, const char *key,
+                               size_t key_len, uint64_t value, int flags)
+{
+  assert(shard != NULL);
+  assert(key != NULL);
+  kp_key_t hkey = kp_key_make(key, key_len);
+  khiter_t k;
+  int id;
+
+  /* only keys this shard has never written need to touch the KP dictionary */
+  if ((k = kh_get(keyid, shard->key_id_hash, hkey)) !=
+      kh_end(shard->key_id_hash)) {
+    id = kh_val(shard->key_id_hash, k);
+  } else if ((id = shard_resolve_key(shard, hkey)) == -1) {
+    return -1;
+  }
+
+  if (shard_write(shard, id, value, flags) != 0) {
+    return -1;
+  }
+
+  return id;
+}
+
+int timeseries_kp_shard_set(timeseries_kp_shard_t *shard, uint32_t key,
+                            uint64_t value)
+{
+  timeseries_kp_t *kp;
+  uint32_t cnt;
+
+  assert(shard != NULL);
+  kp = shard->kp;
+
+  /* other shards may be adding keys, so the count is read under the lock */
+  pthread_rwlock_rdlock(&kp->dict_lock);
+  cnt = kp->key_infos_cnt;
+  pthread_rwlock_unlock(&kp->dict_lock);
+
+  if (key >= cnt) {
+    timeseries_log(__func__, "invalid key ID %" PRIu32 " (KP has %" PRIu32
+                   " keys)", key, cnt);
+    return -1;
+  }
+
+  return shard_write(shard, key, value, 0);
+}
@@ -46,73 +46,139 @@
  */
 
 /**
- * @name Protected Opaque Data Structures
+ * @name Protected Data Structures
  *
  * @{ */
 
-/** Opaque struct holding state for a timeseries Key Package Key */
-typedef struct timeseries_kp_ki timeseries_kp_ki_t;
-
 /** @} */
 
-/**
- * @name Protected Data Structures
+/** Iterate over the IDs of all Key Info objects in the given Key Package
  *
- * @{ */
-
-/** @} */
+ * Key Info (KI) state is stored by the KP in columns (one array per field)
+ * indexed by the key ID, so rather than handing out a KI object this iterates
+ * over IDs that can be passed to the timeseries_kp_ki_* accessors.
+ */
+#define TIMESERIES_KP_FOREACH_KI(kp, id)                                       \
+  for (id = 0; id < timeseries_kp_ki_cnt(kp); id++)
 
-#define TIMESERIES_KP_FOREACH_KI(kp, ki, id)                                   \
-  int cnt = timeseries_kp_size(kp);                                            \
-  for (id = 0, (ki = timeseries_kp_get_ki(kp, id)); id < cnt;                  \
-       id++, (ki = timeseries_kp_get_ki(kp, id)))
+/** Iterate over the IDs of the enabled Key Info objects in the given Key
+ * Package
+ *
+ * The enabled bitmap is scanned a word at a time, so the cost of the loop
+ * depends on the number of enabled keys rather than the size of the KP.
+ */
+#define TIMESERIES_KP_FOREACH_ENABLED_KI(kp, id)                               \
+  for (id = timeseries_kp_ki_next_enabled(kp, 0);                              \
+       id < timeseries_kp_ki_cnt(kp);                                          \
+       id = timeseries_kp_ki_next_enabled(kp, id + 1))
 
-/** Get the Key Info object with the given ID
+/** Get the number of Key Infos that are visible to the backends
+ *
+ * @param kp            pointer to the Key Package
+ * @return the number of KIs being flushed
  *
- * @param kp            Pointer to the KP to retrieve the Key from
- * @param id            ID of the Key Info object to retrieve
- * @return pointer to the Key Info object with the given ID, NULL if none exists
+ * When the KP is flushed in the background, the backends see a snapshot of
+ * the KP, which may have fewer keys than the KP itself.
  */
-timeseries_kp_ki_t *timeseries_kp_get_ki(timeseries_kp_t *kp, int id);
+uint32_t timeseries_kp_ki_cnt(timeseries_kp_t *kp);
 
-/** Get the string key from a Key Info object
+/** Get the string key for the given Key Info
  *
- * @param key           pointer to a Key Package Key Info object
+ * @param kp            pointer to the Key Package
+ * @param id            ID of the Key Info
  * @return a pointer to the string representation of the Key Info
  */
-const char *timeseries_kp_ki_get_key(timeseries_kp_ki_t *ki);
+const char *timeseries_kp_ki_get_key(timeseries_kp_t *kp, uint32_t id);
 
-/** Get the value of the given Key Info object
+/** Get the value of the given Key Info
  *
- * @param key           pointer to a Key Package Key Info object
+ * @param kp            pointer to the Key Package
+ * @param id            ID of the Key Info
  * @return current value for the given Key Info
  */
-uint64_t timeseries_kp_ki_get_value(timeseries_kp_ki_t *ki);
+uint64_t timeseries_kp_ki_get_value(timeseries_kp_t *kp, uint32_t id);
 
 /** Is this KI enabled?
  *
- * @param ki            pointer to a Key Package Key Info object
+ * @param kp            pointer to the Key Package
+ * @param id            ID of the Key Info
  * @return 1 if the KI is enabled (should be dumped), 0 otherwise
  */
-int timeseries_kp_ki_enabled(timeseries_kp_ki_t *ki);
+int timeseries_kp_ki_enabled(timeseries_kp_t *kp, uint32_t id);
+
+/** Find the next enabled KI
+ *
+ * @param kp            pointer to the Key Package
+ * @param id            ID of the KI to start searching from (inclusive)
+ * @return the ID of the first enabled KI with an ID >= id, or
+ * timeseries_kp_ki_cnt if there are no more enabled KIs
+ */
+uint32_t timeseries_kp_ki_next_enabled(timeseries_kp_t *kp, uint32_t id);
 
-/** Get the backend state of the given Key Info object
+/** Get the backend state of the given Key Info
  *
- * @param ki            pointer to a Key Package Key Info object
+ * @param kp            pointer to the Key Package
+ * @param id            ID of the Key Info
  * @param backend_id    ID of the backend state to retrieve
  * @return pointer to the state for this backend/info pair
  */
-void *timeseries_kp_ki_get_backend_state(timeseries_kp_ki_t *ki,
-                                         timeseries_backend_id_t id);
+void *timeseries_kp_ki_get_backend_state(timeseries_kp_t *kp, uint32_t id,
+                                         timeseries_backend_id_t backend_id);
 
-/** Set the backend state of the given Key Info object
+/** Set the backend state of the given Key Info
  *
- * @param ki            pointer to a Key Package Key Info object
+ * @param kp            pointer to the Key Package
+ * @param id            ID of the Key Info
  * @param backend_id    ID of the backend state to store
- * @param ki_state      pointer to the state to store in the KI object
+ * @param ki_state      pointer to the state to store for the KI
+ * @return 0 if the state was stored successfully, -1 otherwise
+ *
+ * @note the state column for a backend is only allocated the first time the
+ * backend stores state, so backends that keep no per-key state cost nothing.
+ */
+int timeseries_kp_ki_set_backend_state(timeseries_kp_t *kp, uint32_t id,
+                                       timeseries_backend_id_t backend_id,
+                                       void *ki_state);
+
+/** Get the fixed-width KI ID column for the given backend
+ *
+ * @param kp            pointer to the Key Package
+ * @param backend_id    ID of the backend to get the column for
+ * @return pointer to an array of IDs indexed by KI ID, NULL if the column
+ * could not be allocated
+ *
+ * Backends that only need to map each KI to a 32-bit ID (e.g. a DBATS key ID)
+ * should use this rather than allocating per-KI state. The column is
+ * allocated (zeroed) the first time it is requested and grows with the KP.
+ *
+ * @note the column may move when keys are added, so the pointer must only be
+ * used for the duration of a single kp_ki_update or kp_flush call
+ */
+uint32_t *timeseries_kp_ki_backend_ids(timeseries_kp_t *kp,
+                                       timeseries_backend_id_t backend_id);
+
+/** Get the state the given backend allocated for the Key Package
+ *
+ * @param kp            pointer to the Key Package
+ * @param backend_id    ID of the backend to get the state for
+ * @return the state created by the backend's kp_init function (may be NULL)
+ */
+void *timeseries_kp_get_backend_state(timeseries_kp_t *kp,
+                                      timeseries_backend_id_t backend_id);
+
+/** Flush the values in the given Key Package to a single backend
+ *
+ * @param kp            Pointer to the KP to flush values for
+ * @param backend       Pointer to the backend to flush to
+ * @param time          The timestamp to associate the values with in the DB
+ * @return 0 if the data was written successfully, -1 otherwise.
+ *
+ * This is used by the backend spool to replay spooled values through a KP of
+ * its own. Unlike timeseries_kp_flush, failures are not spooled, and the
+ * caller must hold the backend lock. The KP must not have shards or be
+ * flushed in the background.
  */
-void timeseries_kp_ki_set_backend_state(timeseries_kp_ki_t *ki,
-                                        timeseries_backend_id_t id,
-                                        void *ki_state);
+int timeseries_kp_flush_backend(timeseries_kp_t *kp,
+                                timeseries_backend_t *backend, uint32_t time);
 
 #endif /* __TIMESERIES_KP_INT_H */
@@ -54,6 +54,9 @@
 /** Opaque struct holding state for a timeseries key package */
 typedef struct timeseries_kp timeseries_kp_t;
 
+/** Opaque struct holding state for a writer shard of a key package */
+typedef struct timeseries_kp_shard timeseries_kp_shard_t;
+
 /** @} */
 
 /**
@@ -67,6 +70,15 @@ enum {
 
   /** Deactivate all keys after a flush */
   TIMESERIES_KP_DISABLE = 0x2,
+
+  /** Flush each backend on its own thread */
+  TIMESERIES_KP_PARALLEL_FLUSH = 0x4,
+};
+
+/** Flags for timeseries_kp_upsert */
+enum {
+  /** Add the value to the current value of the key rather than replacing it */
+  TIMESERIES_KP_UPSERT_ADD = 0x1,
 };
 
 /** @} */
@@ -76,13 +88,42 @@ enum {
  *
  * @{ */
 
+/** Methods for combining the values that different shards wrote for a key */
+typedef enum {
+  /** The flushed value is the sum of the values from all shards */
+  TIMESERIES_KP_COMBINE_SUM = 0,
+
+  /** The flushed value is the largest of the values from all shards */
+  TIMESERIES_KP_COMBINE_MAX = 1,
+
+  /** The flushed value is the value that was written most recently */
+  TIMESERIES_KP_COMBINE_LAST = 2,
+} timeseries_kp_combine_t;
+
+/** Delivery status of the values flushed for a given time */
+typedef enum {
+  /** No recent flush for the time is known */
+  TIMESERIES_KP_FLUSH_UNKNOWN = 0,
+
+  /** The values have been delivered to all backends */
+  TIMESERIES_KP_FLUSH_DELIVERED = 1,
+
+  /** Some values are still waiting to be flushed or acknowledged */
+  TIMESERIES_KP_FLUSH_PENDING = 2,
+
+  /** Some values could not be delivered (they may still be replayed from a
+      spool later) */
+  TIMESERIES_KP_FLUSH_FAILED = 3,
+} timeseries_kp_flush_status_t;
+
 /** @} */
 
 /** Initialize a Key Package
  *
  * @param timeseries    Pointer to the timeseries instance to associate the key
  *                      package with
- * @param flags         Should the values be reset and/or deactivated on flush.
+ * @param flags         Should the values be reset and/or deactivated on flush,
+ *                      and should the backends be flushed in parallel.
  * @return a pointer to a Key Package structure, NULL if an error occurs
  *
  * DBATS supports highly-efficient writes if the key names are known a priori,
@@ -102,6 +143,11 @@ enum {
  * If not all key names are known during initialization, then the
  * timeseries_kp_add_key function can be used to add keys incrementally.
  * There is currently no mechanism for removing keys.
+ *
+ * If several backends are enabled, TIMESERIES_KP_PARALLEL_FLUSH makes a flush
+ * take as long as the slowest backend rather than the sum of all backends. A
+ * backend that is busy with another flush (or a timeseries_set_single call)
+ * is waited for, so each backend still only writes one thing at a time.
  */
 timeseries_kp_t *timeseries_kp_init(timeseries_t *timeseries, int flags);
 
@@ -119,6 +165,51 @@ void timeseries_kp_free(timeseries_kp_t **kp_p);
  */
 int timeseries_kp_add_key(timeseries_kp_t *kp, const char *key);
 
+/** Add a key that is not nul-terminated to an existing Key Package
+ *
+ * @param kp          The Key Package to add the key to
+ * @param key         Pointer to the name of the key to add
+ * @param key_len     Length of the key name
+ * @return the index of the key that was added, -1 if an error occurred
+ *
+ * The KP makes its own (nul-terminated) copy of the key, so key may point
+ * directly into a larger buffer (e.g. a message received from Kafka).
+ */
+int timeseries_kp_add_key_n(timeseries_kp_t *kp, const char *key,
+                            size_t key_len);
+
+/** Pre-allocate space in a Key Package for keys that will be added
+ *
+ * @param kp            The Key Package to reserve space in
+ * @param n_keys        Number of keys that will be added
+ * @param n_key_bytes   Total length of the names of the keys that will be
+ *                      added (may be 0 if unknown)
+ * @return 0 if the space was reserved successfully, -1 otherwise
+ *
+ * Calling this before adding a large number of keys with
+ * timeseries_kp_add_key avoids repeatedly growing the KP as the keys are
+ * added.
+ */
+int timeseries_kp_reserve(timeseries_kp_t *kp, uint32_t n_keys,
+                          size_t n_key_bytes);
+
+/** Set the value of a key, adding the key to the Key Package if needed
+ *
+ * @param kp            The Key Package to update
+ * @param key           Pointer to the name of the key (need not be
+ *                      nul-terminated)
+ * @param key_len       Length of the key name
+ * @param value         Value to set the key to
+ * @param flags         Bitwise OR of TIMESERIES_KP_UPSERT_* flags (or 0)
+ * @return the ID of the key, -1 if an error occurred
+ *
+ * This is equivalent to calling timeseries_kp_get_key, then either
+ * timeseries_kp_add_key or timeseries_kp_enable_key, and finally
+ * timeseries_kp_set, but only performs a single hash lookup.
+ */
+int timeseries_kp_upsert(timeseries_kp_t *kp, const char *key, size_t key_len,
+                         uint64_t value, int flags);
+
 /** Get the ID of the given key
  *
  * @param kp            The Key Package to search
@@ -128,6 +219,17 @@ int timeseries_kp_add_key(timeseries_kp_t *kp, const char *key);
  */
 int timeseries_kp_get_key(timeseries_kp_t *kp, const char *key);
 
+/** Get the ID of the given key that is not nul-terminated
+ *
+ * @param kp            The Key Package to search
+ * @param key           Pointer to the key name to look for
+ * @param key_len       Length of the key name
+ * @return the ID of the key (to be used with timeseries_kp_set) if it exists,
+ * -1 otherwise
+ */
+int timeseries_kp_get_key_n(timeseries_kp_t *kp, const char *key,
+                            size_t key_len);
+
 /** Get the key name for the given key ID
  *
  * @param kp            The Key Package to search
@@ -170,6 +272,35 @@ uint64_t timeseries_kp_get(timeseries_kp_t *kp, uint32_t key);
  */
 void timeseries_kp_set(timeseries_kp_t *kp, uint32_t key, uint64_t value);
 
+/** Add to the current value for the given key in a Key Package
+ *
+ * @param kp            Pointer to the KP to update the value in
+ * @param key           Index of the key (as returned by kp_add_key) to
+ *                      update the value for
+ * @param delta         Amount to add to the current value
+ */
+void timeseries_kp_add(timeseries_kp_t *kp, uint32_t key, uint64_t delta);
+
+/** Atomically add to the current value for the given key in a Key Package
+ *
+ * @param kp            Pointer to the KP to update the value in
+ * @param key           Index of the key (as returned by kp_add_key) to
+ *                      update the value for
+ * @param delta         Amount to add to the current value
+ *
+ * This is a thread-safe version of timeseries_kp_add that may be used to
+ * update counters from multiple threads at once. It uses a relaxed atomic
+ * increment, so it is only slightly more expensive than timeseries_kp_add.
+ *
+ * @note keys must not be added to the KP while other threads are using this
+ * function, since adding keys may move the value storage. Nor may the KP be
+ * flushed in the background (see timeseries_kp_set_async): the flush swaps
+ * the value column, so an increment made concurrently may land in the
+ * snapshot being flushed, or be lost when the swapped-out column is zeroed.
+ */
+void timeseries_kp_add_atomic(timeseries_kp_t *kp, uint32_t key,
+                              uint64_t delta);
+
 /** Force the backends to resolve all keys in the key package (if needed)
  *
  * @param kp            Pointer to the KP to resolve keys for
@@ -189,10 +320,182 @@ int timeseries_kp_resolve(timeseries_kp_t *kp);
  * @param time          The timestamp to associate the values with in the DB
  * @return 0 if the data was written successfully, -1 otherwise.
  *
+ * If background flushing has been enabled (see timeseries_kp_set_async), this
+ * only takes a snapshot of the values and returns 0 once it has been queued.
+ * Errors from the backends are then reported by timeseries_kp_flush_wait.
+ *
+ * If a backend that fails to write the values has a spool (see
+ * timeseries_enable_spool), the values are spooled to be replayed later and
+ * the flush to that backend counts as successful.
+ *
  * @note this will only flush to those backends enabled when the KP was created
  */
 int timeseries_kp_flush(timeseries_kp_t *kp, uint32_t time);
 
+/** Flush the Key Package and wait for the values to be delivered
+ *
+ * @param kp            Pointer to the KP to flush
+ * @param time          Time of the values to flush
+ * @return 0 if the values were delivered to all backends, -1 otherwise
+ *
+ * Unlike timeseries_kp_flush, this also waits for backends that write
+ * asynchronously (e.g. Kafka) to report that the values were acknowledged.
+ * If background flushing is enabled, this first waits for all pending
+ * flushes to complete.
+ */
+int timeseries_kp_flush_sync(timeseries_kp_t *kp, uint32_t time);
+
+/** Get the delivery status of a recent flush
+ *
+ * @param kp            Pointer to the KP to get the status for
+ * @param time          Time that was passed to timeseries_kp_flush
+ * @return the delivery status of the values flushed for the given time
+ *
+ * Only the most recent flushes are tracked. This does not wait for pending
+ * deliveries, use timeseries_kp_flush_sync for that. Backends that write
+ * asynchronously track deliveries by time, so values for the same time from
+ * other KPs count too.
+ */
+timeseries_kp_flush_status_t timeseries_kp_flush_status(timeseries_kp_t *kp,
+                                                        uint32_t time);
+
+/** Get the result of the most recent flush to the given backend
+ *
+ * @param kp            Pointer to the KP to get the status for
+ * @param id            ID of the backend to get the status for
+ * @return 0 if the backend was flushed successfully, -1 if the flush failed
+ * or the backend was not flushed
+ *
+ * When timeseries_kp_flush fails, this can be used to find out which of the
+ * backends the values were written to. Sequential flushes stop at the first
+ * backend that fails, whereas with TIMESERIES_KP_PARALLEL_FLUSH all backends
+ * are always attempted. When flushing in the background, call
+ * timeseries_kp_flush_wait first.
+ */
+int timeseries_kp_get_backend_status(timeseries_kp_t *kp,
+                                     timeseries_backend_id_t id);
+
+/** Set keys in the Key Package to the statistics of the given backend
+ *
+ * @param kp            Pointer to the KP to update
+ * @param backend       Pointer to the backend to get the statistics of
+ * @param key_prefix    Prefix of the key names
+ * @return 0 if the statistics were added, -1 otherwise
+ *
+ * Each statistic reported by timeseries_backend_get_stats is upserted as
+ * "<key_prefix>.<backend name>.<statistic>". Calling this before each
+ * timeseries_kp_flush records the statistics as time series (which may be
+ * written to the same backend).
+ */
+int timeseries_kp_add_backend_stats(timeseries_kp_t *kp,
+                                    timeseries_backend_t *backend,
+                                    const char *key_prefix);
+
+/** Flush the Key Package to the backends from a background thread
+ *
+ * @param kp            Pointer to the KP to flush in the background
+ * @param queue_depth   Maximum number of flushes that may be pending
+ * @return 0 if background flushing was enabled, -1 otherwise
+ *
+ * Once enabled, timeseries_kp_flush swaps the value and enabled columns into a
+ * standby buffer (or copies them, if the KP neither resets values nor
+ * disables keys) and returns immediately. A thread owned by the KP writes the
+ * snapshot to the backends while the caller fills in the next interval. If
+ * queue_depth flushes are already pending, timeseries_kp_flush blocks until
+ * one of them completes.
+ *
+ * Keys may still be added while a flush is in progress. Adding a key only
+ * waits while the flush thread has a backend resolve the keys added since the
+ * previous flush, never for the values to be written.
+ *
+ * @note timeseries_kp_add_atomic must not be used on a KP that flushes in the
+ * background, since the flush swaps the value column and increments made
+ * while it does so may be written to the snapshot being flushed or lost.
+ */
+int timeseries_kp_set_async(timeseries_kp_t *kp, int queue_depth);
+
+/** Wait for all pending background flushes to complete
+ *
+ * @param kp            Pointer to the KP to wait for
+ * @return 0 if all background flushes since the last call succeeded, -1 if any
+ * of them failed
+ *
+ * Returns 0 immediately if background flushing is not enabled.
+ */
+int timeseries_kp_flush_wait(timeseries_kp_t *kp);
+
+/** Set how the values written by shards are combined when the KP is flushed
+ *
+ * @param kp            Pointer to the KP to set the combine method for
+ * @param combine       Method to use to combine shard values
+ * @return 0 if the method was set successfully, -1 if the KP already has shards
+ *
+ * The default method is TIMESERIES_KP_COMBINE_SUM. This must be called before
+ * any shards are created.
+ */
+int timeseries_kp_set_combine(timeseries_kp_t *kp,
+                              timeseries_kp_combine_t combine);
+
+/** Create a writer shard for the given Key Package
+ *
+ * @param kp            Pointer to the KP to create a shard for
+ * @return a pointer to the new shard, NULL if an error occurred
+ *
+ * Shards allow several threads to write values into a single KP concurrently.
+ * Each writer thread should create its own shard and use
+ * timeseries_kp_shard_upsert (or timeseries_kp_shard_set) to write values. The
+ * shards share the KP's key dictionary, but each has its own hash and value
+ * columns, so writers only contend with each other when they add new keys.
+ *
+ * When the KP is flushed, the values written to each shard since the last
+ * flush are combined (see timeseries_kp_set_combine) and copied into the KP
+ * before it is written to the backends. Keys written by shards are enabled
+ * before the flush. timeseries_kp_flush may be called from any one thread.
+ *
+ * @note while the KP has shards, the non-shard functions that modify the KP
+ * (e.g. timeseries_kp_add_key or timeseries_kp_set) must not be used
+ * concurrently with shard writers.
+ */
+timeseries_kp_shard_t *timeseries_kp_shard_init(timeseries_kp_t *kp);
+
+/** Free a Key Package shard
+ *
+ * @param shard_p       Double pointer to the shard to free
+ *
+ * Values written to the shard since the last flush are discarded. Shards that
+ * have not been freed when the KP is freed are freed along with it.
+ */
+void timeseries_kp_shard_free(timeseries_kp_shard_t **shard_p);
+
+/** Set the value of a key in a shard, adding the key to the KP if needed
+ *
+ * @param shard         Pointer to the shard to write to
+ * @param key           Pointer to the name of the key (need not be
+ *                      nul-terminated)
+ * @param key_len       Length of the key name
+ * @param value         Value to set the key to
+ * @param flags         Bitwise OR of TIMESERIES_KP_UPSERT_* flags (or 0)
+ * @return the ID of the key, -1 if an error occurred
+ *
+ * This is the shard equivalent of timeseries_kp_upsert. With
+ * TIMESERIES_KP_UPSERT_ADD, the value is added to the value written to this
+ * shard since the last flush.
+ */
+int timeseries_kp_shard_upsert(timeseries_kp_shard_t *shard, const char *key,
+                               size_t key_len, uint64_t value, int flags);
+
+/** Set the value of a key in a shard using the key ID
+ *
+ * @param shard         Pointer to the shard to write to
+ * @param key           ID of the key (as returned by timeseries_kp_add_key or
+ *                      timeseries_kp_shard_upsert)
+ * @param value         Value to set the key to
+ * @return 0 if the value was set successfully, -1 if the key ID is not in the
+ *         KP or an error occurred
+ */
+int timeseries_kp_shard_set(timeseries_kp_shard_t *shard, uint32_t key,
+                            uint64_t value);
+
 /** Get the number of Keys in the given Key Package
  *
  * @param kp            pointer to a Key Package
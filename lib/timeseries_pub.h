@@ -104,6 +104,33 @@ void timeseries_free(timeseries_t **timeseries);
 int timeseries_enable_backend(timeseries_backend_t *backend,
                               const char *options);
 
+/** Spool the Key Package flushes that the given backend fails to write
+ *
+ * @param timeseries    The timeseries object that the backend belongs to
+ * @param backend       Pointer to an enabled backend
+ * @param dir           Directory to store the spool in (must exist)
+ * @param max_size      Maximum number of bytes to keep in the spool
+ * @return 0 if spooling was enabled, -1 if an error occurred
+ *
+ * When a flush to the backend fails (e.g. because a database or broker is
+ * unavailable), the values are appended to a spool of files named
+ * <dir>/<backend>.<segment>.spool rather than being lost. A background thread
+ * replays the spool once the backend can be written to again, pausing between
+ * snapshots so that live flushes keep most of the backend's time. If the
+ * spool grows beyond max_size, the oldest segments are discarded. Anything
+ * left in the spool when libtimeseries is freed is replayed by the next
+ * instance that enables the spool.
+ *
+ * Values are written with at-least-once semantics: a flush that failed part
+ * way through is replayed in full.
+ *
+ * @note this should be called after timeseries_enable_backend, and before
+ * anything is written to the backend.
+ */
+int timeseries_enable_spool(timeseries_t *timeseries,
+                            timeseries_backend_t *backend, const char *dir,
+                            uint64_t max_size);
+
 /** Retrieve the backend object for the given backend ID
  *
  * @param timeseries    The timeseries object to retrieve the backend object
@@ -150,4 +177,15 @@ timeseries_backend_t **timeseries_get_all_backends(timeseries_t *timeseries);
 int timeseries_set_single(timeseries_t *timeseries, const char *key,
                           uint64_t value, uint32_t time);
 
+/** Write any values buffered by timeseries_set_single to all enabled backends
+ *
+ * @param timeseries    Pointer to the timeseries object to flush
+ * @return 0 if all backends were flushed successfully, -1 otherwise
+ *
+ * Some backends (e.g. DBATS) buffer values written with
+ * timeseries_set_single and write them in batches. Buffered values are
+ * written when this function is called, and when the backend is freed.
+ */
+int timeseries_flush(timeseries_t *timeseries);
+
 #endif /* __TIMESERIES_PUB_H */
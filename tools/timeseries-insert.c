@@ -48,6 +48,9 @@
 
 #define BUFFER_LEN 1024
 
+/** Maximum size of the spool for each backend (1 GiB) */
+#define SPOOL_MAX_SIZE (1024 * 1024 * 1024)
+
 static timeseries_t *timeseries = NULL;
 static timeseries_kp_t *kp = NULL;
 static int points_pending = 0;
@@ -128,15 +131,15 @@ static int insert(char *line)
       points_pending = 0;
     }
 
-    /* attempt to get id for this key */
-    if ((key_id = timeseries_kp_get_key(kp, key)) == -1 &&
-        (key_id = timeseries_kp_add_key(kp, key)) == -1) {
+    /* set the value for this key, adding it if needed. strsep replaced the
+       space after the key with a nul, so the key ends just before the value */
+    if ((key_id = timeseries_kp_upsert(kp, key, value_str - key - 1, value,
+                                       0)) == -1) {
       fprintf(stderr, "ERROR: Could not add key (%s) to KP\n", key);
       return -1;
     }
     assert(key_id >= 0);
 
-    timeseries_kp_set(kp, key_id, value);
     points_pending++;
   }
 
@@ -173,6 +176,8 @@ static void usage(const char *name)
     "       -b                 Simulate batch insert mode (may be slower)\n"
     "       -f <input-file>    File to read time series data from (default: "
     "stdin)\n"
+    "       -s <spool-dir>     Spool batches that a backend fails to write to "
+    "<spool-dir>\n"
     "       -t <ts-backend>    Timeseries backend to use for writing\n",
     name);
   backend_usage();
@@ -233,6 +238,8 @@ int main(int argc, char **argv)
   int i;
 
   char *input_file = "-";
+  char *spool_dir = NULL;
+  timeseries_backend_t *backend;
   io_t *infile = NULL;
   char buffer[BUFFER_LEN];
 
@@ -243,7 +250,7 @@ int main(int argc, char **argv)
     return -1;
   }
 
-  while (prevoptind = optind, (opt = getopt(argc, argv, ":bf:t:v?")) >= 0) {
+  while (prevoptind = optind, (opt = getopt(argc, argv, ":bf:s:t:v?")) >= 0) {
     if (optind == prevoptind + 2 && (optarg == NULL || *optarg == '-')) {
       opt = ':';
       --optind;
@@ -263,6 +270,10 @@ int main(int argc, char **argv)
       input_file = optarg;
       break;
 
+    case 's':
+      spool_dir = optarg;
+      break;
+
     case 't':
       if (ts_backend_cnt >= TIMESERIES_BACKEND_ID_LAST - 1) {
         fprintf(stderr, "ERROR: At most %d backends can be enabled\n",
@@ -308,6 +319,21 @@ int main(int argc, char **argv)
 
   assert(timeseries != NULL);
 
+  if (spool_dir != NULL) {
+    for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+      backend = timeseries_get_all_backends(timeseries)[i];
+      if (backend == NULL || timeseries_backend_is_enabled(backend) == 0) {
+        continue;
+      }
+      if (timeseries_enable_spool(timeseries, backend, spool_dir,
+                                  SPOOL_MAX_SIZE) != 0) {
+        fprintf(stderr, "ERROR: Could not enable spool for %s\n",
+                timeseries_backend_get_name(backend));
+        goto err;
+      }
+    }
+  }
+
   if (batch_mode != 0) {
     fprintf(stderr, "INFO: Using batch mode (Key Package)\n");
     if ((kp = timeseries_kp_init(timeseries, 1)) == NULL) {
@@ -343,6 +369,11 @@ int main(int argc, char **argv)
     }
   }
 
+  if (batch_mode == 0 && timeseries_flush(timeseries) != 0) {
+    fprintf(stderr, "ERROR: Could not flush buffered values\n");
+    goto err;
+  }
+
   /* free the kp */
   timeseries_kp_free(&kp);
   /* free timeseries, backends will be free'd */
@@ -104,8 +104,27 @@
 // When passed as an argument to maybe_flush(), it forces the function to flush.
 #define FORCE_FLUSH 0
 
-// The protocol version that we expect.
+// The protocol versions that we understand.
 #define TSKBATCH_VERSION 0
+#define TSKBATCH_VERSION_V1 1
+
+// Version 1 header flag: the message contains delta-encoded values.
+#define TSKBATCH_FLAG_DELTA 0x01
+
+// Version 1 header flag: records identify keys by their ID in a key
+// dictionary.
+#define TSKBATCH_FLAG_IDS 0x02
+
+// Key dictionaries that have not been used for this many seconds (of message
+// time) are dropped.
+#define DICT_EXPIRY 3600
+
+// Marks a dictionary ID that is not (yet) defined, or whose key is filtered.
+#define DICT_ID_UNKNOWN -1
+#define DICT_ID_FILTERED -2
+
+// Maximum length of a (LEB128) varint in a version 1 message.
+#define VARINT_MAX_LEN 10
 
 // Number of header bytes that we skip when parsing an TSK message.
 #define HEADER_MAGIC_LEN 8
@@ -116,9 +135,6 @@
 // Timeout for kafka consumer poll in milliseconds.
 #define KAFKA_POLL_TIMEOUT 1 * 1000
 
-// Buffer length to hold key package keys.
-#define KEY_BUF_LEN 1024
-
 // Log levels.  DEBUG is the most verbose and ERROR the most silent.
 #define LOG_LEVEL_ERROR 0
 #define LOG_LEVEL_INFO 1
@@ -151,16 +167,61 @@ typedef struct tsk_config {
 // References to our two timeseries objects.
 static timeseries_t *timeseries = NULL;
 static timeseries_t *stats_timeseries = NULL;
+static timeseries_backend_t *timeseries_backend = NULL;
 
 // Key packages for our active probing data and for statistics.
 static timeseries_kp_t *kp = NULL;
 static timeseries_kp_t *stats_kp = NULL;
 
+// Statistics that we keep track of (indexes into stats_names/stats_key_ids).
+typedef enum {
+  STAT_FLUSH_CNT,
+  STAT_FLUSHED_KEY_CNT,
+  STAT_MESSAGES_CNT,
+  STAT_MESSAGES_BYTES,
+  STAT_DELTA_MISSED_CNT,
+  STAT_DICT_MISSED_CNT,
+  STAT_CNT,
+} stat_t;
+
+// Key suffixes of our statistics (the key prefix is stats_key_prefix).
+static const char *stats_names[STAT_CNT] = {
+  "flush_cnt",
+  "flushed_key_cnt",
+  "messages_cnt",
+  "messages_bytes",
+  "delta_missed_cnt",
+  "dict_missed_cnt",
+};
+
 // Statistics-related variables.
+static int stats_key_ids[STAT_CNT];
 static char *stats_key_prefix = NULL;
 static int stats_interval = 0;
 static int stats_time = 0;
 
+// The last value (and the time of the message it was in) of each key in kp,
+// used to resolve delta-encoded values in version 1 messages.
+static uint64_t *last_values = NULL;
+static uint32_t *last_times = NULL;
+static uint32_t last_alloc = 0;
+
+// The previous key of the version 1 message being parsed.
+static char v1_key[UINT16_MAX];
+
+// Maps the key IDs of a producer's key dictionary to IDs in kp.
+typedef struct key_dict {
+  uint32_t dict_id;
+  int *kp_ids;
+  uint32_t alloc;
+  uint32_t last_used;
+} key_dict_t;
+
+// The key dictionaries that we have seen (there is one per producer KP, so
+// there are few of them).
+static key_dict_t *dicts = NULL;
+static int dicts_cnt = 0;
+
 // 0 = ERROR, 1 = INFO, 2 = DEBUG.
 static int log_level = 0;
 
@@ -209,37 +270,35 @@ char *graphite_safe_node(char *str)
   return str;
 }
 
-void inc_stat(const char *stats_key_suffix, const int value)
+void inc_stat(stat_t stat, const int value)
 {
-  int key_id = 0;
-  int old_value = 0;
-  char *stats_key = NULL;
-
   assert(value > 0);
+  timeseries_kp_add(stats_kp, stats_key_ids[stat], value);
+}
 
-  if (asprintf(&stats_key, "%s.%s", stats_key_prefix, stats_key_suffix) < 0) {
-    // error -- should log and return an error code XXX
-    return;
-  }
+/** Returns 1 if the key should be written to the key package */
+static int key_matches(const tsk_config_t *cfg, const char *key, size_t keylen)
+{
+  int i;
 
-  if ((key_id = timeseries_kp_get_key(stats_kp, stats_key)) == -1) {
-    key_id = timeseries_kp_add_key(stats_kp, stats_key);
+  // If we have filters enabled, check if this key matches a filter
+  if (cfg->filters_cnt == 0) {
+    return 1;
   }
-
-  old_value = timeseries_kp_get(stats_kp, key_id);
-  timeseries_kp_set(stats_kp, key_id, value + old_value);
-
-  free(stats_key);
+  for (i = 0; i < cfg->filters_cnt; i++) {
+    if (keylen >= cfg->filter_lens[i] &&
+        memcmp(cfg->filters[i], key, cfg->filter_lens[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
 }
 
 int parse_key_value(const tsk_config_t *cfg, uint8_t **buf, ssize_t *remain)
 {
   uint16_t keylen = 0;
   uint64_t value = 0;
-  int key_id = 0;
-  char key[KEY_BUF_LEN];
-  int match;
-  int i;
+  const char *key = NULL;
 
   // Get 2-byte key length (network byte-ordered).
   DESERIALIZE_VAL(*buf, *remain, keylen);
@@ -252,9 +311,9 @@ int parse_key_value(const tsk_config_t *cfg, uint8_t **buf, ssize_t *remain)
     return 1;
   }
 
-  // Get variable-length key.  We have to 0-terminate the key ourselves.
-  memcpy(key, *buf, keylen);
-  key[keylen] = '\0';
+  // Get variable-length key.  This is not 0-terminated, but the key package
+  // can use it in place.
+  key = (const char *)*buf;
   *buf += keylen;
   *remain -= keylen;
 
@@ -262,29 +321,289 @@ int parse_key_value(const tsk_config_t *cfg, uint8_t **buf, ssize_t *remain)
   DESERIALIZE_VAL(*buf, *remain, value);
   value = ntohll(value);
 
-  // If we have filters enabled, check if this key matches a filter
-  if (cfg->filters_cnt) {
-    match = 0;
-    for (i = 0; i < cfg->filters_cnt; i++) {
-      if (keylen >= cfg->filter_lens[i] &&
-          strncmp(cfg->filters[i], key, cfg->filter_lens[i]) == 0) {
-        match = 1;
-        break;
-      }
+  if (!key_matches(cfg, key, keylen)) {
+    return 0;
+  }
+
+  // Write key:val pair to key package (this also enables the key).
+  if (timeseries_kp_upsert(kp, key, keylen, value, 0) == -1) {
+    LOG_ERROR("Could not add key %.*s to key package.\n", keylen, key);
+    return 1;
+  }
+
+  return 0;
+}
+
+/** Read a (LEB128) varint, returns 0 on success, 1 if it is malformed */
+static int read_varint(uint8_t **buf, ssize_t *remain, uint64_t *value)
+{
+  int i;
+
+  *value = 0;
+  for (i = 0; i < VARINT_MAX_LEN && i < *remain; i++) {
+    *value |= (uint64_t)((*buf)[i] & 0x7f) << (7 * i);
+    if (((*buf)[i] & 0x80) == 0) {
+      *buf += i + 1;
+      *remain -= i + 1;
+      return 0;
+    }
+  }
+  LOG_ERROR("Malformed varint (%d bytes remain).\n", (int)*remain);
+  return 1;
+}
+
+/** Remember the last value written for the given key
+ *
+ * Values older than the remembered one (e.g. from a flush that the producer
+ * spooled and replayed later) are ignored, since newer deltas are relative to
+ * the newer value.
+ */
+static int remember_value(int id, uint64_t value, uint32_t time)
+{
+  uint32_t new_alloc;
+  void *tmp;
+
+  if ((uint32_t)id >= last_alloc) {
+    new_alloc = (last_alloc == 0) ? 1024 : last_alloc;
+    while (new_alloc <= (uint32_t)id) {
+      new_alloc *= 2;
+    }
+    if ((tmp = realloc(last_values, sizeof(uint64_t) * new_alloc)) == NULL) {
+      return -1;
+    }
+    last_values = tmp;
+    if ((tmp = realloc(last_times, sizeof(uint32_t) * new_alloc)) == NULL) {
+      return -1;
+    }
+    last_times = tmp;
+    // a time of 0 never matches a delta base time
+    memset(&last_times[last_alloc], 0,
+           sizeof(uint32_t) * (new_alloc - last_alloc));
+    last_alloc = new_alloc;
+  }
+
+  if (time < last_times[id]) {
+    return 0;
+  }
+  last_values[id] = value;
+  last_times[id] = time;
+  return 0;
+}
+
+/** Find (or create) the key dictionary with the given ID */
+static key_dict_t *get_dict(uint32_t dict_id, uint32_t time)
+{
+  key_dict_t *dict = NULL;
+  void *tmp;
+  int i;
+
+  for (i = 0; i < dicts_cnt; i++) {
+    if (dicts[i].dict_id == dict_id) {
+      dict = &dicts[i];
+    } else if (dicts[i].last_used + DICT_EXPIRY < time) {
+      // this producer has gone away (or restarted with a new dictionary)
+      LOG_INFO("Dropping unused key dictionary %08" PRIx32 ".\n",
+               dicts[i].dict_id);
+      free(dicts[i].kp_ids);
+      dicts[i--] = dicts[--dicts_cnt];
     }
-    if (!match) {
+  }
+
+  if (dict == NULL) {
+    LOG_INFO("New key dictionary %08" PRIx32 ".\n", dict_id);
+    if ((tmp = realloc(dicts, sizeof(key_dict_t) * (dicts_cnt + 1))) == NULL) {
+      return NULL;
+    }
+    dicts = tmp;
+    dict = &dicts[dicts_cnt++];
+    memset(dict, 0, sizeof(key_dict_t));
+    dict->dict_id = dict_id;
+  }
+
+  dict->last_used = time;
+  return dict;
+}
+
+/** Map a dictionary key ID to the given KP ID */
+static int dict_define(key_dict_t *dict, uint64_t id, int kp_id)
+{
+  uint64_t new_alloc;
+  void *tmp;
+
+  if (id >= dict->alloc) {
+    new_alloc = (dict->alloc == 0) ? 1024 : dict->alloc;
+    while (new_alloc <= id) {
+      new_alloc *= 2;
+    }
+    if (new_alloc > UINT32_MAX ||
+        (tmp = realloc(dict->kp_ids, sizeof(int) * new_alloc)) == NULL) {
+      return -1;
+    }
+    dict->kp_ids = tmp;
+    while (dict->alloc < new_alloc) {
+      dict->kp_ids[dict->alloc++] = DICT_ID_UNKNOWN;
+    }
+  }
+
+  dict->kp_ids[id] = kp_id;
+  return 0;
+}
+
+/** Parse the value of a version 1 record whose key was defined earlier. This
+    needs neither a copy nor a hash lookup of the key */
+static int parse_id_value(uint8_t **buf, ssize_t *remain, uint64_t dict_key,
+                          int is_delta, uint32_t time, uint32_t base_time,
+                          key_dict_t *dict)
+{
+  uint64_t value = 0;
+  int id;
+
+  if (read_varint(buf, remain, &value) != 0) {
+    return 1;
+  }
+
+  if (dict_key >= dict->alloc ||
+      (id = dict->kp_ids[dict_key]) == DICT_ID_UNKNOWN) {
+    // we missed the definition, it will be re-published eventually
+    inc_stat(STAT_DICT_MISSED_CNT, 1);
+    return 0;
+  }
+  if (id == DICT_ID_FILTERED) {
+    return 0;
+  }
+
+  if (is_delta) {
+    // we can only apply the delta if we saw the value it is relative to
+    if ((uint32_t)id >= last_alloc || last_times[id] != base_time) {
+      inc_stat(STAT_DELTA_MISSED_CNT, 1);
       return 0;
     }
+    value = last_values[id] + ((value >> 1) ^ -(value & 1));
   }
 
-  // Write key:val pair to key package.
-  if ((key_id = timeseries_kp_get_key(kp, key)) == -1) {
-    key_id = timeseries_kp_add_key(kp, key);
+  // Write the value to the key package (and enable the key)
+  timeseries_kp_enable_key(kp, id);
+  timeseries_kp_set(kp, id, value);
+
+  if (remember_value(id, value, time) != 0) {
+    LOG_ERROR("Could not allocate delta state.\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+/** Parse a version 1 record. The key is front-coded against the previous key
+    in the message (held in v1_key), and the value may be a (zigzag-encoded)
+    delta from the value the key had at base_time. If dict is not NULL, the
+    record starts with the key's ID in dict, and only carries the key if it
+    (re-)defines the ID */
+int parse_key_value_v1(const tsk_config_t *cfg, uint8_t **buf, ssize_t *remain,
+                       size_t *keylen, int64_t *prev_id, uint32_t time,
+                       uint32_t base_time, key_dict_t *dict)
+{
+  uint64_t gap = 0;
+  uint64_t dict_key = 0;
+  uint64_t prefix = 0;
+  uint64_t suffix = 0;
+  uint64_t value = 0;
+  int is_delta;
+  int id;
+
+  if (dict != NULL) {
+    if (read_varint(buf, remain, &gap) != 0) {
+      return 1;
+    }
+    // the ID is encoded as the (zigzag-encoded) gap from the ID following
+    // the previous ID in the message
+    *prev_id += 1 + (int64_t)((gap >> 3) ^ -((gap >> 2) & 1));
+    if (*prev_id < 0 || *prev_id >= UINT32_MAX) {
+      LOG_ERROR("Malformed key ID (%" PRId64 ").\n", *prev_id);
+      return 1;
+    }
+    dict_key = *prev_id;
+    is_delta = gap & 1;
+    if ((gap & 2) == 0) {
+      // the key was defined by an earlier message
+      return parse_id_value(buf, remain, dict_key, is_delta, time, base_time,
+                            dict);
+    }
+    if (read_varint(buf, remain, &prefix) != 0) {
+      return 1;
+    }
   } else {
-    timeseries_kp_enable_key(kp, key_id);
+    if (read_varint(buf, remain, &prefix) != 0) {
+      return 1;
+    }
+    is_delta = prefix & 1;
+    prefix >>= 1;
+  }
+  if (read_varint(buf, remain, &suffix) != 0) {
+    return 1;
   }
 
-  timeseries_kp_set(kp, key_id, value);
+  if (prefix > *keylen || suffix > sizeof(v1_key) - prefix ||
+      (ssize_t)suffix > *remain) {
+    LOG_ERROR("Malformed key (prefix %" PRIu64 ", suffix %" PRIu64
+              ", %d bytes remain).\n",
+              prefix, suffix, (int)*remain);
+    return 1;
+  }
+  memcpy(v1_key + prefix, *buf, suffix);
+  *buf += suffix;
+  *remain -= suffix;
+  *keylen = prefix + suffix;
+
+  if (read_varint(buf, remain, &value) != 0) {
+    return 1;
+  }
+
+  if (!key_matches(cfg, v1_key, *keylen)) {
+    if (dict != NULL && dict_define(dict, dict_key, DICT_ID_FILTERED)) {
+      LOG_ERROR("Could not allocate key dictionary.\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  if (is_delta) {
+    // we can only apply the delta if we saw the value it is relative to
+    if ((id = timeseries_kp_get_key_n(kp, v1_key, *keylen)) == -1 ||
+        (uint32_t)id >= last_alloc || last_times[id] != base_time) {
+      inc_stat(STAT_DELTA_MISSED_CNT, 1);
+      if (dict == NULL) {
+        return 0;
+      }
+      // only the value is lost, later records may still use the definition
+      if (id == -1 &&
+          (id = timeseries_kp_add_key_n(kp, v1_key, *keylen)) != -1) {
+        timeseries_kp_disable_key(kp, id);
+      }
+      if (id == -1 || dict_define(dict, dict_key, id) != 0) {
+        LOG_ERROR("Could not define key %.*s.\n", (int)*keylen, v1_key);
+        return 1;
+      }
+      return 0;
+    }
+    value = last_values[id] + ((value >> 1) ^ -(value & 1));
+  }
+
+  // Write key:val pair to key package (this also enables the key).
+  if ((id = timeseries_kp_upsert(kp, v1_key, *keylen, value, 0)) == -1) {
+    LOG_ERROR("Could not add key %.*s to key package.\n", (int)*keylen,
+              v1_key);
+    return 1;
+  }
+
+  if (remember_value(id, value, time) != 0) {
+    LOG_ERROR("Could not allocate delta state.\n");
+    return 1;
+  }
+
+  if (dict != NULL && dict_define(dict, dict_key, id) != 0) {
+    LOG_ERROR("Could not allocate key dictionary.\n");
+    return 1;
+  }
 
   return 0;
 }
@@ -302,8 +621,8 @@ int maybe_flush(const int flush_time)
       LOG_INFO("%sFlushing key packages at %d with %d keys enabled (%d total).\n",
                (flush_time == FORCE_FLUSH) ? "(Force-)" : "", current_time,
                timeseries_kp_enabled_size(kp), timeseries_kp_size(kp));
-      inc_stat("flush_cnt", 1);
-      inc_stat("flushed_key_cnt", timeseries_kp_enabled_size(kp));
+      inc_stat(STAT_FLUSH_CNT, 1);
+      inc_stat(STAT_FLUSHED_KEY_CNT, timeseries_kp_enabled_size(kp));
 
       if (timeseries_kp_flush(kp, current_time) == -1) {
         LOG_ERROR("Could not flush key package.\n");
@@ -324,6 +643,11 @@ static void maybe_flush_stats()
 
   if (now >= (stats_time + stats_interval)) {
     LOG_DEBUG("Flushing stats at %d.\n", stats_time);
+    // Include the statistics of the backend we write to (e.g. librdkafka's).
+    if (timeseries_kp_add_backend_stats(stats_kp, timeseries_backend,
+                                        stats_key_prefix) != 0) {
+      LOG_ERROR("Could not get timeseries backend stats.\n");
+    }
     if (timeseries_kp_flush(stats_kp, stats_time) == -1) {
       LOG_ERROR("Could not flush stats key packages.\n");
       return;
@@ -335,8 +659,14 @@ static void maybe_flush_stats()
 int handle_message(const rd_kafka_message_t *rkmessage, const tsk_config_t *cfg)
 {
   uint8_t version = 0;
+  uint8_t flags = 0;
   uint32_t time = 0;
+  uint32_t base_time = 0;
+  uint32_t dict_id = 0;
+  key_dict_t *dict = NULL;
   uint16_t chanlen = 0;
+  size_t keylen = 0;
+  int64_t prev_id = -1;
   uint8_t *buf = rkmessage->payload;
   ssize_t remain, len;
   remain = len = rkmessage->len;
@@ -350,8 +680,10 @@ int handle_message(const rd_kafka_message_t *rkmessage, const tsk_config_t *cfg)
   buf += HEADER_MAGIC_LEN;
 
   // Check version (1 byte)
-  if ((version = *(buf++)) != TSKBATCH_VERSION) {
-    LOG_ERROR("Expected version %d but got %d.\n", TSKBATCH_VERSION, version);
+  if ((version = *(buf++)) != TSKBATCH_VERSION &&
+      version != TSKBATCH_VERSION_V1) {
+    LOG_ERROR("Expected version %d or %d but got %d.\n", TSKBATCH_VERSION,
+              TSKBATCH_VERSION_V1, version);
     return 0;
   }
   // Extract time (4 bytes, network byte-order)
@@ -384,14 +716,50 @@ int handle_message(const rd_kafka_message_t *rkmessage, const tsk_config_t *cfg)
   buf += chanlen;
   remain -= chanlen;
 
+  // version 1 adds flags, and the time that deltas are relative to
+  if (version == TSKBATCH_VERSION_V1) {
+    if (remain < sizeof(flags)) {
+      LOG_ERROR("Truncated message received, skipping (%d bytes)\n", len);
+      return 0;
+    }
+    flags = *(buf++);
+    remain -= sizeof(flags);
+    if ((flags & TSKBATCH_FLAG_DELTA) != 0) {
+      if (remain < sizeof(base_time)) {
+        LOG_ERROR("Truncated message received, skipping (%d bytes)\n", len);
+        return 0;
+      }
+      memcpy(&base_time, buf, sizeof(base_time));
+      buf += sizeof(base_time);
+      remain -= sizeof(base_time);
+      base_time = ntohl(base_time);
+    }
+    if ((flags & TSKBATCH_FLAG_IDS) != 0) {
+      if (remain < sizeof(dict_id)) {
+        LOG_ERROR("Truncated message received, skipping (%d bytes)\n", len);
+        return 0;
+      }
+      memcpy(&dict_id, buf, sizeof(dict_id));
+      buf += sizeof(dict_id);
+      remain -= sizeof(dict_id);
+      if ((dict = get_dict(ntohl(dict_id), time)) == NULL) {
+        LOG_ERROR("Could not allocate key dictionary.\n");
+        return -1;
+      }
+    }
+  }
+
   if (maybe_flush(time) != 0) {
     return -1;
   }
-  inc_stat("messages_cnt", 1);
-  inc_stat("messages_bytes", len);
+  inc_stat(STAT_MESSAGES_CNT, 1);
+  inc_stat(STAT_MESSAGES_BYTES, len);
 
   while (remain > 0) {
-    if (parse_key_value(cfg, &buf, &remain) != 0) {
+    if ((version == TSKBATCH_VERSION
+           ? parse_key_value(cfg, &buf, &remain)
+           : parse_key_value_v1(cfg, &buf, &remain, &keylen, &prev_id,
+                                time, base_time, dict)) != 0) {
       // this is an error, but not a fatal one
       return 0;
     }
@@ -502,6 +870,7 @@ int init_timeseries(const tsk_config_t *cfg)
     LOG_ERROR("Failed to initialize backend.\n");
     return 1;
   }
+  timeseries_backend = backend;
 
   if ((kp = timeseries_kp_init(timeseries, TIMESERIES_KP_DISABLE)) == NULL) {
     LOG_ERROR("Could not create key packages.\n");
@@ -514,6 +883,8 @@ int init_timeseries(const tsk_config_t *cfg)
 int init_stats_timeseries(const tsk_config_t *cfg)
 {
   timeseries_backend_t *backend = NULL;
+  char *stats_key = NULL;
+  int i;
 
   LOG_INFO("Initializing stats timeseries.\n");
 
@@ -541,6 +912,20 @@ int init_stats_timeseries(const tsk_config_t *cfg)
     return 1;
   }
 
+  // Add all of our stats keys up front so that updating a stat is cheap.
+  for (i = 0; i < STAT_CNT; i++) {
+    if (asprintf(&stats_key, "%s.%s", stats_key_prefix, stats_names[i]) < 0) {
+      LOG_ERROR("Could not create stats key for %s.\n", stats_names[i]);
+      return 1;
+    }
+    stats_key_ids[i] = timeseries_kp_add_key(stats_kp, stats_key);
+    free(stats_key);
+    if (stats_key_ids[i] == -1) {
+      LOG_ERROR("Could not add stats key for %s.\n", stats_names[i]);
+      return 1;
+    }
+  }
+
   stats_time = STATS_INTERVAL_NOW;
 
   return 0;
@@ -816,6 +1201,7 @@ int main(int argc, char **argv)
 {
   rd_kafka_t *kafka = NULL;
   tsk_config_t *cfg = NULL;
+  int i;
 
   signal(SIGINT, catch_sigint);
 
@@ -856,6 +1242,12 @@ int main(int argc, char **argv)
   rd_kafka_destroy(kafka);
   timeseries_kp_free(&kp);
   timeseries_kp_free(&stats_kp);
+  free(last_values);
+  free(last_times);
+  for (i = 0; i < dicts_cnt; i++) {
+    free(dicts[i].kp_ids);
+  }
+  free(dicts);
   timeseries_free(&timeseries);
   timeseries_free(&stats_timeseries);
   destroy_tsk_config(cfg);